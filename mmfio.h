@@ -27,7 +27,16 @@
 #ifndef INCLUDE_MMFIO_H
 #define INCLUDE_MMFIO_H
 
+// The POSIX implementation needs functions and constants that strict C modes
+// hide (pread, ftruncate, madvise, MAP_ANONYMOUS, clock_gettime and the like).
+// They are requested here, which only works if mmfio.h is included before
+// any system header in the file that defines MMFIO_IMPLEMENTATION.
+#if defined(MMFIO_IMPLEMENTATION) && !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -35,16 +44,384 @@ extern "C" {
 
 typedef struct MMFILE_impl MMFILE;                         // Opaque file definition
 
-MMFILE* mmfopen(const char* name, const char* mode);       // Opens a specified file, in memory-mapped fashion
+MMFILE* mmfopen(const char* name, const char* mode);       // Opens a specified file, in memory-mapped fashion ("r" to read, "r+" to read and write; add "l" to read it into memory instead, "f" to keep it from forked children, "d" to leave it out of core dumps)
+MMFILE* mmfcreate(const char* name, size_t size);          // Creates (or truncates) a file of the specified size and maps it for reading and writing
 void* mmfdata(MMFILE* mmf);                                // Returns a pointer to memory-mapped data
 size_t mmfsize(MMFILE* mmf);                               // Returns a number of bytes available at memory-mapped file location
+int mmfflush(MMFILE* mmf);                                 // Writes modified pages back to the file, returns 0 on success
+int mmfadvise(MMFILE* mmf, size_t offset, size_t len, int advice); // Hints expected access to a byte range (len 0 means up to the end), returns 0 on success
 void mmfclose(MMFILE* mmf);                                // Closes a memory-mapped file
 const char* mmferror(void);                                // Returns text description of last error happened with memory-mapped I/O
 
+MMFILE* mmfopen_concat(const char* const* names, size_t n); // Opens several files as one contiguous read-only memory-mapped range
+
+#define MMF_ADVICE_NORMAL 0                                // No special treatment
+#define MMF_ADVICE_SEQUENTIAL 1                            // Range will be read front to back: read ahead aggressively
+#define MMF_ADVICE_RANDOM 2                                // Range will be read at random: do not read ahead
+#define MMF_ADVICE_WILLNEED 3                              // Range will be needed soon: start reading it in
+#define MMF_ADVICE_DONTNEED 4                              // Range is not needed for now: its pages may be dropped
+#define MMF_ADVICE_HUGEPAGE 5                              // Range is hot and large: back it with huge pages where the system can
+#define MMF_ADVICE_DONTFORK 6                              // Range is not inherited by forked children, which keeps fork() fast (Linux)
+#define MMF_ADVICE_DOFORK 7                                // Range is inherited by forked children again (Linux)
+#define MMF_ADVICE_DONTDUMP 8                              // Range is left out of core dumps
+#define MMF_ADVICE_DODUMP 9                                // Range is included in core dumps again
+#define MMF_ADVICE_WIPEONFORK 10                           // Range reads as zeros in forked children, for anonymous mappings only (Linux)
+
+typedef struct MMFPACKW_impl MMFPACKW;                     // Opaque pack archive builder
+typedef struct MMFPACK_impl MMFPACK;                       // Opaque pack archive reader
+
+MMFPACKW* mmfpack_create(const char* name);                // Starts building a pack archive at the specified path
+int mmfpack_add(MMFPACKW* w, const char* key, const void* data, size_t size); // Appends a named blob to the archive being built
+int mmfpack_finish(MMFPACKW* w);                           // Writes the name index and releases the builder, returns 0 on success
+MMFPACK* mmfpack_open(const char* name);                   // Opens a pack archive, in memory-mapped fashion
+const void* mmfpack_get(MMFPACK* pack, const char* key, size_t* size); // Returns a pointer to the named blob, or NULL if there is none
+size_t mmfpack_count(MMFPACK* pack);                       // Returns a number of blobs in the archive
+void mmfpack_close(MMFPACK* pack);                         // Closes a pack archive
+
+typedef struct MMFTAR_impl MMFTAR;                         // Opaque tar archive index
+
+MMFTAR* mmftar_open(const char* name);                     // Opens an uncompressed tar archive and indexes its regular files
+size_t mmftar_count(MMFTAR* tar);                          // Returns a number of regular files in the archive
+const char* mmftar_name(MMFTAR* tar, size_t i);            // Returns a full path of i-th member
+const void* mmftar_data(MMFTAR* tar, size_t i, size_t* size); // Returns a pointer to i-th member contents inside the mapping
+size_t mmftar_find(MMFTAR* tar, const char* name);         // Returns an index of the named member, or mmftar_count() if there is none
+void mmftar_close(MMFTAR* tar);                            // Closes a tar archive
+
+typedef struct { uint64_t lo, hi; } MMFHASH;               // 128-bit content hash
+typedef struct MMFSTORE_impl MMFSTORE;                     // Opaque content-addressed blob store
+
+MMFHASH mmfhash128(const void* data, size_t size);         // Computes a 128-bit hash, the same one the blob store uses as a key
+MMFSTORE* mmfstore_open(const char* dir, size_t segment_size); // Opens or creates a blob store inside an existing directory
+int mmfstore_put(MMFSTORE* store, const void* data, size_t size, MMFHASH* key); // Stores a blob unless an identical one is present, returns 0 on success
+const void* mmfstore_get(MMFSTORE* store, MMFHASH key, size_t* size); // Returns a pointer to the stored blob, or NULL if there is none
+int mmfstore_flush(MMFSTORE* store);                       // Writes the index and segments back to disk, returns 0 on success
+void mmfstore_close(MMFSTORE* store);                      // Closes a blob store
+
+typedef struct MMFSSTW_impl MMFSSTW;                       // Opaque sorted string table builder
+typedef struct MMFSST_impl MMFSST;                         // Opaque sorted string table reader
+typedef struct MMFSSTITER_impl MMFSSTITER;                 // Opaque sorted string table range iterator
+
+MMFSSTW* mmfsst_create(const char* name, size_t block_size, unsigned bloom_bits_per_key); // Starts building a table, bloom filter is omitted when bits are 0
+int mmfsst_add(MMFSSTW* w, const void* key, size_t keylen, const void* value, size_t valuelen); // Appends an entry, keys must be strictly ascending
+int mmfsst_finish(MMFSSTW* w);                             // Writes the block index and filter and releases the builder, returns 0 on success
+MMFSST* mmfsst_open(const char* name);                     // Opens a sorted string table, in memory-mapped fashion
+const void* mmfsst_get(MMFSST* t, const void* key, size_t keylen, size_t* valuelen); // Returns a pointer to the value, or NULL if the key is absent
+MMFSSTITER* mmfsst_seek(MMFSST* t, const void* key, size_t keylen); // Starts a range scan at the first key not less than the specified one (NULL for the first key)
+int mmfsst_next(MMFSSTITER* it, const void** key, size_t* keylen, const void** value, size_t* valuelen); // Returns the next entry of a range scan, 0 when there are no more
+void mmfsst_iter_close(MMFSSTITER* it);                    // Ends a range scan
+size_t mmfsst_count(MMFSST* t);                            // Returns a number of entries in the table
+void mmfsst_close(MMFSST* t);                              // Closes a sorted string table
+
+#define MMF_FILTER_BLOOM 1                                 // Blocked bloom filter: a query reads one 64-byte block
+#define MMF_FILTER_FUSE8 2                                 // Binary fuse filter with 8-bit fingerprints: 9 bits per key, three reads per query
+
+typedef struct MMFFILTER_impl MMFFILTER;                   // Opaque approximate membership filter
+
+uint64_t mmfhash64(const void* data, size_t size);         // Computes a 64-bit hash suitable as a filter key
+int mmffilter_build(const char* name, int kind, const uint64_t* hashes, size_t n, unsigned bits_per_key, int nthreads); // Writes a filter over key hashes (bits per key only apply to bloom; 0 threads means all cores), returns 0 on success
+MMFFILTER* mmffilter_open(const char* name);               // Opens a filter file, in memory-mapped fashion
+int mmffilter_contains(MMFFILTER* f, uint64_t hash);       // Returns 0 if the key is definitely absent, 1 if it may be present
+void mmffilter_close(MMFFILTER* f);                        // Closes a filter file
+
+typedef struct {
+  const void* key;
+  size_t keylen;
+  const void* value;
+  size_t valuelen;
+} MMFPHFITEM;                                              // Key-value pair for a perfect hash table
+typedef struct MMFPHF_impl MMFPHF;                         // Opaque read-only perfect hash table
+
+int mmfphf_build(const char* name, const MMFPHFITEM* items, size_t n, int nthreads); // Writes a minimal perfect hash table (0 threads means all cores), returns 0 on success
+MMFPHF* mmfphf_open(const char* name);                     // Opens a perfect hash table, in memory-mapped fashion
+const void* mmfphf_get(MMFPHF* t, const void* key, size_t keylen, size_t* valuelen); // Returns a pointer to the value, or NULL if the key is absent (1/65536 chance of a false hit)
+size_t mmfphf_count(MMFPHF* t);                            // Returns a number of keys in the table
+void mmfphf_close(MMFPHF* t);                              // Closes a perfect hash table
+
+typedef struct MMFSTREE_impl MMFSTREE;                     // Opaque static search tree over sorted 64-bit keys
+
+int mmfstree_build(const char* name, const uint64_t* keys, size_t n); // Converts an ascending key array into search tree layout, returns 0 on success
+MMFSTREE* mmfstree_open(const char* name);                 // Opens a search tree, in memory-mapped fashion
+size_t mmfstree_lower_bound(MMFSTREE* t, uint64_t key);    // Returns an index (in the original sorted array) of the first key not less than the specified one, or the key count
+void mmfstree_lower_bound_batch(MMFSTREE* t, const uint64_t* keys, size_t count, size_t* out); // Same as above for many keys at once, overlapping their memory accesses
+size_t mmfstree_count(MMFSTREE* t);                        // Returns a number of keys in the tree
+void mmfstree_close(MMFSTREE* t);                          // Closes a search tree
+
+typedef struct MMFTRIEW_impl MMFTRIEW;                     // Opaque string dictionary builder
+typedef struct MMFTRIE_impl MMFTRIE;                       // Opaque string dictionary
+typedef int (*MMFTRIECB)(const char* s, size_t len, void* ctx); // Receives a matching string, returns nonzero to stop the search
+
+MMFTRIEW* mmftrie_create(const char* name);                // Starts building a string dictionary at the specified path
+int mmftrie_add(MMFTRIEW* w, const char* s, size_t len);   // Adds a string, strings must be added in strictly ascending byte order
+int mmftrie_finish(MMFTRIEW* w);                           // Writes the dictionary and releases the builder, returns 0 on success
+MMFTRIE* mmftrie_open(const char* name);                   // Opens a string dictionary, in memory-mapped fashion
+int mmftrie_contains(MMFTRIE* t, const char* s, size_t len); // Returns 1 if the string is in the dictionary, 0 otherwise
+size_t mmftrie_prefix(MMFTRIE* t, const char* prefix, size_t len, MMFTRIECB cb, void* ctx); // Reports strings starting with the prefix in ascending order, returns their number
+size_t mmftrie_fuzzy(MMFTRIE* t, const char* s, size_t len, unsigned maxdist, MMFTRIECB cb, void* ctx); // Reports strings within the edit distance in ascending order, returns their number
+size_t mmftrie_count(MMFTRIE* t);                          // Returns a number of strings in the dictionary
+void mmftrie_close(MMFTRIE* t);                            // Closes a string dictionary
+
+typedef struct MMFIDXW_impl MMFIDXW;                       // Opaque inverted index builder
+typedef struct MMFIDX_impl MMFIDX;                         // Opaque inverted index
+
+MMFIDXW* mmfidx_create(const char* name);                  // Starts building an inverted index at the specified path
+int mmfidx_add(MMFIDXW* w, const char* term, const uint32_t* docs, size_t n); // Adds a posting list of a term, document numbers must be strictly ascending
+int mmfidx_finish(MMFIDXW* w);                             // Writes the term index and releases the builder, returns 0 on success
+MMFIDX* mmfidx_open(const char* name);                     // Opens an inverted index, in memory-mapped fashion
+size_t mmfidx_count(MMFIDX* idx, const char* term);        // Returns a number of documents containing the term
+size_t mmfidx_decode(MMFIDX* idx, const char* term, uint32_t* out); // Decodes a posting list into out (mmfidx_count() elements), returns its length
+size_t mmfidx_intersect(MMFIDX* idx, const char* const* terms, size_t nterms, uint32_t* out); // Writes documents containing all terms into out (room for the rarest term's count), returns their number
+size_t mmfidx_terms(MMFIDX* idx);                          // Returns a number of terms in the index
+void mmfidx_close(MMFIDX* idx);                            // Closes an inverted index
+
+typedef struct {
+  void* base;
+  size_t size;
+  size_t used;
+} MMFARENA;                                                // Caller-owned memory that results are appended to
+typedef struct MMFROARING_impl MMFROARING;                 // Opaque compressed bitmap
+
+int mmfroaring_write(const char* name, const uint32_t* values, size_t n); // Writes strictly ascending values as a bitmap in the portable Roaring format, returns 0 on success
+MMFROARING* mmfroaring_open(const char* name);             // Opens a serialized bitmap file, in memory-mapped fashion
+MMFROARING* mmfroaring_view(const void* data, size_t size); // Uses a serialized bitmap in memory (e.g. a pack blob) in place; the memory must outlive it
+uint64_t mmfroaring_cardinality(MMFROARING* r);            // Returns a number of values in the bitmap
+int mmfroaring_contains(MMFROARING* r, uint32_t value);    // Returns 1 if the value is in the bitmap, 0 otherwise
+uint32_t* mmfroaring_and(MMFROARING* a, MMFROARING* b, MMFARENA* arena, size_t* count); // Appends values in both bitmaps to the arena and returns them (NULL arena only counts them)
+uint32_t* mmfroaring_or(MMFROARING* a, MMFROARING* b, MMFARENA* arena, size_t* count); // Same as above for values in either bitmap
+uint32_t* mmfroaring_andnot(MMFROARING* a, MMFROARING* b, MMFARENA* arena, size_t* count); // Same as above for values in the first bitmap only
+void mmfroaring_close(MMFROARING* r);                      // Closes a bitmap
+
+#define MMF_COL_I32 1                                      // Column of int32_t
+#define MMF_COL_I64 2                                      // Column of int64_t
+#define MMF_COL_F32 3                                      // Column of float
+#define MMF_COL_F64 4                                      // Column of double
+#define MMF_ENC_PLAIN 0                                    // Values are stored as they are
+#define MMF_ENC_FOR 1                                      // Integers are stored as narrow offsets from the column minimum
+#define MMF_ENC_DICT 2                                     // Values are stored as narrow codes into a sorted dictionary of distinct values
+
+typedef struct {
+  int64_t isum, imin, imax;                                // Integer columns only (the sum wraps around on overflow)
+  double fsum, fmin, fmax;                                 // Any column
+} MMFCOLAGG;                                               // Column aggregates
+typedef struct MMFCOLW_impl MMFCOLW;                       // Opaque column file builder
+typedef struct MMFCOL_impl MMFCOL;                         // Opaque column file
+
+MMFCOLW* mmfcol_create(const char* name, size_t nrows);    // Starts building a column file with the specified number of rows
+int mmfcol_add(MMFCOLW* w, const char* colname, int type, int encoding, const void* values); // Appends a column of nrows values of the type, returns 0 on success
+int mmfcol_finish(MMFCOLW* w);                             // Writes the column directory and releases the builder, returns 0 on success
+MMFCOL* mmfcol_open(const char* name);                     // Opens a column file, in memory-mapped fashion
+size_t mmfcol_rows(MMFCOL* c);                             // Returns a number of rows
+size_t mmfcol_columns(MMFCOL* c);                          // Returns a number of columns
+int mmfcol_find(MMFCOL* c, const char* colname);           // Returns an index of the named column, or -1 if there is none
+int mmfcol_type(MMFCOL* c, int col);                       // Returns a type of the column (MMF_COL_*)
+const void* mmfcol_data(MMFCOL* c, int col);               // Returns a pointer to the values of a plain column, or NULL if it is encoded
+int mmfcol_aggregate(MMFCOL* c, int col, int nthreads, MMFCOLAGG* agg); // Computes sum, minimum and maximum of a column (0 threads means all cores), returns 0 on success
+size_t mmfcol_filter(MMFCOL* c, int col, double lo, double hi, uint64_t* bits, int nthreads); // Sets a bit per row with lo <= value <= hi in bits (one bit per row), returns their number
+void mmfcol_close(MMFCOL* c);                              // Closes a column file
+
+#define MMF_NPY_MAXDIM 8                                   // Most dimensions an array may have
+
+typedef struct {
+  const void* data;                                        // First element, inside the mapping
+  char kind;                                               // Element kind: 'f' float, 'i' signed, 'u' unsigned, 'b' bool, 'c' complex
+  size_t itemsize;                                         // Element size in bytes
+  int fortran;                                             // Nonzero if the first index varies fastest
+  int ndim;                                                // Number of dimensions (0 for a scalar)
+  size_t shape[MMF_NPY_MAXDIM];                            // Extent of every dimension
+  ptrdiff_t strides[MMF_NPY_MAXDIM];                       // Distance between neighbours along every dimension, in bytes
+} MMFNPYARRAY;                                             // View of an n-dimensional array
+
+MMFILE* mmfnpy_open(const char* name, MMFNPYARRAY* array);  // Maps a .npy file and describes its array, which lives until mmfclose()
+int mmfnpy_parse(const void* data, size_t size, MMFNPYARRAY* array); // Describes a .npy image in memory, returns 0 on success
+int mmfnpy_raw(const void* data, size_t size, const char* descr, int ndim, const size_t* shape, MMFNPYARRAY* array); // Describes headerless C-order data of a NumPy type (e.g. "<f4"), returns 0 on success
+
+#define MMF_VEC_F32 1                                      // Vector components are float
+#define MMF_VEC_F16 2                                      // Vector components are IEEE half floats
+#define MMF_VEC_I8 3                                       // Vector components are int8_t
+#define MMF_VEC_U8 4                                       // Vector components are uint8_t
+#define MMF_METRIC_DOT 1                                   // Larger dot product is nearer
+#define MMF_METRIC_L2 2                                    // Smaller squared Euclidean distance is nearer
+
+typedef struct {
+  MMFILE* file;                                            // File holding the rows, or NULL
+  const void* data;                                        // First component of the first row
+  int type;                                                // Component type (MMF_VEC_*)
+  size_t dim;                                              // Components per row
+  size_t count;                                            // Number of rows
+  size_t stride;                                           // Distance between rows, in bytes
+} MMFVECS;                                                 // Rows of vectors inside a mapping
+typedef struct {
+  uint64_t index;                                          // Row number
+  float score;                                             // Dot product or squared distance to the query
+} MMFVECHIT;                                               // Search result
+
+int mmfvecs_fvecs(MMFILE* file, MMFVECS* vecs);            // Describes the rows of an .fvecs file, returns 0 on success
+int mmfvecs_bvecs(MMFILE* file, MMFVECS* vecs);            // Describes the rows of a .bvecs file, returns 0 on success
+int mmfvecs_raw(MMFILE* file, size_t offset, int type, size_t dim, MMFVECS* vecs); // Describes headerless rows starting at the offset, returns 0 on success
+size_t mmfvecs_search(const MMFVECS* vecs, const float* query, int metric, size_t k, MMFVECHIT* hits, int nthreads); // Finds the k rows nearest to a float query, best first (0 threads means all cores), returns their number
+
+typedef struct MMFGRAPH_impl MMFGRAPH;                     // Opaque graph in compressed sparse row form
+
+int mmfgraph_build(const char* name, size_t nnodes, const uint32_t* src, const uint32_t* dst, size_t nedges, int transpose); // Writes a graph from an edge list, with in-edges too if transpose is nonzero, returns 0 on success
+MMFGRAPH* mmfgraph_open(const char* name);                 // Opens a graph file, in memory-mapped fashion
+size_t mmfgraph_nodes(MMFGRAPH* g);                        // Returns a number of nodes
+size_t mmfgraph_edges(MMFGRAPH* g);                        // Returns a number of edges
+const uint32_t* mmfgraph_neighbors(MMFGRAPH* g, uint32_t v, size_t* degree); // Returns out-neighbours of a node, or NULL if there is no such node
+const uint32_t* mmfgraph_in_neighbors(MMFGRAPH* g, uint32_t v, size_t* degree); // Returns in-neighbours of a node, or NULL if the file has no in-edges or there is no such node
+size_t mmfgraph_bfs(MMFGRAPH* g, uint32_t source, uint32_t* dist, int nthreads); // Writes hop counts from the source (UINT32_MAX if unreachable) for every node, returns a number of reached nodes
+int mmfgraph_pagerank(MMFGRAPH* g, double damping, int iterations, float* rank, int nthreads); // Writes PageRank of every node (needs in-edges), returns 0 on success
+void mmfgraph_close(MMFGRAPH* g);                          // Closes a graph file
+
+int mmfsort(const char* in, const char* out, size_t record_size, size_t key_offset, size_t key_len, size_t mem_budget); // Sorts fixed-size records of a file by a byte key into another file, using about mem_budget bytes per run, returns 0 on success
+
+typedef uint64_t (*MMFSORTKEY)(const void* record, void* ctx); // Returns a sort key of a record, may be called from several threads at once
+
+int mmfsort_inplace(MMFILE* mmf, size_t record_size, size_t key_offset, size_t key_len, int nthreads); // Sorts fixed-size records of a writable mapping by a byte key (0 threads means all cores), using 32 bytes of memory per record for keys up to 8 bytes if free memory allows, returns 0 on success
+int mmfsort_inplace_by(MMFILE* mmf, size_t record_size, MMFSORTKEY key, void* ctx, int nthreads); // Sorts fixed-size records of a writable mapping by keys from a callback, keeping equal keys in order and using 32 bytes of memory per record, returns 0 on success
+
+typedef struct MMFRECITER_impl MMFRECITER;                 // Opaque length-prefixed record iterator
+typedef int (*MMFRECCB)(const void* rec, size_t len, int tid, void* ctx); // Receives a record on thread tid, returns nonzero to stop the scan
+
+MMFRECITER* mmfrec_iter(const void* data, size_t size, const void* sync, size_t synclen); // Starts iterating over varint length-prefixed records, skipping sync markers (NULL for none)
+int mmfrec_next(MMFRECITER* it, const void** rec, size_t* len); // Returns the next record, 1 on success, 0 at the end, -1 on bad framing
+void mmfrec_iter_close(MMFRECITER* it);                    // Ends iterating over records
+int mmfrec_parallel(const void* data, size_t size, const void* sync, size_t synclen, MMFRECCB cb, void* ctx, int nthreads); // Calls back for every record, splitting the stream at sync markers between threads (0 means all cores), returns 0 on success
+
+int mmfhistogram(MMFILE* mmf, size_t block_size, int nthreads, uint64_t counts[256], double* block_entropy); // Counts every byte value of a file (0 threads means all cores), and if block_entropy is not NULL writes the entropy of each block_size bytes there, returns 0 on success
+double mmfentropy(const uint64_t counts[256]);             // Returns Shannon entropy of a byte histogram, in bits per byte
+
+int mmfz_compress(const char* in, const char* out, size_t block_size); // Writes a block-compressed copy of a file (block size a multiple of 64 KiB, 0 for 256 KiB), which mmfopen() maps with mode "z", returns 0 on success
+int mmfz_budget(MMFILE* mmf, size_t bytes);                // Limits decompressed blocks of a "z" mapping kept in memory (64 MiB by default, never under two blocks), returns 0 on success
+
+typedef struct MMFCACHE_impl MMFCACHE;                     // Opaque cache of mapped file windows
+typedef struct MMFCACHEWIN_impl MMFCACHEWIN;               // Opaque pinned window
+
+MMFCACHE* mmfcache_open(const char* const* names, size_t n, size_t window_size, size_t max_len, size_t budget); // Opens files for windowed access, mapping at most budget bytes of address space at once
+const void* mmfcache_get(MMFCACHE* c, size_t file, uint64_t offset, size_t len, MMFCACHEWIN** win); // Returns a pointer to len (up to max_len) bytes of a file and pins their window until mmfcache_unpin(), or NULL
+void mmfcache_unpin(MMFCACHEWIN* win);                     // Releases a window pinned by mmfcache_get()
+void mmfcache_close(MMFCACHE* c);                          // Unmaps all windows and closes the files
+
+int mmfbudget(size_t bytes);                               // Limits resident pages of all open mappings together (0 for no limit), evicting least recently used ones at once, returns 0 on success
+int mmfbudget_enforce(void);                               // Evicts least recently used mappings until resident pages fit the budget again, returns 0 on success
+int mmfbudget_watch(unsigned stall_ms, unsigned window_ms); // Enforces the budget from a thread every window_ms, and at once when memory stalls exceed stall_ms per window (Linux, 0 for no such trigger); 0 window stops it, returns 0 on success
+void mmftouch(MMFILE* mmf);                                // Marks a mapping as just used, so that the budget evicts it after the others
+size_t mmfresident(void);                                  // Returns a number of resident bytes in all open mappings
+
+#define MMF_LOCK_ONFAULT 1                                 // Lock pages as they are first touched instead of reading the whole range in (Linux only)
+
+int mmflock(MMFILE* mmf, size_t offset, size_t len, int flags); // Keeps a byte range (len 0 means up to the end) in memory, within RLIMIT_MEMLOCK, returns 0 on success
+int mmfunlock(MMFILE* mmf, size_t offset, size_t len);     // Lets a locked byte range be evicted again, returns 0 on success
+int mmflock_hot(MMFILE* mmf, const size_t* samples, size_t nsamples, size_t region_size, size_t topn, int flags); // Locks the topn regions hit most by sampled access offsets and unlocks the rest of the mapping, returns 0 on success
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
 
+#ifdef __cplusplus
+#include <limits>
+
+namespace mmfio {
+
+// Element kind NumPy uses for a C++ type
+template <typename T> struct npykind {
+  static char value() { return std::numeric_limits<T>::is_integer ? (std::numeric_limits<T>::is_signed ? 'i' : 'u') : 'f'; }
+};
+template <> struct npykind<bool> {
+  static char value() { return 'b'; }
+};
+
+// Typed read-only view of a mapped array. A view is invalid (and empty) when
+// the element type does not match T or the data is not aligned for T.
+template <typename T> class npyview {
+public:
+  npyview() : data_(NULL), ndim_(0) {}
+
+  explicit npyview(const MMFNPYARRAY& array) : data_(NULL), ndim_(0)
+  {
+    if (array.data != NULL && array.kind == npykind<T>::value() && array.itemsize == sizeof(T) &&
+        reinterpret_cast<uintptr_t>(array.data) % alignof_T() == 0) {
+      bool aligned = true;
+      for (int d = 0; d < array.ndim; d++) {
+        shape_[d] = array.shape[d];
+        strides_[d] = array.strides[d];
+        if (strides_[d] % static_cast<ptrdiff_t>(alignof_T()) != 0) aligned = false;
+      }
+      if (aligned) {
+        data_ = static_cast<const char*>(array.data);
+        ndim_ = array.ndim;
+      }
+    }
+  }
+
+  bool valid() const { return data_ != NULL; }
+  int ndim() const { return ndim_; }
+  size_t shape(int d) const { return shape_[d]; }
+  ptrdiff_t stride(int d) const { return strides_[d]; }   // In bytes
+
+  size_t size() const
+  {
+    size_t n = data_ != NULL ? 1 : 0;
+    for (int d = 0; d < ndim_; d++) n *= shape_[d];
+    return n;
+  }
+
+  // True if elements are adjacent in index order, so data() can be used as a plain array
+  bool contiguous() const
+  {
+    ptrdiff_t expected = sizeof(T);
+    for (int d = ndim_ - 1; d >= 0; d--) {
+      if (shape_[d] != 1 && strides_[d] != expected) return false;
+      expected *= static_cast<ptrdiff_t>(shape_[d]);
+    }
+    return true;
+  }
+
+  const T* data() const { return reinterpret_cast<const T*>(data_); }
+
+  const T& operator()(size_t i) const { return *reinterpret_cast<const T*>(data_ + i * strides_[0]); }
+  const T& operator()(size_t i, size_t j) const
+  {
+    return *reinterpret_cast<const T*>(data_ + i * strides_[0] + j * strides_[1]);
+  }
+  const T& operator()(size_t i, size_t j, size_t k) const
+  {
+    return *reinterpret_cast<const T*>(data_ + i * strides_[0] + j * strides_[1] + k * strides_[2]);
+  }
+  const T& at(const size_t* index) const
+  {
+    const char* p = data_;
+    for (int d = 0; d < ndim_; d++) p += index[d] * strides_[d];
+    return *reinterpret_cast<const T*>(p);
+  }
+
+  // Sub-array at index i along the first dimension
+  npyview operator[](size_t i) const
+  {
+    npyview sub;
+    sub.data_ = data_ + i * strides_[0];
+    sub.ndim_ = ndim_ - 1;
+    for (int d = 1; d < ndim_; d++) {
+      sub.shape_[d - 1] = shape_[d];
+      sub.strides_[d - 1] = strides_[d];
+    }
+    return sub;
+  }
+
+private:
+  struct alignment_probe {
+    char c;
+    T t;
+  };
+  static size_t alignof_T() { return offsetof(alignment_probe, t); }
+
+  const char* data_;
+  int ndim_;
+  size_t shape_[MMF_NPY_MAXDIM];
+  ptrdiff_t strides_[MMF_NPY_MAXDIM];
+};
+
+} // namespace mmfio
+#endif // __cplusplus
+
 #endif // INCLUDE_MMFIO_H
 
 #if defined(MMFIO_IMPLEMENTATION) && !defined(MMFIO_IMPLEMENTATION_INCLUDED)
@@ -54,9 +431,17 @@ const char* mmferror(void);                                // Returns text descr
 #error Implementation must be compiled with C compiler.
 #endif // __cplusplus
 
+#include <math.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
 
 static char mmferrorbuffer[512] = "";
 static void mmfseterror(const char* fmt, ...)
@@ -72,10 +457,20 @@ const char* mmferror(void)
   return mmferrorbuffer;
 }
 
+#define MMFKIND_MAPPED 0
+#define MMFKIND_CONCAT 1
+#define MMFKIND_COMPRESSED 2
+#define MMFKIND_LOADED 3
+
 #define OPENMODE_INVALID 0
 #define OPENMODE_READONLY 1
 #define OPENMODE_WRITEONLY 2
 #define OPENMODE_READWRITE 3
+#define OPENMODE_COMPRESSED 4
+#define OPENMODE_DONTFORK 8
+#define OPENMODE_DONTDUMP 16
+#define OPENMODE_LOAD 32
+#define OPENMODE_ADVICES (OPENMODE_DONTFORK | OPENMODE_DONTDUMP)
 static int decode_open_mode(const char* mode)
 {
   int i, mask = OPENMODE_INVALID;
@@ -88,12 +483,175 @@ static int decode_open_mode(const char* mode)
       case 'w':
         mask |= OPENMODE_WRITEONLY;
         break;
+
+      case '+':
+        mask |= OPENMODE_READWRITE;
+        break;
+
+      case 'z':
+        mask |= OPENMODE_COMPRESSED;
+        break;
+
+      case 'f':
+        mask |= OPENMODE_DONTFORK;
+        break;
+
+      case 'd':
+        mask |= OPENMODE_DONTDUMP;
+        break;
+
+      case 'l':
+        mask |= OPENMODE_LOAD;
+        break;
     }
   }
 
   return mask;
 }
 
+// ----------------------------------------------------------------------------
+// Block-compressed files, opened with "z". Layout:
+//   header    32 bytes: magic "MMFZBLK1", uncompressed size, number of
+//             blocks, block size (a multiple of 64 KiB so that blocks start
+//             on page boundaries everywhere), reserved
+//   index     nblocks + 1 file offsets; block i lies between the i-th and
+//             the next one
+//   blocks    each compressed with the codec below, or stored as is when
+//             that would not make it smaller (then its length equals the
+//             uncompressed one)
+// The codec is an LZ77 variant in the manner of LZ4: every sequence is a
+// token (literal count and match length minus four, a nibble each, 15
+// meaning that 255-terminated extension bytes follow), the literals, and a
+// 16-bit match distance. The last sequence has literals only.
+// ----------------------------------------------------------------------------
+
+#define MMFZ_ALIGN 65536
+#define MMFZ_HASHBITS 14
+
+struct mmfz_header {
+  char magic[8];
+  uint64_t size;
+  uint64_t nblocks;
+  uint32_t block_size;
+  uint32_t reserved;
+};
+
+static const char mmfz_magic[8] = {'M', 'M', 'F', 'Z', 'B', 'L', 'K', '1'};
+
+static size_t mmfz_bound(size_t n)
+{
+  return n + n / 255 + 16;
+}
+
+static uint32_t mmfz_read32(const unsigned char* p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static unsigned char* mmfz_put_length(unsigned char* out, size_t len)
+{
+  while (len >= 255) {
+    *out++ = 255;
+    len -= 255;
+  }
+  *out++ = (unsigned char)len;
+  return out;
+}
+
+static unsigned char* mmfz_put_sequence(unsigned char* out, const unsigned char* lit, size_t nlit, size_t distance, size_t len)
+{
+  unsigned char* token = out++;
+  *token = (unsigned char)((nlit >= 15 ? 15 : nlit) << 4);
+  if (nlit >= 15) out = mmfz_put_length(out, nlit - 15);
+  memcpy(out, lit, nlit);
+  out += nlit;
+  if (len > 0) {
+    *token |= (unsigned char)(len - 4 >= 15 ? 15 : len - 4);
+    *out++ = (unsigned char)(distance & 255);
+    *out++ = (unsigned char)(distance >> 8);
+    if (len - 4 >= 15) out = mmfz_put_length(out, len - 4 - 15);
+  }
+  return out;
+}
+
+// Compresses n bytes into out, which must hold mmfz_bound(n) bytes, and
+// returns the compressed size. Positions missing a match are skipped
+// faster and faster, so incompressible data goes through quickly.
+static size_t mmfz_compress_block(const unsigned char* in, size_t n, unsigned char* out, uint32_t* table)
+{
+  unsigned char* op = out;
+  size_t anchor = 0, i = 0, misses = 0;
+
+  memset(table, 0xff, sizeof(*table) << MMFZ_HASHBITS);
+  while (i + 4 <= n) {
+    uint32_t seq = mmfz_read32(in + i);
+    uint32_t h = (seq * 2654435761u) >> (32 - MMFZ_HASHBITS);
+    uint32_t candidate = table[h];
+    table[h] = (uint32_t)i;
+    if (candidate != UINT32_MAX && i - candidate <= 65535 && mmfz_read32(in + candidate) == seq) {
+      size_t len = 4;
+      while (i + len < n && in[candidate + len] == in[i + len]) len++;
+      op = mmfz_put_sequence(op, in + anchor, i - anchor, i - candidate, len);
+      i += len;
+      anchor = i;
+      misses = 0;
+    }
+    else i += 1 + (misses++ >> 6);
+  }
+
+  return (size_t)(mmfz_put_sequence(op, in + anchor, n - anchor, 0, 0) - out);
+}
+
+static bool mmfz_get_length(const unsigned char** p, const unsigned char* end, size_t* len)
+{
+  unsigned char b;
+  do {
+    if (*p >= end) return false;
+    b = *(*p)++;
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+// Decompresses a block that must fill out exactly. Uses no allocation and
+// no locks, so it can run inside a signal handler.
+static bool mmfz_decompress_block(const unsigned char* in, size_t n, unsigned char* out, size_t outsize)
+{
+  const unsigned char* ip = in;
+  const unsigned char* iend = in + n;
+  unsigned char* op = out;
+  unsigned char* oend = out + outsize;
+
+  while (ip < iend) {
+    unsigned token = *ip++;
+    size_t nlit = token >> 4, len = token & 15, distance;
+    if (nlit == 15 && !mmfz_get_length(&ip, iend, &nlit)) return false;
+    if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op)) return false;
+    memcpy(op, ip, nlit);
+    op += nlit;
+    ip += nlit;
+    if (ip == iend) break;
+
+    if (iend - ip < 2) return false;
+    distance = (size_t)ip[0] | (size_t)ip[1] << 8;
+    ip += 2;
+    if (len == 15 && !mmfz_get_length(&ip, iend, &len)) return false;
+    len += 4;
+    if (distance == 0 || distance > (size_t)(op - out) || len > (size_t)(oend - op)) return false;
+    if (distance >= len) memcpy(op, op - distance, len);
+    else {
+      // Overlapping copy repeats the last distance bytes
+      size_t k;
+      for (k = 0; k < len; k++) op[k] = op[k - distance];
+    }
+    op += len;
+  }
+
+  return op == oend;
+}
+
 #ifdef _WIN32
 // ============================================================================
 // Windows implementation. Uses CreateFileMapping.
@@ -106,6 +664,7 @@ struct MMFILE_impl {
   HANDLE map;
   void* mem;
   size_t size;
+  int kind;
 };
 
 static const char* GetWindowsErrorString(int errcode)
@@ -138,13 +697,17 @@ static const char* GetWindowsErrorString(int errcode)
 
 #define LASTERROR GetWindowsErrorString(GetLastError())
 
-MMFILE* mmfopen(const char* name, const char* mode)
+static MMFILE* mmfloadfile(const char* name);
+
+// Opens and maps a file. When `create` is set the file is created or
+// truncated and then extended to `createsize` bytes.
+static MMFILE* mmfmapfile(const char* name, int openmode, bool create, size_t createsize)
 {
   MMFILE* ret = NULL;
   struct { DWORD file, mode, page, map; } flags = {0};
   bool openable = false;
 
-  switch (decode_open_mode(mode)) {
+  switch (openmode) {
     case OPENMODE_READONLY:
       flags.file = GENERIC_READ;
       flags.mode = OPEN_EXISTING;
@@ -152,6 +715,14 @@ MMFILE* mmfopen(const char* name, const char* mode)
       flags.map = FILE_MAP_READ;
       openable = true;
       break;
+
+    case OPENMODE_READWRITE:
+      flags.file = GENERIC_READ | GENERIC_WRITE;
+      flags.mode = create ? CREATE_ALWAYS : OPEN_EXISTING;
+      flags.page = PAGE_READWRITE;
+      flags.map = FILE_MAP_WRITE;
+      openable = true;
+      break;
   }
 
   if (openable) {
@@ -161,12 +732,14 @@ MMFILE* mmfopen(const char* name, const char* mode)
       f.file = CreateFileA(name, flags.file, 0, NULL, flags.mode, FILE_ATTRIBUTE_NORMAL, NULL);
       if (f.file != INVALID_HANDLE_VALUE) {
         LARGE_INTEGER filesize;
-        BOOL ok = GetFileSizeEx(f.file, &filesize);
+        BOOL ok = TRUE;
+        if (create) filesize.QuadPart = (LONGLONG)createsize;
+        else ok = GetFileSizeEx(f.file, &filesize);
         if (ok) {
           f.size = (size_t)filesize.QuadPart;
           if (f.size > 0) {
             f.map = CreateFileMappingA(f.file, NULL, flags.page, filesize.HighPart, filesize.LowPart, NULL);
-            if (f.map != INVALID_HANDLE_VALUE) {
+            if (f.map != NULL) {
               f.mem = MapViewOfFile(f.map, flags.map, 0, 0, f.size);
               if (f.mem != NULL) {
                 *fp = f;
@@ -185,6 +758,30 @@ MMFILE* mmfopen(const char* name, const char* mode)
   return ret;
 }
 
+// Mappings are never inherited by child processes nor written to crash
+// dumps on Windows, so the fork and dump mode letters change nothing.
+MMFILE* mmfopen(const char* name, const char* mode)
+{
+  int openmode = decode_open_mode(mode) & ~OPENMODE_ADVICES;
+  if (openmode & OPENMODE_COMPRESSED) {
+    mmfseterror("could not map compressed file: lazy decompression needs Linux");
+    return NULL;
+  }
+  if (openmode & OPENMODE_LOAD) {
+    if (openmode & OPENMODE_WRITEONLY) {
+      mmfseterror("could not load file: loaded files are read-only copies");
+      return NULL;
+    }
+    return mmfloadfile(name);
+  }
+  return mmfmapfile(name, openmode, false, 0);
+}
+
+MMFILE* mmfcreate(const char* name, size_t size)
+{
+  return mmfmapfile(name, OPENMODE_READWRITE, true, size);
+}
+
 void* mmfdata(MMFILE* mmf)
 {
   return mmf->mem;
@@ -195,99 +792,8148 @@ size_t mmfsize(MMFILE* mmf)
   return mmf->size;
 }
 
-void mmfclose(MMFILE* mmf)
+int mmfflush(MMFILE* mmf)
 {
-  CloseHandle(mmf->map);
-  CloseHandle(mmf->file);
-  LocalFree(mmf);
+  int ret = -1;
+  if (mmf->kind == MMFKIND_MAPPED) {
+    if (FlushViewOfFile(mmf->mem, mmf->size)) {
+      if (FlushFileBuffers(mmf->file)) {
+        ret = 0;
+      } else mmfseterror("could not flush file buffers: %s", LASTERROR);
+    } else mmfseterror("could not flush mapping: %s", LASTERROR);
+  } else mmfseterror("could not flush mapping: mapping is not backed by a single file");
+
+  return ret;
 }
 
+// Windows has no per-range read-ahead policy, so only WILLNEED does anything,
+// and only where PrefetchVirtualMemory is available (Windows 8 and later).
+int mmfadvise(MMFILE* mmf, size_t offset, size_t len, int advice)
+{
+  int ret = 0;
+  if (offset > mmf->size) {
+    mmfseterror("could not advise: offset is past the end of mapping");
+    ret = -1;
+  }
+  else {
+    if (len == 0 || len > mmf->size - offset) len = mmf->size - offset;
+#if defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0602
+    if (advice == MMF_ADVICE_WILLNEED && len > 0) {
+      WIN32_MEMORY_RANGE_ENTRY range;
+      range.VirtualAddress = (char*)mmf->mem + offset;
+      range.NumberOfBytes = len;
+      if (!PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0)) {
+        mmfseterror("could not advise: %s", LASTERROR);
+        ret = -1;
+      }
+    }
 #else
-// ============================================================================
-// POSIX implementation. Uses mmap.
-// ============================================================================
+    (void)advice;
+#endif
+  }
 
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <errno.h>
-#include <string.h>
-#include <stdlib.h>
+  return ret;
+}
 
-struct MMFILE_impl {
-  int fd;
-  void* mem;
-  size_t size;
-};
+void mmfclose(MMFILE* mmf)
+{
+  switch (mmf->kind) {
+    case MMFKIND_MAPPED:
+      UnmapViewOfFile(mmf->mem);
+      CloseHandle(mmf->map);
+      CloseHandle(mmf->file);
+      break;
 
-#define LASTERROR strerror(errno)
+    case MMFKIND_CONCAT:
+    case MMFKIND_LOADED:
+      VirtualFree(mmf->mem, 0, MEM_RELEASE);
+      break;
+  }
 
-MMFILE* mmfopen(const char* name, const char* mode)
+  LocalFree(mmf);
+}
+
+// Windows cannot place several file views back to back in one reservation
+// without the placeholder API of Windows 10, so files are read into a single
+// committed region instead.
+MMFILE* mmfopen_concat(const char* const* names, size_t n)
 {
   MMFILE* ret = NULL;
-  MMFILE f;
-  struct { int mode, prot, map; } flags = {0};
-  bool openable = false;
+  size_t* sizes = LocalAlloc(LPTR, (n > 0 ? n : 1) * sizeof(*sizes));
+  size_t i, total = 0;
+  bool ok = sizes != NULL;
 
-  switch (decode_open_mode(mode)) {
-    case OPENMODE_READONLY:
-      flags.mode = O_RDONLY;
-      flags.prot = PROT_READ;
-      flags.map = MAP_PRIVATE;
-      openable = true;
-      break;
+  if (!ok) mmfseterror("could not allocate space for file sizes: %s", LASTERROR);
+  for (i = 0; ok && i < n; i++) {
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (GetFileAttributesExA(names[i], GetFileExInfoStandard, &info)) {
+      sizes[i] = ((size_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+      total += sizes[i];
+    }
+    else {
+      mmfseterror("could not get size of '%s': %s", names[i], LASTERROR);
+      ok = false;
+    }
   }
 
-  if (openable) {
-    MMFILE* fp = calloc(1, sizeof(*fp));
-    if (fp != NULL) {
-      f.fd = open(name, flags.mode);
-      if (f.fd != -1) {
-        struct stat fileinfo;
-        int res = fstat(f.fd, &fileinfo);
-        if (res == 0) {
-          f.size = (size_t)fileinfo.st_size;
-          if (f.size > 0) {
-            f.mem = mmap(NULL, f.size, flags.prot, flags.map, f.fd, 0);
-            if (f.mem != MAP_FAILED) {
-              *fp = f;
-              ret = fp;
-            } else mmfseterror("could not map file: %s", LASTERROR);
-          } else mmfseterror("could not map file: file is empty");
-        } else mmfseterror("could not get file size: %s", LASTERROR);
-        if (ret == NULL) close(f.fd);
-      } else mmfseterror("could not open the file: %s", LASTERROR);
-      if (ret == NULL) free(fp);
-    } else mmfseterror("could not allocate space for MMFILE: %s", LASTERROR);
-  } else mmfseterror("no valid file opening mode flags were provided");
+  if (ok && total == 0) {
+    mmfseterror("could not map files: all files are empty");
+    ok = false;
+  }
+
+  if (ok) {
+    MMFILE* fp = LocalAlloc(LPTR, sizeof(*fp));
+    char* mem = VirtualAlloc(NULL, total, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    size_t pos = 0;
+    for (i = 0; fp != NULL && mem != NULL && ok && i < n; i++) {
+      HANDLE file = CreateFileA(names[i], GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+      if (file != INVALID_HANDLE_VALUE) {
+        size_t done = 0;
+        while (ok && done < sizes[i]) {
+          size_t left = sizes[i] - done;
+          DWORD chunk = left > 0x40000000 ? 0x40000000 : (DWORD)left, got = 0;
+          if (ReadFile(file, mem + pos + done, chunk, &got, NULL) && got > 0) {
+            done += got;
+          }
+          else {
+            mmfseterror("could not read '%s': %s", names[i], LASTERROR);
+            ok = false;
+          }
+        }
+        CloseHandle(file);
+        pos += sizes[i];
+      }
+      else {
+        mmfseterror("could not open the file '%s': %s", names[i], LASTERROR);
+        ok = false;
+      }
+    }
+
+    if (fp == NULL) mmfseterror("could not allocate space for MMFILE: %s", LASTERROR);
+    else if (mem == NULL) mmfseterror("could not allocate space for files: %s", LASTERROR);
+
+    if (fp != NULL && mem != NULL && ok) {
+      DWORD old;
+      VirtualProtect(mem, total, PAGE_READONLY, &old);
+      fp->file = INVALID_HANDLE_VALUE;
+      fp->mem = mem;
+      fp->size = total;
+      fp->kind = MMFKIND_CONCAT;
+      ret = fp;
+    }
+    else {
+      if (mem != NULL) VirtualFree(mem, 0, MEM_RELEASE);
+      if (fp != NULL) LocalFree(fp);
+    }
+  }
 
+  if (sizes != NULL) LocalFree(sizes);
   return ret;
 }
 
-void* mmfdata(MMFILE* mmf)
+// Runs fn(arg, tid, nthreads) for every tid in [0, nthreads), each on its own
+// thread where possible. Work of threads that could not be started is done on
+// the calling thread, so every tid always runs exactly once.
+struct mmf_worker {
+  void (*fn)(void* arg, int tid, int nthreads);
+  void* arg;
+  int tid, nthreads;
+};
+
+static DWORD WINAPI mmf_worker_main(LPVOID p)
 {
-  return mmf->mem;
+  struct mmf_worker* w = p;
+  w->fn(w->arg, w->tid, w->nthreads);
+  return 0;
 }
 
-size_t mmfsize(MMFILE* mmf)
+static int mmf_cpu_count(void)
 {
-  return mmf->size;
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
 }
 
-void mmfclose(MMFILE* mmf)
+static size_t mmf_available_memory(void)
 {
-  munmap(mmf->mem, mmf->size);
-  close(mmf->fd);
-  free(mmf);
+  MEMORYSTATUSEX status;
+  status.dwLength = sizeof(status);
+  if (!GlobalMemoryStatusEx(&status)) return SIZE_MAX;
+  return status.ullAvailPhys < SIZE_MAX ? (size_t)status.ullAvailPhys : SIZE_MAX;
 }
 
-#endif
+static void mmf_parallel(int nthreads, void (*fn)(void* arg, int tid, int nthreads), void* arg)
+{
+  HANDLE* threads = nthreads > 1 ? LocalAlloc(LPTR, nthreads * sizeof(*threads)) : NULL;
+  struct mmf_worker* workers = nthreads > 1 ? LocalAlloc(LPTR, nthreads * sizeof(*workers)) : NULL;
+  int i;
+
+  if (threads == NULL || workers == NULL) {
+    for (i = 0; i < nthreads; i++) fn(arg, i, nthreads);
+  }
+  else {
+    for (i = 1; i < nthreads; i++) {
+      workers[i].fn = fn;
+      workers[i].arg = arg;
+      workers[i].tid = i;
+      workers[i].nthreads = nthreads;
+      threads[i] = CreateThread(NULL, 0, mmf_worker_main, &workers[i], 0, NULL);
+      if (threads[i] == NULL) fn(arg, i, nthreads);
+    }
+    fn(arg, 0, nthreads);
+    for (i = 1; i < nthreads; i++) {
+      if (threads[i] != NULL) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+      }
+    }
+  }
+
+  if (threads != NULL) LocalFree(threads);
+  if (workers != NULL) LocalFree(workers);
+}
+
+static uint64_t mmf_atomic_or64(uint64_t* p, uint64_t v)
+{
+  return (uint64_t)InterlockedOr64((volatile LONG64*)p, (LONG64)v);
+}
+
+static bool mmf_atomic_cas32(uint32_t* p, uint32_t expected, uint32_t desired)
+{
+  return (uint32_t)InterlockedCompareExchange((volatile LONG*)p, (LONG)desired, (LONG)expected) == expected;
+}
+
+static uint32_t mmf_atomic_load32(const uint32_t* p)
+{
+  return *(const volatile uint32_t*)p;
+}
+
+static void mmf_atomic_store32(uint32_t* p, uint32_t v)
+{
+  InterlockedExchange((volatile LONG*)p, (LONG)v);
+}
+
+static void mmf_yield(void)
+{
+  SwitchToThread();
+}
+
+// Files opened with "l" are read into committed memory instead of being
+// mapped. Every thread reads its part through a handle of its own, as reads
+// through one synchronous handle are serialized. Large pages would need the
+// lock pages privilege, so ordinary pages are used.
+#define MMFLOAD_ALIGN ((size_t)2 << 20)
+
+struct mmfload_job {
+  const char* name;
+  char* mem;
+  size_t size;
+  LONG failed;
+  DWORD error;                                             // Error code of the first failed read
+};
+
+static void mmfload_part(void* arg, int tid, int nthreads)
+{
+  struct mmfload_job* job = arg;
+  size_t chunks = (job->size + MMFLOAD_ALIGN - 1) / MMFLOAD_ALIGN;
+  size_t begin = chunks * (size_t)tid / (size_t)nthreads * MMFLOAD_ALIGN;
+  size_t end = chunks * (size_t)(tid + 1) / (size_t)nthreads * MMFLOAD_ALIGN;
+  HANDLE file;
+  bool ok;
+
+  if (end > job->size) end = job->size;
+  if (begin >= end) return;
+  file = CreateFileA(job->name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  ok = file != INVALID_HANDLE_VALUE;
+  while (ok && begin < end) {
+    OVERLAPPED at;
+    DWORD chunk = end - begin > 0x40000000 ? 0x40000000 : (DWORD)(end - begin), got = 0;
+    memset(&at, 0, sizeof(at));
+    at.Offset = (DWORD)begin;
+    at.OffsetHigh = (DWORD)((uint64_t)begin >> 32);
+    ok = ReadFile(file, job->mem + begin, chunk, &got, &at) != FALSE;
+    if (ok && got == 0) {
+      SetLastError(ERROR_HANDLE_EOF);
+      ok = false;
+    }
+    begin += got;
+  }
+  if (!ok && InterlockedCompareExchange(&job->failed, 1, 0) == 0) job->error = GetLastError();
+  if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+}
+
+static MMFILE* mmfloadfile(const char* name)
+{
+  MMFILE* ret = NULL;
+  MMFILE* fp = LocalAlloc(LPTR, sizeof(*fp));
+  struct mmfload_job job;
+  WIN32_FILE_ATTRIBUTE_DATA info;
+
+  memset(&job, 0, sizeof(job));
+  job.name = name;
+  if (fp != NULL) {
+    if (GetFileAttributesExA(name, GetFileExInfoStandard, &info)) {
+      job.size = ((size_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+      if (job.size > 0) {
+        job.mem = VirtualAlloc(NULL, job.size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        if (job.mem != NULL) {
+          size_t chunks = (job.size + MMFLOAD_ALIGN - 1) / MMFLOAD_ALIGN;
+          int nthreads = mmf_cpu_count();
+          if ((size_t)nthreads > chunks) nthreads = (int)chunks;
+          mmf_parallel(nthreads, mmfload_part, &job);
+          if (!job.failed) {
+            DWORD old;
+            VirtualProtect(job.mem, job.size, PAGE_READONLY, &old);
+            fp->file = INVALID_HANDLE_VALUE;
+            fp->mem = job.mem;
+            fp->size = job.size;
+            fp->kind = MMFKIND_LOADED;
+            ret = fp;
+          }
+          else {
+            mmfseterror("could not read file: %s", GetWindowsErrorString(job.error));
+            VirtualFree(job.mem, 0, MEM_RELEASE);
+          }
+        } else mmfseterror("could not allocate memory for file: %s", LASTERROR);
+      } else mmfseterror("could not load file: file is empty");
+    } else mmfseterror("could not get file size: %s", LASTERROR);
+    if (ret == NULL) LocalFree(fp);
+  } else mmfseterror("could not allocate space for MMFILE: %s", LASTERROR);
+
+  return ret;
+}
+
+// A file mapped piecewise: views of any part of it can be made and dropped
+// independently. Offsets of views must be multiples of mmf_granularity().
+struct mmf_source {
+  HANDLE file;
+  HANDLE map;
+  uint64_t size;
+};
+
+static size_t mmf_granularity(void)
+{
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwAllocationGranularity;
+}
+
+static bool mmf_source_open(const char* name, struct mmf_source* src)
+{
+  bool ret = false;
+  LARGE_INTEGER size;
+  src->map = NULL;
+  src->file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (src->file != INVALID_HANDLE_VALUE) {
+    if (GetFileSizeEx(src->file, &size)) {
+      src->size = (uint64_t)size.QuadPart;
+      // Empty files cannot be mapped, but then there is nothing to view either
+      if (src->size > 0) src->map = CreateFileMappingA(src->file, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (src->size == 0 || src->map != NULL) {
+        ret = true;
+      } else mmfseterror("could not map file '%s' (CreateFileMappingA): %s", name, LASTERROR);
+    } else mmfseterror("could not get size of '%s': %s", name, LASTERROR);
+    if (!ret) CloseHandle(src->file);
+  } else mmfseterror("could not open the file '%s': %s", name, LASTERROR);
+
+  return ret;
+}
+
+static void* mmf_source_map(struct mmf_source* src, uint64_t offset, size_t len)
+{
+  void* ret = MapViewOfFile(src->map, FILE_MAP_READ, (DWORD)(offset >> 32), (DWORD)offset, len);
+  if (ret == NULL) mmfseterror("could not map file window: %s", LASTERROR);
+  return ret;
+}
+
+static void mmf_source_unmap(void* mem, size_t len)
+{
+  (void)len;
+  UnmapViewOfFile(mem);
+}
+
+static void mmf_source_close(struct mmf_source* src)
+{
+  if (src->map != NULL) CloseHandle(src->map);
+  CloseHandle(src->file);
+}
+
+int mmfz_budget(MMFILE* mmf, size_t bytes)
+{
+  (void)mmf;
+  (void)bytes;
+  mmfseterror("could not set budget: lazy decompression needs Linux");
+  return -1;
+}
+
+// Windows reports no residency of mapped pages the way mincore does, so the
+// resident budget is not available there.
+void mmftouch(MMFILE* mmf)
+{
+  (void)mmf;
+}
+
+size_t mmfresident(void)
+{
+  return 0;
+}
+
+int mmfbudget(size_t bytes)
+{
+  (void)bytes;
+  mmfseterror("could not set budget: resident budgets need POSIX");
+  return -1;
+}
+
+int mmfbudget_enforce(void)
+{
+  mmfseterror("could not enforce budget: resident budgets need POSIX");
+  return -1;
+}
+
+int mmfbudget_watch(unsigned stall_ms, unsigned window_ms)
+{
+  (void)stall_ms;
+  (void)window_ms;
+  mmfseterror("could not watch memory pressure: resident budgets need POSIX");
+  return -1;
+}
+
+// VirtualLock keeps pages in the working set, so the working set quota is
+// grown when locking would overflow it. Pages are read in at once, since
+// MMF_LOCK_ONFAULT has no Windows counterpart.
+static size_t mmf_lock_limit(void)
+{
+  return SIZE_MAX;
+}
+
+int mmflock(MMFILE* mmf, size_t offset, size_t len, int flags)
+{
+  int ret = -1;
+  (void)flags;
+  if (offset <= mmf->size) {
+    if (len == 0 || len > mmf->size - offset) len = mmf->size - offset;
+    if (len == 0 || VirtualLock((char*)mmf->mem + offset, len)) {
+      ret = 0;
+    }
+    else if (GetLastError() == ERROR_WORKING_SET_QUOTA) {
+      SIZE_T lo, hi;
+      if (GetProcessWorkingSetSize(GetCurrentProcess(), &lo, &hi) &&
+          SetProcessWorkingSetSize(GetCurrentProcess(), lo + len, hi + len) &&
+          VirtualLock((char*)mmf->mem + offset, len)) {
+        ret = 0;
+      } else mmfseterror("could not lock: %s", LASTERROR);
+    } else mmfseterror("could not lock: %s", LASTERROR);
+  } else mmfseterror("could not lock: offset is past the end of mapping");
+
+  return ret;
+}
+
+int mmfunlock(MMFILE* mmf, size_t offset, size_t len)
+{
+  int ret = -1;
+  if (offset <= mmf->size) {
+    if (len == 0 || len > mmf->size - offset) len = mmf->size - offset;
+    // Pages that were not locked are only dropped from the working set
+    if (len == 0 || VirtualUnlock((char*)mmf->mem + offset, len) || GetLastError() == ERROR_NOT_LOCKED) {
+      ret = 0;
+    } else mmfseterror("could not unlock: %s", LASTERROR);
+  } else mmfseterror("could not unlock: offset is past the end of mapping");
+
+  return ret;
+}
+
+#else
+// ============================================================================
+// POSIX implementation. Uses mmap.
+// ============================================================================
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/resource.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+struct MMFILE_impl {
+  int fd;
+  void* mem;
+  size_t size;
+  int kind;
+  struct mmfz_map* z;                                      // State of a compressed file
+  MMFILE* prev;                                            // Neighbours in the registry of mappings
+  MMFILE* next;
+  uint64_t touched;                                        // Time of last use, in nanoseconds
+};
+
+#define LASTERROR strerror(errno)
+
+static MMFILE* mmfmapcompressed(const char* name);
+static void mmfunmapcompressed(MMFILE* mmf);
+static MMFILE* mmfloadfile(const char* name);
+static void mmf_register(MMFILE* mmf);
+static void mmf_unregister(MMFILE* mmf);
+
+// Opens and maps a file. When `create` is set the file is created or
+// truncated and then extended to `createsize` bytes.
+static MMFILE* mmfmapfile(const char* name, int openmode, bool create, size_t createsize)
+{
+  MMFILE* ret = NULL;
+  MMFILE f = {0};
+  struct { int mode, prot, map; } flags = {0};
+  bool openable = false;
+
+  switch (openmode) {
+    case OPENMODE_READONLY:
+      flags.mode = O_RDONLY;
+      flags.prot = PROT_READ;
+      flags.map = MAP_PRIVATE;
+      openable = true;
+      break;
+
+    case OPENMODE_READWRITE:
+      flags.mode = create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR;
+      flags.prot = PROT_READ | PROT_WRITE;
+      flags.map = MAP_SHARED;
+      openable = true;
+      break;
+  }
+
+  if (openable) {
+    MMFILE* fp = calloc(1, sizeof(*fp));
+    if (fp != NULL) {
+      f.fd = open(name, flags.mode, 0644);
+      if (f.fd != -1) {
+        struct stat fileinfo;
+        int res = create ? ftruncate(f.fd, (off_t)createsize) : fstat(f.fd, &fileinfo);
+        if (res == 0) {
+          f.size = create ? createsize : (size_t)fileinfo.st_size;
+          if (f.size > 0) {
+            f.mem = mmap(NULL, f.size, flags.prot, flags.map, f.fd, 0);
+            if (f.mem != MAP_FAILED) {
+              *fp = f;
+              mmf_register(fp);
+              ret = fp;
+            } else mmfseterror("could not map file: %s", LASTERROR);
+          } else mmfseterror("could not map file: file is empty");
+        } else mmfseterror("could not get file size: %s", LASTERROR);
+        if (ret == NULL) close(f.fd);
+      } else mmfseterror("could not open the file: %s", LASTERROR);
+      if (ret == NULL) free(fp);
+    } else mmfseterror("could not allocate space for MMFILE: %s", LASTERROR);
+  } else mmfseterror("no valid file opening mode flags were provided");
+
+  return ret;
+}
+
+MMFILE* mmfopen(const char* name, const char* mode)
+{
+  MMFILE* ret;
+  int openmode = decode_open_mode(mode);
+  int advices = openmode & OPENMODE_ADVICES;
+  openmode &= ~OPENMODE_ADVICES;
+  if (openmode & OPENMODE_COMPRESSED) {
+    // Only reading makes sense for compressed files
+    if (openmode & OPENMODE_WRITEONLY) {
+      mmfseterror("could not map compressed file: compressed files are read-only");
+      return NULL;
+    }
+    // Blocks are mapped afresh on every load, so advice given to the reservation would not last
+    if (advices != 0) {
+      mmfseterror("could not map compressed file: fork and dump mode letters are not supported with \"z\"");
+      return NULL;
+    }
+    return mmfmapcompressed(name);
+  }
+
+  if (openmode & OPENMODE_LOAD) {
+    if (openmode & OPENMODE_WRITEONLY) {
+      mmfseterror("could not load file: loaded files are read-only copies");
+      return NULL;
+    }
+    ret = mmfloadfile(name);
+  }
+  else ret = mmfmapfile(name, openmode, false, 0);
+  if (ret != NULL && (((advices & OPENMODE_DONTFORK) && mmfadvise(ret, 0, 0, MMF_ADVICE_DONTFORK) != 0) ||
+                      ((advices & OPENMODE_DONTDUMP) && mmfadvise(ret, 0, 0, MMF_ADVICE_DONTDUMP) != 0))) {
+    mmfclose(ret);
+    ret = NULL;
+  }
+  return ret;
+}
+
+MMFILE* mmfcreate(const char* name, size_t size)
+{
+  return mmfmapfile(name, OPENMODE_READWRITE, true, size);
+}
+
+void* mmfdata(MMFILE* mmf)
+{
+  return mmf->mem;
+}
+
+size_t mmfsize(MMFILE* mmf)
+{
+  return mmf->size;
+}
+
+int mmfflush(MMFILE* mmf)
+{
+  int ret = -1;
+  if (msync(mmf->mem, mmf->size, MS_SYNC) == 0) {
+    ret = 0;
+  } else mmfseterror("could not flush mapping: %s", LASTERROR);
+
+  return ret;
+}
+
+int mmfadvise(MMFILE* mmf, size_t offset, size_t len, int advice)
+{
+  int ret = -1, native = -1;
+  switch (advice) {
+    case MMF_ADVICE_NORMAL: native = MADV_NORMAL; break;
+    case MMF_ADVICE_SEQUENTIAL: native = MADV_SEQUENTIAL; break;
+    case MMF_ADVICE_RANDOM: native = MADV_RANDOM; break;
+    case MMF_ADVICE_WILLNEED: native = MADV_WILLNEED; break;
+    case MMF_ADVICE_DONTNEED: native = MADV_DONTNEED; break;
+#ifdef MADV_HUGEPAGE
+    case MMF_ADVICE_HUGEPAGE: native = MADV_HUGEPAGE; break;
+#endif
+#ifdef MADV_DONTFORK
+    case MMF_ADVICE_DONTFORK: native = MADV_DONTFORK; break;
+    case MMF_ADVICE_DOFORK: native = MADV_DOFORK; break;
+#endif
+#if defined(MADV_DONTDUMP)
+    case MMF_ADVICE_DONTDUMP: native = MADV_DONTDUMP; break;
+    case MMF_ADVICE_DODUMP: native = MADV_DODUMP; break;
+#elif defined(MADV_NOCORE)
+    case MMF_ADVICE_DONTDUMP: native = MADV_NOCORE; break;
+    case MMF_ADVICE_DODUMP: native = MADV_CORE; break;
+#endif
+#ifdef MADV_WIPEONFORK
+    case MMF_ADVICE_WIPEONFORK: native = MADV_WIPEONFORK; break;
+#endif
+  }
+
+  // Blocks of compressed files come and go with the fault handler, so access
+  // hints are moot, while fork and dump advice would not outlive a reload
+  if (native != -1 && mmf->kind == MMFKIND_COMPRESSED) {
+    if (advice >= MMF_ADVICE_DONTFORK && advice <= MMF_ADVICE_WIPEONFORK) {
+      mmfseterror("could not advise: fork and dump advice is not supported on compressed files");
+    } else ret = 0;
+  }
+  else if (native != -1) {
+    if (offset <= mmf->size) {
+      // madvise wants a page-aligned start, so the range is widened down
+      size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+      size_t start = offset - offset % pagesize;
+      if (len == 0 || len > mmf->size - offset) len = mmf->size - offset;
+      if (len == 0 || madvise((char*)mmf->mem + start, len + (offset - start), native) == 0) {
+        ret = 0;
+      } else mmfseterror("could not advise: %s", LASTERROR);
+    } else mmfseterror("could not advise: offset is past the end of mapping");
+  } else mmfseterror("could not advise: unknown advice %d", advice);
+
+  return ret;
+}
+
+void mmfclose(MMFILE* mmf)
+{
+  if (mmf->kind == MMFKIND_COMPRESSED) mmfunmapcompressed(mmf);
+  else {
+    mmf_unregister(mmf);
+    munmap(mmf->mem, mmf->size);
+  }
+  if (mmf->fd != -1) close(mmf->fd);
+  free(mmf);
+}
+
+static bool mmf_pread_full(int fd, void* buf, size_t len, off_t offset)
+{
+  char* p = buf;
+  while (len > 0) {
+    ssize_t got = pread(fd, p, len, offset);
+    if (got > 0) {
+      p += got;
+      len -= (size_t)got;
+      offset += got;
+    }
+    else if (got == 0 || errno != EINTR) {
+      if (got == 0) errno = EIO;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// The whole range is first reserved as anonymous private memory. Every file
+// that starts on a page boundary of the range then has its whole pages mapped
+// over the reservation with MAP_FIXED; the trailing partial page, which is
+// shared with the head of the next file, is filled with pread. A file that
+// starts in the middle of a page cannot be mapped at that address (mapping
+// offsets must be page-aligned), so its contents are read into the
+// reservation instead. Part files sized in whole pages are thus mapped with
+// no copying at all.
+MMFILE* mmfopen_concat(const char* const* names, size_t n)
+{
+  MMFILE* ret = NULL;
+  int* fds = malloc((n > 0 ? n : 1) * sizeof(*fds));
+  size_t* sizes = malloc((n > 0 ? n : 1) * sizeof(*sizes));
+  size_t i, opened = 0, total = 0;
+  bool ok = fds != NULL && sizes != NULL;
+
+  if (!ok) mmfseterror("could not allocate space for file descriptors: %s", LASTERROR);
+  for (i = 0; ok && i < n; i++) {
+    struct stat fileinfo;
+    fds[i] = open(names[i], O_RDONLY);
+    if (fds[i] != -1) {
+      opened++;
+      if (fstat(fds[i], &fileinfo) == 0) {
+        sizes[i] = (size_t)fileinfo.st_size;
+        total += sizes[i];
+      }
+      else {
+        mmfseterror("could not get size of '%s': %s", names[i], LASTERROR);
+        ok = false;
+      }
+    }
+    else {
+      mmfseterror("could not open the file '%s': %s", names[i], LASTERROR);
+      ok = false;
+    }
+  }
+
+  if (ok && total == 0) {
+    mmfseterror("could not map files: all files are empty");
+    ok = false;
+  }
+
+  if (ok) {
+    MMFILE* fp = calloc(1, sizeof(*fp));
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    char* mem = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    size_t pos = 0;
+    if (fp == NULL) mmfseterror("could not allocate space for MMFILE: %s", LASTERROR);
+    if (mem == MAP_FAILED) mmfseterror("could not reserve address range: %s", LASTERROR);
+
+    for (i = 0; fp != NULL && mem != MAP_FAILED && ok && i < n; i++) {
+      size_t whole = pos % pagesize == 0 ? sizes[i] - sizes[i] % pagesize : 0;
+      if (whole > 0 && mmap(mem + pos, whole, PROT_READ, MAP_PRIVATE | MAP_FIXED, fds[i], 0) == MAP_FAILED) {
+        mmfseterror("could not map '%s': %s", names[i], LASTERROR);
+        ok = false;
+      }
+      else if (!mmf_pread_full(fds[i], mem + pos + whole, sizes[i] - whole, (off_t)whole)) {
+        mmfseterror("could not read '%s': %s", names[i], LASTERROR);
+        ok = false;
+      }
+      pos += sizes[i];
+    }
+
+    if (fp != NULL && mem != MAP_FAILED && ok) {
+      mprotect(mem, total, PROT_READ);
+      fp->fd = -1;
+      fp->mem = mem;
+      fp->size = total;
+      fp->kind = MMFKIND_CONCAT;
+      mmf_register(fp);
+      ret = fp;
+    }
+    else {
+      if (mem != MAP_FAILED) munmap(mem, total);
+      free(fp);
+    }
+  }
+
+  for (i = 0; i < opened; i++) close(fds[i]);
+  free(fds);
+  free(sizes);
+  return ret;
+}
+
+// Runs fn(arg, tid, nthreads) for every tid in [0, nthreads), each on its own
+// thread where possible. Work of threads that could not be started is done on
+// the calling thread, so every tid always runs exactly once. Programs using
+// the parallel functions have to be linked with -pthread.
+struct mmf_worker {
+  void (*fn)(void* arg, int tid, int nthreads);
+  void* arg;
+  int tid, nthreads;
+};
+
+static void* mmf_worker_main(void* p)
+{
+  struct mmf_worker* w = p;
+  w->fn(w->arg, w->tid, w->nthreads);
+  return NULL;
+}
+
+static int mmf_cpu_count(void)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+// Free physical memory, or SIZE_MAX where the system does not tell
+static size_t mmf_available_memory(void)
+{
+#ifdef _SC_AVPHYS_PAGES
+  long pages = sysconf(_SC_AVPHYS_PAGES), pagesize = sysconf(_SC_PAGESIZE);
+  if (pages > 0 && pagesize > 0) return (size_t)pages < SIZE_MAX / (size_t)pagesize ? (size_t)pages * (size_t)pagesize : SIZE_MAX;
+#endif
+  return SIZE_MAX;
+}
+
+static void mmf_parallel(int nthreads, void (*fn)(void* arg, int tid, int nthreads), void* arg)
+{
+  pthread_t* threads = nthreads > 1 ? calloc((size_t)nthreads, sizeof(*threads)) : NULL;
+  struct mmf_worker* workers = nthreads > 1 ? calloc((size_t)nthreads, sizeof(*workers)) : NULL;
+  bool* started = nthreads > 1 ? calloc((size_t)nthreads, sizeof(*started)) : NULL;
+  int i;
+
+  if (threads == NULL || workers == NULL || started == NULL) {
+    for (i = 0; i < nthreads; i++) fn(arg, i, nthreads);
+  }
+  else {
+    for (i = 1; i < nthreads; i++) {
+      workers[i].fn = fn;
+      workers[i].arg = arg;
+      workers[i].tid = i;
+      workers[i].nthreads = nthreads;
+      started[i] = pthread_create(&threads[i], NULL, mmf_worker_main, &workers[i]) == 0;
+      if (!started[i]) fn(arg, i, nthreads);
+    }
+    fn(arg, 0, nthreads);
+    for (i = 1; i < nthreads; i++) {
+      if (started[i]) pthread_join(threads[i], NULL);
+    }
+  }
+
+  free(threads);
+  free(workers);
+  free(started);
+}
+
+static uint64_t mmf_atomic_or64(uint64_t* p, uint64_t v)
+{
+  return __atomic_fetch_or(p, v, __ATOMIC_RELAXED);
+}
+
+// Like the Windows interlocked functions these order other memory accesses
+// too, so that they can guard data published by another thread.
+static bool mmf_atomic_cas32(uint32_t* p, uint32_t expected, uint32_t desired)
+{
+  return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static uint32_t mmf_atomic_load32(const uint32_t* p)
+{
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void mmf_atomic_store32(uint32_t* p, uint32_t v)
+{
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static void mmf_yield(void)
+{
+  sched_yield();
+}
+
+// Files opened with "l" are read into anonymous memory instead of being
+// mapped, trading startup time for having no page faults later on. The
+// region is aligned to 2 MiB and advised MADV_HUGEPAGE so that transparent
+// huge pages can back it, and threads fill their parts of it with pread.
+#define MMFLOAD_ALIGN ((size_t)2 << 20)
+
+struct mmfload_job {
+  int fd;
+  char* mem;
+  size_t size;
+  uint32_t failed;
+  int error;                                               // errno of the first failed read
+};
+
+static void mmfload_part(void* arg, int tid, int nthreads)
+{
+  struct mmfload_job* job = arg;
+  // Parts are whole huge pages
+  size_t chunks = (job->size + MMFLOAD_ALIGN - 1) / MMFLOAD_ALIGN;
+  size_t begin = chunks * (size_t)tid / (size_t)nthreads * MMFLOAD_ALIGN;
+  size_t end = chunks * (size_t)(tid + 1) / (size_t)nthreads * MMFLOAD_ALIGN;
+
+  if (end > job->size) end = job->size;
+  if (begin < end && !mmf_pread_full(job->fd, job->mem + begin, end - begin, (off_t)begin)) {
+    int error = errno;
+    if (mmf_atomic_cas32(&job->failed, 0, 1)) job->error = error;
+  }
+}
+
+static MMFILE* mmfloadfile(const char* name)
+{
+  MMFILE* ret = NULL;
+  MMFILE* fp = calloc(1, sizeof(*fp));
+  struct mmfload_job job;
+  struct stat fileinfo;
+
+  memset(&job, 0, sizeof(job));
+  if (fp != NULL) {
+    job.fd = open(name, O_RDONLY);
+    if (job.fd != -1) {
+      if (fstat(job.fd, &fileinfo) == 0) {
+        job.size = (size_t)fileinfo.st_size;
+        if (job.size > 0) {
+          // Reserved with room to slide the region onto a huge page boundary
+          size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+          size_t len = (job.size + pagesize - 1) / pagesize * pagesize;
+          char* base = mmap(NULL, len + MMFLOAD_ALIGN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+          if (base != MAP_FAILED) {
+            size_t head = (MMFLOAD_ALIGN - (uintptr_t)base % MMFLOAD_ALIGN) % MMFLOAD_ALIGN;
+            size_t chunks = (job.size + MMFLOAD_ALIGN - 1) / MMFLOAD_ALIGN;
+            int nthreads = mmf_cpu_count();
+            if (head > 0) munmap(base, head);
+            munmap(base + head + len, MMFLOAD_ALIGN - head);
+            job.mem = base + head;
+#ifdef MADV_HUGEPAGE
+            madvise(job.mem, len, MADV_HUGEPAGE);
+#endif
+            if ((size_t)nthreads > chunks) nthreads = (int)chunks;
+            mmf_parallel(nthreads, mmfload_part, &job);
+            if (!job.failed) {
+              mprotect(job.mem, len, PROT_READ);
+              fp->fd = -1;
+              fp->mem = job.mem;
+              fp->size = job.size;
+              fp->kind = MMFKIND_LOADED;
+              mmf_register(fp);
+              ret = fp;
+            }
+            else {
+              mmfseterror("could not read file: %s", strerror(job.error));
+              munmap(job.mem, len);
+            }
+          } else mmfseterror("could not allocate memory for file: %s", LASTERROR);
+        } else mmfseterror("could not load file: file is empty");
+      } else mmfseterror("could not get file size: %s", LASTERROR);
+      close(job.fd);
+    } else mmfseterror("could not open the file: %s", LASTERROR);
+    if (ret == NULL) free(fp);
+  } else mmfseterror("could not allocate space for MMFILE: %s", LASTERROR);
+
+  return ret;
+}
+
+// A file mapped piecewise: views of any part of it can be made and dropped
+// independently. Offsets of views must be multiples of mmf_granularity().
+struct mmf_source {
+  int fd;
+  uint64_t size;
+};
+
+static size_t mmf_granularity(void)
+{
+  return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static bool mmf_source_open(const char* name, struct mmf_source* src)
+{
+  bool ret = false;
+  struct stat fileinfo;
+  src->fd = open(name, O_RDONLY);
+  if (src->fd != -1) {
+    if (fstat(src->fd, &fileinfo) == 0) {
+      src->size = (uint64_t)fileinfo.st_size;
+      ret = true;
+    } else mmfseterror("could not get size of '%s': %s", name, LASTERROR);
+    if (!ret) close(src->fd);
+  } else mmfseterror("could not open the file '%s': %s", name, LASTERROR);
+
+  return ret;
+}
+
+static void* mmf_source_map(struct mmf_source* src, uint64_t offset, size_t len)
+{
+  void* ret = mmap(NULL, len, PROT_READ, MAP_SHARED, src->fd, (off_t)offset);
+  if (ret == MAP_FAILED) {
+    mmfseterror("could not map file window: %s", LASTERROR);
+    ret = NULL;
+  }
+  return ret;
+}
+
+static void mmf_source_unmap(void* mem, size_t len)
+{
+  munmap(mem, len);
+}
+
+static void mmf_source_close(struct mmf_source* src)
+{
+  close(src->fd);
+}
+
+// Registry of open mappings for the process-wide resident budget. Every
+// mapping remembers when it was opened or last passed to mmftouch(), and
+// when the resident pages of all mappings (as mincore reports them) exceed
+// the budget, the least recently used mappings are evicted first. Eviction
+// prefers MADV_PAGEOUT, which reclaims the pages at once. Without it, file
+// pages are dropped with MADV_DONTNEED, while anonymous ones (concatenated
+// and loaded files) are only marked MADV_COLD, because dropping them would
+// lose their contents. Compressed files have a budget of their own and are left out.
+static MMFILE* mmf_registry = NULL;
+static pthread_mutex_t mmf_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t mmf_budget_bytes = 0;
+
+static uint64_t mmf_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void mmf_register(MMFILE* mmf)
+{
+  mmf->touched = mmf_now();
+  pthread_mutex_lock(&mmf_registry_lock);
+  mmf->prev = NULL;
+  mmf->next = mmf_registry;
+  if (mmf_registry != NULL) mmf_registry->prev = mmf;
+  mmf_registry = mmf;
+  pthread_mutex_unlock(&mmf_registry_lock);
+}
+
+static void mmf_unregister(MMFILE* mmf)
+{
+  pthread_mutex_lock(&mmf_registry_lock);
+  if (mmf->prev != NULL) mmf->prev->next = mmf->next;
+  else mmf_registry = mmf->next;
+  if (mmf->next != NULL) mmf->next->prev = mmf->prev;
+  pthread_mutex_unlock(&mmf_registry_lock);
+}
+
+void mmftouch(MMFILE* mmf)
+{
+  __atomic_store_n(&mmf->touched, mmf_now(), __ATOMIC_RELAXED);
+}
+
+static size_t mmf_resident_bytes(MMFILE* mmf)
+{
+  size_t pagesize = (size_t)sysconf(_SC_PAGESIZE), ret = 0, pos, len, i;
+  unsigned char vec[4096];
+
+  for (pos = 0; pos < mmf->size; pos += len) {
+    len = mmf->size - pos < sizeof(vec) * pagesize ? mmf->size - pos : sizeof(vec) * pagesize;
+    if (mincore((char*)mmf->mem + pos, len, (void*)vec) == 0) {
+      for (i = 0; i < (len + pagesize - 1) / pagesize; i++) ret += (vec[i] & 1) * pagesize;
+    }
+  }
+  return ret;
+}
+
+size_t mmfresident(void)
+{
+  size_t ret = 0;
+  MMFILE* m;
+
+  pthread_mutex_lock(&mmf_registry_lock);
+  for (m = mmf_registry; m != NULL; m = m->next) ret += mmf_resident_bytes(m);
+  pthread_mutex_unlock(&mmf_registry_lock);
+  return ret;
+}
+
+static void mmf_evict(MMFILE* mmf)
+{
+  bool done = false;
+#ifdef MADV_PAGEOUT
+  done = madvise(mmf->mem, mmf->size, MADV_PAGEOUT) == 0;
+#endif
+  if (!done && mmf->fd != -1) madvise(mmf->mem, mmf->size, MADV_DONTNEED);
+#ifdef MADV_COLD
+  else if (!done) madvise(mmf->mem, mmf->size, MADV_COLD);
+#endif
+  // Clean pages no longer mapped anywhere leave the page cache as well
+  if (mmf->fd != -1) posix_fadvise(mmf->fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+struct mmf_ranked {
+  MMFILE* mmf;
+  uint64_t touched;
+  size_t resident;
+};
+
+static int mmf_ranked_compare(const void* a, const void* b)
+{
+  uint64_t x = ((const struct mmf_ranked*)a)->touched, y = ((const struct mmf_ranked*)b)->touched;
+  return x < y ? -1 : x > y;
+}
+
+// Evicts the coldest mappings until the rest fit the budget. Under memory
+// pressure at least half of the resident pages go, even within the budget.
+static int mmf_budget_evict(bool pressure)
+{
+  int ret = -1;
+  struct mmf_ranked* ranked;
+  size_t n = 0, i, total = 0, target;
+  MMFILE* m;
+
+  pthread_mutex_lock(&mmf_registry_lock);
+  for (m = mmf_registry; m != NULL; m = m->next) n++;
+  ranked = malloc((n > 0 ? n : 1) * sizeof(*ranked));
+  if (ranked != NULL) {
+    for (m = mmf_registry, i = 0; m != NULL; m = m->next, i++) {
+      ranked[i].mmf = m;
+      ranked[i].touched = __atomic_load_n(&m->touched, __ATOMIC_RELAXED);
+      ranked[i].resident = mmf_resident_bytes(m);
+      total += ranked[i].resident;
+    }
+    qsort(ranked, n, sizeof(*ranked), mmf_ranked_compare);
+    target = mmf_budget_bytes > 0 ? mmf_budget_bytes : SIZE_MAX;
+    if (pressure && total / 2 < target) target = total / 2;
+    for (i = 0; i < n && total > target; i++) {
+      if (ranked[i].resident > 0) {
+        // Pages mapped elsewhere too may stay, so what is left is measured
+        size_t left;
+        mmf_evict(ranked[i].mmf);
+        left = mmf_resident_bytes(ranked[i].mmf);
+        total -= left < ranked[i].resident ? ranked[i].resident - left : 0;
+      }
+    }
+    ret = 0;
+  } else mmfseterror("could not allocate space for mapping list: %s", LASTERROR);
+  pthread_mutex_unlock(&mmf_registry_lock);
+
+  free(ranked);
+  return ret;
+}
+
+int mmfbudget(size_t bytes)
+{
+  pthread_mutex_lock(&mmf_registry_lock);
+  mmf_budget_bytes = bytes;
+  pthread_mutex_unlock(&mmf_registry_lock);
+  return mmf_budget_evict(false);
+}
+
+int mmfbudget_enforce(void)
+{
+  return mmf_budget_evict(false);
+}
+
+// The watcher thread polls a pipe, which is closed to stop it, and on Linux
+// a pressure stall (PSI) trigger. The kernel accepts trigger windows from
+// 500 ms to 10 s, and from unprivileged processes only multiples of 2 s.
+static pthread_mutex_t mmf_watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t mmf_watcher;
+static bool mmf_watching = false;
+static int mmf_watch_pipe[2] = {-1, -1};
+static int mmf_watch_psi = -1;
+static int mmf_watch_period = 0;
+
+static void* mmf_watch_main(void* p)
+{
+  struct pollfd fds[2];
+  nfds_t nfds = mmf_watch_psi != -1 ? 2 : 1;
+  bool stop = false;
+
+  (void)p;
+  fds[0].fd = mmf_watch_pipe[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = mmf_watch_psi;
+  fds[1].events = POLLPRI;
+  while (!stop) {
+    int res = poll(fds, nfds, mmf_watch_period);
+    if (res > 0 && fds[0].revents != 0) stop = true;
+    else if (res > 0 && nfds == 2 && (fds[1].revents & POLLERR)) nfds = 1;
+    else if (res >= 0) mmf_budget_evict(res > 0 && nfds == 2 && (fds[1].revents & POLLPRI));
+    else stop = errno != EINTR;
+  }
+  return NULL;
+}
+
+static bool mmf_watch_psi_open(unsigned stall_ms, unsigned window_ms)
+{
+  bool ret = false;
+#if defined(__linux__)
+  char trigger[64];
+  mmf_watch_psi = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK);
+  if (mmf_watch_psi != -1) {
+    snprintf(trigger, sizeof(trigger), "some %llu %llu", (unsigned long long)stall_ms * 1000, (unsigned long long)window_ms * 1000);
+    if (write(mmf_watch_psi, trigger, strlen(trigger) + 1) > 0) {
+      ret = true;
+    } else mmfseterror("could not set memory pressure trigger: %s", LASTERROR);
+    if (!ret) {
+      close(mmf_watch_psi);
+      mmf_watch_psi = -1;
+    }
+  } else mmfseterror("could not open memory pressure file: %s", LASTERROR);
+#else
+  (void)stall_ms;
+  (void)window_ms;
+  mmfseterror("could not watch memory pressure: pressure stall information needs Linux");
+#endif
+  return ret;
+}
+
+int mmfbudget_watch(unsigned stall_ms, unsigned window_ms)
+{
+  int ret = -1;
+
+  pthread_mutex_lock(&mmf_watch_lock);
+  if (mmf_watching) {
+    close(mmf_watch_pipe[1]);
+    pthread_join(mmf_watcher, NULL);
+    close(mmf_watch_pipe[0]);
+    if (mmf_watch_psi != -1) close(mmf_watch_psi);
+    mmf_watch_psi = -1;
+    mmf_watching = false;
+  }
+
+  if (window_ms == 0) ret = 0;
+  else if (pipe(mmf_watch_pipe) == 0) {
+    mmf_watch_period = window_ms > INT_MAX ? INT_MAX : (int)window_ms;
+    if (stall_ms == 0 || mmf_watch_psi_open(stall_ms, window_ms)) {
+      if (pthread_create(&mmf_watcher, NULL, mmf_watch_main, NULL) == 0) {
+        mmf_watching = true;
+        ret = 0;
+      } else mmfseterror("could not start watcher thread");
+      if (ret != 0 && mmf_watch_psi != -1) {
+        close(mmf_watch_psi);
+        mmf_watch_psi = -1;
+      }
+    }
+    if (ret != 0) {
+      close(mmf_watch_pipe[0]);
+      close(mmf_watch_pipe[1]);
+    }
+  } else mmfseterror("could not create watcher pipe: %s", LASTERROR);
+  pthread_mutex_unlock(&mmf_watch_lock);
+
+  return ret;
+}
+
+// Locks use mlock2 with MLOCK_ONFAULT on Linux when asked to, so that pages
+// are pinned as they are first touched instead of all being read in at
+// once; elsewhere, or on kernels without mlock2, mlock is used. The kernel
+// refuses to lock more than RLIMIT_MEMLOCK allows an unprivileged process.
+static size_t mmf_lock_limit(void)
+{
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) return (size_t)limit.rlim_cur;
+  return SIZE_MAX;
+}
+
+static int mmf_mlock(void* addr, size_t len, int flags)
+{
+#if defined(__linux__) && defined(SYS_mlock2)
+  if (flags & MMF_LOCK_ONFAULT) {
+    int res = (int)syscall(SYS_mlock2, addr, len, 1);        // MLOCK_ONFAULT
+    if (res == 0 || errno != ENOSYS) return res;
+  }
+#endif
+  (void)flags;
+  return mlock(addr, len);
+}
+
+int mmflock(MMFILE* mmf, size_t offset, size_t len, int flags)
+{
+  int ret = -1;
+  if (mmf->kind == MMFKIND_COMPRESSED) mmfseterror("could not lock: blocks of compressed files come and go with the fault handler");
+  else if (offset <= mmf->size) {
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = offset - offset % pagesize;
+    if (len == 0 || len > mmf->size - offset) len = mmf->size - offset;
+    if (len == 0 || mmf_mlock((char*)mmf->mem + start, len + (offset - start), flags) == 0) {
+      ret = 0;
+    }
+    else if (errno == ENOMEM || errno == EPERM) {
+      mmfseterror("could not lock: %s (RLIMIT_MEMLOCK is %llu bytes)", LASTERROR, (unsigned long long)mmf_lock_limit());
+    } else mmfseterror("could not lock: %s", LASTERROR);
+  } else mmfseterror("could not lock: offset is past the end of mapping");
+
+  return ret;
+}
+
+int mmfunlock(MMFILE* mmf, size_t offset, size_t len)
+{
+  int ret = -1;
+  if (mmf->kind == MMFKIND_COMPRESSED) ret = 0;
+  else if (offset <= mmf->size) {
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = offset - offset % pagesize;
+    if (len == 0 || len > mmf->size - offset) len = mmf->size - offset;
+    if (len == 0 || munlock((char*)mmf->mem + start, len + (offset - start)) == 0) {
+      ret = 0;
+    } else mmfseterror("could not unlock: %s", LASTERROR);
+  } else mmfseterror("could not unlock: offset is past the end of mapping");
+
+  return ret;
+}
+
+// Compressed files opened with "z" are exposed as a PROT_NONE reservation.
+// The first touch of a block raises SIGSEGV; the handler reads the block,
+// decompresses it into fresh pages and moves those over the block with
+// mremap, so other threads never see a half-filled block. Once more blocks
+// are resident than the budget allows, a hand sweeping over the block
+// numbers picks the ones to replace by PROT_NONE pages again. userfaultfd would avoid the signal round trip but
+// is usually not allowed to unprivileged processes, so it is not used.
+// Pages of a compressed mapping that the kernel reads on the caller's
+// behalf (write(2) from the mapping, say) must have been touched first:
+// system calls report EFAULT instead of raising the signal.
+#if defined(__linux__)
+
+#ifndef MREMAP_FIXED
+// Declared by <sys/mman.h> only under _GNU_SOURCE
+#define MREMAP_MAYMOVE 1
+#define MREMAP_FIXED 2
+void* mremap(void* old_address, size_t old_size, size_t new_size, int flags, ...);
+#endif
+
+#include <signal.h>
+
+#define MMFZ_MAXMAPS 64
+#define MMFZ_BUDGET ((size_t)64 << 20)
+
+struct mmfz_map {
+  int fd;
+  char* base;
+  size_t reserved;                                         // Whole blocks
+  size_t size;
+  size_t block_size;
+  size_t nblocks;
+  uint64_t* offsets;                                       // nblocks + 1
+  unsigned char* scratch;                                  // Compressed block being read
+  uint32_t* resident;                                      // Nonzero for decompressed blocks
+  uint32_t* loads;                                         // Times each block was decompressed
+  size_t nresident;
+  size_t maxresident;
+  size_t hand;                                             // Next eviction candidate
+  uint32_t lock;
+};
+
+static struct mmfz_map* mmfz_maps[MMFZ_MAXMAPS];
+static pthread_mutex_t mmfz_maps_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sigaction mmfz_oldsegv;
+static bool mmfz_installed = false;
+static __thread char* mmfz_lastfault;
+static __thread uint32_t mmfz_lastloads;
+
+static void mmfz_lock(struct mmfz_map* m)
+{
+  while (__atomic_exchange_n(&m->lock, 1, __ATOMIC_ACQUIRE) != 0) sched_yield();
+}
+
+static void mmfz_unlock(struct mmfz_map* m)
+{
+  __atomic_store_n(&m->lock, 0, __ATOMIC_RELEASE);
+}
+
+// Evicts blocks in hand order until at most limit are resident. Block keep
+// and its neighbours stay, so that an access across a block boundary can
+// have both blocks at once; if only they are left, the limit is exceeded.
+static void mmfz_evict(struct mmfz_map* m, size_t keep, size_t limit)
+{
+  size_t swept;
+
+  for (swept = 0; m->nresident > limit && swept < m->nblocks; swept++) {
+    size_t victim = m->hand;
+    m->hand = (m->hand + 1) % m->nblocks;
+    if (m->resident[victim] && (keep >= m->nblocks || victim + 1 < keep || victim > keep + 1)) {
+      mmap(m->base + victim * m->block_size, m->block_size, PROT_NONE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+      m->resident[victim] = 0;
+      m->nresident--;
+    }
+  }
+}
+
+// Makes a block readable. Returns false on I/O errors or corrupt data.
+// *loaded tells whether this call did the work; if not, the load count
+// of the block is returned in *loads.
+static bool mmfz_load(struct mmfz_map* m, size_t block, bool* loaded, uint32_t* loads)
+{
+  bool ret = true;
+
+  mmfz_lock(m);
+  *loaded = !m->resident[block];
+  *loads = m->loads[block];
+  if (*loaded) {
+    size_t raw = m->size - block * m->block_size < m->block_size ? m->size - block * m->block_size : m->block_size;
+    size_t packed = (size_t)(m->offsets[block + 1] - m->offsets[block]);
+    char* pages = mmap(NULL, m->block_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    mmfz_evict(m, block, m->maxresident - 1);
+    ret = pages != MAP_FAILED && mmf_pread_full(m->fd, m->scratch, packed, (off_t)m->offsets[block]);
+    if (ret) {
+      if (packed == raw) memcpy(pages, m->scratch, raw);
+      else ret = mmfz_decompress_block(m->scratch, packed, (unsigned char*)pages, raw);
+    }
+    ret = ret && mprotect(pages, m->block_size, PROT_READ) == 0 &&
+          mremap(pages, m->block_size, m->block_size, MREMAP_MAYMOVE | MREMAP_FIXED, m->base + block * m->block_size) != MAP_FAILED;
+    if (ret) {
+      m->resident[block] = 1;
+      m->loads[block]++;
+      m->nresident++;
+    }
+    else if (pages != MAP_FAILED) munmap(pages, m->block_size);
+  }
+  mmfz_unlock(m);
+
+  return ret;
+}
+
+static void mmfz_fault(int sig, siginfo_t* info, void* context)
+{
+  int saved = errno;
+  char* addr = info->si_addr;
+  struct mmfz_map* m = NULL;
+  bool handled = false;
+  int i;
+
+  for (i = 0; m == NULL && i < MMFZ_MAXMAPS; i++) {
+    m = __atomic_load_n(&mmfz_maps[i], __ATOMIC_ACQUIRE);
+    if (m != NULL && (addr < m->base || addr >= m->base + m->reserved)) m = NULL;
+  }
+
+  if (m != NULL) {
+    bool loaded;
+    uint32_t loads;
+    if (!mmfz_load(m, (size_t)(addr - m->base) / m->block_size, &loaded, &loads)) {
+      static const char message[] = "mmfio: could not read a block of a compressed file\n";
+      ssize_t written = write(2, message, sizeof(message) - 1);
+      (void)written;
+      // Same as a read error on a mapped file
+      signal(SIGBUS, SIG_DFL);
+      raise(SIGBUS);
+    }
+    // A block that was already resident either was loaded by another thread
+    // in the meantime, or the access is one that no load can satisfy (a
+    // write, say); the second time the same address faults with the block
+    // unchanged, the fault is passed on.
+    handled = loaded || mmfz_lastfault != addr || mmfz_lastloads != loads;
+    mmfz_lastfault = loaded ? NULL : addr;
+    mmfz_lastloads = loads;
+  }
+
+  if (!handled) {
+    if (mmfz_oldsegv.sa_flags & SA_SIGINFO) mmfz_oldsegv.sa_sigaction(sig, info, context);
+    else if (mmfz_oldsegv.sa_handler != SIG_DFL && mmfz_oldsegv.sa_handler != SIG_IGN) mmfz_oldsegv.sa_handler(sig);
+    else sigaction(SIGSEGV, &mmfz_oldsegv, NULL);          // The access is repeated and fails for good
+  }
+  errno = saved;
+}
+
+static void mmfz_free(struct mmfz_map* m)
+{
+  if (m->base != NULL) munmap(m->base, m->reserved);
+  if (m->fd != -1) close(m->fd);
+  free(m->offsets);
+  free(m->scratch);
+  free(m->resident);
+  free(m->loads);
+  free(m);
+}
+
+static bool mmfz_register(struct mmfz_map* m)
+{
+  bool ret = false;
+  int i;
+
+  pthread_mutex_lock(&mmfz_maps_lock);
+  if (!mmfz_installed) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = mmfz_fault;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, &mmfz_oldsegv) == 0) mmfz_installed = true;
+    else mmfseterror("could not install fault handler: %s", LASTERROR);
+  }
+  for (i = 0; mmfz_installed && !ret && i < MMFZ_MAXMAPS; i++) {
+    if (mmfz_maps[i] == NULL) {
+      __atomic_store_n(&mmfz_maps[i], m, __ATOMIC_RELEASE);
+      ret = true;
+    }
+  }
+  if (mmfz_installed && !ret) mmfseterror("could not map compressed file: too many compressed files are open");
+  pthread_mutex_unlock(&mmfz_maps_lock);
+
+  return ret;
+}
+
+static MMFILE* mmfmapcompressed(const char* name)
+{
+  MMFILE* ret = NULL;
+  MMFILE* fp = calloc(1, sizeof(*fp));
+  struct mmfz_map* m = calloc(1, sizeof(*m));
+  size_t pagesize = (size_t)sysconf(_SC_PAGESIZE), i, largest = 0;
+  struct mmfz_header header;
+  struct stat fileinfo;
+  bool ok = false;
+
+  if (m != NULL) m->fd = -1;
+  if (fp != NULL && m != NULL) {
+    m->fd = open(name, O_RDONLY);
+    if (m->fd != -1) {
+      if (fstat(m->fd, &fileinfo) == 0 && mmf_pread_full(m->fd, &header, sizeof(header), 0)) {
+        if (memcmp(header.magic, mmfz_magic, sizeof(mmfz_magic)) == 0 && header.size > 0 && header.block_size > 0 &&
+            header.block_size % MMFZ_ALIGN == 0 && header.block_size % pagesize == 0 && header.size <= SIZE_MAX &&
+            header.nblocks == (header.size - 1) / header.block_size + 1 &&
+            header.nblocks < ((uint64_t)fileinfo.st_size - sizeof(header)) / sizeof(uint64_t)) {
+          m->size = (size_t)header.size;
+          m->block_size = header.block_size;
+          m->nblocks = (size_t)header.nblocks;
+          m->reserved = m->nblocks * m->block_size;
+          m->offsets = malloc((m->nblocks + 1) * sizeof(*m->offsets));
+          m->resident = calloc(m->nblocks, sizeof(*m->resident));
+          m->loads = calloc(m->nblocks, sizeof(*m->loads));
+          if (m->offsets != NULL && m->resident != NULL && m->loads != NULL) {
+            if (mmf_pread_full(m->fd, m->offsets, (m->nblocks + 1) * sizeof(*m->offsets), sizeof(header))) {
+              ok = m->offsets[0] >= sizeof(header) + (m->nblocks + 1) * sizeof(*m->offsets) &&
+                   m->offsets[m->nblocks] <= (uint64_t)fileinfo.st_size;
+              for (i = 0; ok && i < m->nblocks; i++) {
+                ok = m->offsets[i] <= m->offsets[i + 1] && m->offsets[i + 1] - m->offsets[i] <= m->block_size;
+                if (ok && m->offsets[i + 1] - m->offsets[i] > largest) largest = (size_t)(m->offsets[i + 1] - m->offsets[i]);
+              }
+              if (!ok) mmfseterror("could not map compressed file: block index is damaged");
+            } else mmfseterror("could not read block index: %s", LASTERROR);
+          } else mmfseterror("could not allocate space for block index: %s", LASTERROR);
+        } else mmfseterror("could not map compressed file: header is not valid");
+      } else mmfseterror("could not read file header: %s", LASTERROR);
+    } else mmfseterror("could not open the file: %s", LASTERROR);
+  } else mmfseterror("could not allocate space for MMFILE: %s", LASTERROR);
+
+  if (ok) {
+    m->scratch = malloc(largest > 0 ? largest : 1);
+    m->maxresident = MMFZ_BUDGET / m->block_size > 2 ? MMFZ_BUDGET / m->block_size : 2;
+    m->base = mmap(NULL, m->reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (m->base == MAP_FAILED) {
+      m->base = NULL;
+      mmfseterror("could not reserve address range: %s", LASTERROR);
+    }
+    else if (m->scratch == NULL) mmfseterror("could not allocate space for block buffer: %s", LASTERROR);
+    else if (mmfz_register(m)) {
+      fp->fd = -1;
+      fp->mem = m->base;
+      fp->size = m->size;
+      fp->kind = MMFKIND_COMPRESSED;
+      fp->z = m;
+      ret = fp;
+    }
+  }
+
+  if (ret == NULL) {
+    if (m != NULL) mmfz_free(m);
+    free(fp);
+  }
+  return ret;
+}
+
+static void mmfunmapcompressed(MMFILE* mmf)
+{
+  int i;
+
+  pthread_mutex_lock(&mmfz_maps_lock);
+  for (i = 0; i < MMFZ_MAXMAPS; i++) {
+    if (mmfz_maps[i] == mmf->z) __atomic_store_n(&mmfz_maps[i], NULL, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&mmfz_maps_lock);
+  mmfz_free(mmf->z);
+}
+
+int mmfz_budget(MMFILE* mmf, size_t bytes)
+{
+  int ret = -1;
+  if (mmf->kind == MMFKIND_COMPRESSED) {
+    struct mmfz_map* m = mmf->z;
+    mmfz_lock(m);
+    m->maxresident = bytes / m->block_size > 2 ? bytes / m->block_size : 2;
+    mmfz_evict(m, m->nblocks, m->maxresident);
+    mmfz_unlock(m);
+    ret = 0;
+  } else mmfseterror("could not set budget: mapping is not a compressed file");
+
+  return ret;
+}
+
+#else
+
+static MMFILE* mmfmapcompressed(const char* name)
+{
+  (void)name;
+  mmfseterror("could not map compressed file: lazy decompression needs Linux");
+  return NULL;
+}
+
+static void mmfunmapcompressed(MMFILE* mmf)
+{
+  (void)mmf;
+}
+
+int mmfz_budget(MMFILE* mmf, size_t bytes)
+{
+  (void)mmf;
+  (void)bytes;
+  mmfseterror("could not set budget: lazy decompression needs Linux");
+  return -1;
+}
+
+#endif
+
+#endif
+
+// ============================================================================
+// Platform-independent part. Everything below is built on top of mmfopen.
+// ============================================================================
+
+// MurmurHash3 x64 128-bit variant. File formats below store these hashes, so
+// the function must never change.
+static uint64_t mmf_rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t mmf_fmix64(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+static void mmf_hash128(const void* data, size_t len, uint64_t seed, uint64_t out[2])
+{
+  const unsigned char* p = data;
+  const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = seed, h2 = seed, k1, k2;
+  size_t i, nblocks = len / 16;
+
+  for (i = 0; i < nblocks; i++) {
+    memcpy(&k1, p + i * 16, 8);
+    memcpy(&k2, p + i * 16 + 8, 8);
+
+    k1 *= c1; k1 = mmf_rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = mmf_rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+    k2 *= c2; k2 = mmf_rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = mmf_rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  p += nblocks * 16;
+  k1 = k2 = 0;
+  switch (len & 15) {
+    case 15: k2 ^= (uint64_t)p[14] << 48; /* fallthrough */
+    case 14: k2 ^= (uint64_t)p[13] << 40; /* fallthrough */
+    case 13: k2 ^= (uint64_t)p[12] << 32; /* fallthrough */
+    case 12: k2 ^= (uint64_t)p[11] << 24; /* fallthrough */
+    case 11: k2 ^= (uint64_t)p[10] << 16; /* fallthrough */
+    case 10: k2 ^= (uint64_t)p[9] << 8;   /* fallthrough */
+    case 9:  k2 ^= (uint64_t)p[8];
+             k2 *= c2; k2 = mmf_rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+             /* fallthrough */
+    case 8:  k1 ^= (uint64_t)p[7] << 56;  /* fallthrough */
+    case 7:  k1 ^= (uint64_t)p[6] << 48;  /* fallthrough */
+    case 6:  k1 ^= (uint64_t)p[5] << 40;  /* fallthrough */
+    case 5:  k1 ^= (uint64_t)p[4] << 32;  /* fallthrough */
+    case 4:  k1 ^= (uint64_t)p[3] << 24;  /* fallthrough */
+    case 3:  k1 ^= (uint64_t)p[2] << 16;  /* fallthrough */
+    case 2:  k1 ^= (uint64_t)p[1] << 8;   /* fallthrough */
+    case 1:  k1 ^= (uint64_t)p[0];
+             k1 *= c1; k1 = mmf_rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= (uint64_t)len; h2 ^= (uint64_t)len;
+  h1 += h2; h2 += h1;
+  h1 = mmf_fmix64(h1); h2 = mmf_fmix64(h2);
+  h1 += h2; h2 += h1;
+  out[0] = h1;
+  out[1] = h2;
+}
+
+static uint64_t mmf_hash64(const void* data, size_t len)
+{
+  uint64_t h[2];
+  mmf_hash128(data, len, 0, h);
+  return h[0];
+}
+
+// Grows a heap array so that it can hold at least `need` elements.
+static bool mmf_reserve(void** arr, size_t* cap, size_t need, size_t elemsize)
+{
+  if (need > *cap) {
+    size_t newcap = *cap > 0 ? *cap : 16;
+    void* p;
+    while (newcap < need) newcap *= 2;
+    p = realloc(*arr, newcap * elemsize);
+    if (p == NULL) return false;
+    *arr = p;
+    *cap = newcap;
+  }
+
+  return true;
+}
+
+static size_t mmf_put_varint(unsigned char* buf, uint64_t v)
+{
+  size_t n = 0;
+  while (v >= 0x80) {
+    buf[n++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  buf[n++] = (unsigned char)v;
+  return n;
+}
+
+static bool mmf_get_varint(const unsigned char** p, const unsigned char* end, uint64_t* v)
+{
+  const unsigned char* q = *p;
+  uint64_t result = 0;
+  int shift = 0;
+  while (q < end && shift < 64) {
+    unsigned char b = *q++;
+    result |= (uint64_t)(b & 0x7f) << shift;
+    if (b < 0x80) {
+      *p = q;
+      *v = result;
+      return true;
+    }
+    shift += 7;
+  }
+
+  return false;
+}
+
+// Splits [0, n) into nthreads near-equal parts and returns part tid.
+static void mmf_split(size_t n, int tid, int nthreads, size_t* begin, size_t* end)
+{
+  *begin = n / (size_t)nthreads * (size_t)tid;
+  *end = tid + 1 == nthreads ? n : n / (size_t)nthreads * (size_t)(tid + 1);
+}
+
+static bool mmf_write_padding(FILE* out, uint64_t* pos, uint64_t alignment)
+{
+  static const char zeros[64] = {0};
+  while (*pos % alignment != 0) {
+    size_t chunk = (size_t)(alignment - *pos % alignment);
+    if (chunk > sizeof(zeros)) chunk = sizeof(zeros);
+    if (fwrite(zeros, 1, chunk, out) != chunk) return false;
+    *pos += chunk;
+  }
+
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+// Pack archives: many blobs stored in one file with a hashed name index.
+//
+// Layout: header, blobs (each aligned to MMFPACK_ALIGNMENT), name pool,
+// entry array, slot array. Slots form an open-addressing table with linear
+// probing; each holds entry index + 1, or 0 for an empty slot.
+// ----------------------------------------------------------------------------
+
+#ifndef MMFPACK_ALIGNMENT
+#define MMFPACK_ALIGNMENT 64
+#endif
+
+static const char mmfpack_magic[8] = { 'M', 'M', 'F', 'P', 'A', 'C', 'K', '1' };
+
+struct mmfpack_header {
+  char magic[8];
+  uint64_t count;
+  uint64_t nslots;
+  uint64_t entries;
+  uint64_t slots;
+  uint64_t names;
+  uint64_t reserved[2];
+};
+
+struct mmfpack_entry {
+  uint64_t hash;
+  uint64_t offset;
+  uint64_t size;
+  uint64_t name;
+  uint64_t namelen;
+};
+
+struct MMFPACKW_impl {
+  FILE* out;
+  uint64_t pos;
+  struct mmfpack_entry* entries;
+  size_t count, entriescap;
+  char* names;
+  size_t namessize, namescap;
+  bool failed;
+};
+
+struct MMFPACK_impl {
+  MMFILE* file;
+  const char* base;
+  const struct mmfpack_entry* entries;
+  const uint32_t* slots;
+  const char* names;
+  uint64_t count;
+  uint64_t mask;
+};
+
+MMFPACKW* mmfpack_create(const char* name)
+{
+  MMFPACKW* ret = NULL;
+  MMFPACKW* w = calloc(1, sizeof(*w));
+  if (w != NULL) {
+    w->out = fopen(name, "wb");
+    if (w->out != NULL) {
+      struct mmfpack_header header;
+      memset(&header, 0, sizeof(header));
+      if (fwrite(&header, sizeof(header), 1, w->out) == 1) {
+        w->pos = sizeof(header);
+        ret = w;
+      } else mmfseterror("could not write pack header: %s", strerror(errno));
+      if (ret == NULL) fclose(w->out);
+    } else mmfseterror("could not create the file: %s", strerror(errno));
+    if (ret == NULL) free(w);
+  } else mmfseterror("could not allocate space for MMFPACKW: %s", strerror(errno));
+
+  return ret;
+}
+
+int mmfpack_add(MMFPACKW* w, const char* key, const void* data, size_t size)
+{
+  size_t keylen = strlen(key);
+  struct mmfpack_entry e;
+
+  if (w->failed) return -1;
+  if (!mmf_reserve((void**)&w->entries, &w->entriescap, w->count + 1, sizeof(*w->entries)) ||
+      !mmf_reserve((void**)&w->names, &w->namescap, w->namessize + keylen, 1)) {
+    mmfseterror("could not allocate space for pack index: %s", strerror(errno));
+    w->failed = true;
+    return -1;
+  }
+
+  if (!mmf_write_padding(w->out, &w->pos, MMFPACK_ALIGNMENT) || fwrite(data, 1, size, w->out) != size) {
+    mmfseterror("could not write blob '%s': %s", key, strerror(errno));
+    w->failed = true;
+    return -1;
+  }
+
+  e.hash = mmf_hash64(key, keylen);
+  e.offset = w->pos;
+  e.size = size;
+  e.name = w->namessize;
+  e.namelen = keylen;
+  memcpy(w->names + w->namessize, key, keylen);
+  w->entries[w->count++] = e;
+  w->namessize += keylen;
+  w->pos += size;
+  return 0;
+}
+
+int mmfpack_finish(MMFPACKW* w)
+{
+  int ret = -1;
+  struct mmfpack_header header;
+  uint64_t nslots = 2, i;
+  uint32_t* slots;
+
+  while (nslots < (uint64_t)w->count * 2) nslots *= 2;
+  slots = calloc((size_t)nslots, sizeof(*slots));
+
+  if (!w->failed && slots != NULL) {
+    bool ok = true;
+    for (i = 0; ok && i < w->count; i++) {
+      uint64_t at = w->entries[i].hash & (nslots - 1);
+      while (ok && slots[at] != 0) {
+        const struct mmfpack_entry* other = &w->entries[slots[at] - 1];
+        if (other->hash == w->entries[i].hash && other->namelen == w->entries[i].namelen &&
+            memcmp(w->names + other->name, w->names + w->entries[i].name, (size_t)other->namelen) == 0) {
+          mmfseterror("could not finish pack: duplicate key '%.*s'", (int)other->namelen, w->names + other->name);
+          ok = false;
+        }
+        at = (at + 1) & (nslots - 1);
+      }
+      slots[at] = (uint32_t)(i + 1);
+    }
+
+    if (ok) {
+      memcpy(header.magic, mmfpack_magic, sizeof(header.magic));
+      memset(header.reserved, 0, sizeof(header.reserved));
+      header.count = w->count;
+      header.nslots = nslots;
+      header.names = w->pos;
+      ok = w->namessize == 0 || fwrite(w->names, 1, w->namessize, w->out) == w->namessize;
+      w->pos += w->namessize;
+      ok = ok && mmf_write_padding(w->out, &w->pos, 8);
+      header.entries = w->pos;
+      ok = ok && (w->count == 0 || fwrite(w->entries, sizeof(*w->entries), w->count, w->out) == w->count);
+      w->pos += (uint64_t)w->count * sizeof(*w->entries);
+      header.slots = w->pos;
+      ok = ok && fwrite(slots, sizeof(*slots), (size_t)nslots, w->out) == nslots;
+      if (ok) {
+        rewind(w->out);
+        ok = fwrite(&header, sizeof(header), 1, w->out) == 1;
+      }
+      if (ok) ret = 0;
+      else mmfseterror("could not write pack index: %s", strerror(errno));
+    }
+  }
+  else if (slots == NULL) mmfseterror("could not allocate space for pack slots: %s", strerror(errno));
+
+  if (fclose(w->out) != 0 && ret == 0) {
+    mmfseterror("could not close the file: %s", strerror(errno));
+    ret = -1;
+  }
+
+  free(slots);
+  free(w->entries);
+  free(w->names);
+  free(w);
+  return ret;
+}
+
+// Checks every entry and slot against the mapping once, so that lookups need
+// no checks of their own: blobs and names lie inside the file, slots refer to
+// existing entries, and at least one empty slot ends every probe sequence.
+static bool mmfpack_valid(const char* base, size_t size, const struct mmfpack_header* h)
+{
+  const struct mmfpack_entry* entries;
+  const uint32_t* slots;
+  uint64_t i, empty = 0;
+
+  if (memcmp(h->magic, mmfpack_magic, sizeof(h->magic)) != 0 ||
+      h->entries > size || h->count > (size - h->entries) / sizeof(struct mmfpack_entry) || h->entries % 8 != 0 ||
+      h->slots > size || h->nslots > (size - h->slots) / sizeof(uint32_t) || h->slots % 4 != 0 ||
+      h->names > size || h->nslots == 0 || (h->nslots & (h->nslots - 1)) != 0) return false;
+
+  entries = (const struct mmfpack_entry*)(base + h->entries);
+  slots = (const uint32_t*)(base + h->slots);
+  for (i = 0; i < h->count; i++) {
+    if (entries[i].offset > size || entries[i].size > size - entries[i].offset ||
+        entries[i].name > size - h->names || entries[i].namelen > size - h->names - entries[i].name) return false;
+  }
+  for (i = 0; i < h->nslots; i++) {
+    if (slots[i] > h->count) return false;
+    if (slots[i] == 0) empty++;
+  }
+  return empty > 0;
+}
+
+MMFPACK* mmfpack_open(const char* name)
+{
+  MMFPACK* ret = NULL;
+  MMFPACK* pack = calloc(1, sizeof(*pack));
+  if (pack != NULL) {
+    pack->file = mmfopen(name, "r");
+    if (pack->file != NULL) {
+      struct mmfpack_header header;
+      size_t size = mmfsize(pack->file);
+      pack->base = mmfdata(pack->file);
+      if (size >= sizeof(header)) {
+        memcpy(&header, pack->base, sizeof(header));
+        if (mmfpack_valid(pack->base, size, &header)) {
+          pack->entries = (const struct mmfpack_entry*)(pack->base + header.entries);
+          pack->slots = (const uint32_t*)(pack->base + header.slots);
+          pack->names = pack->base + header.names;
+          pack->count = header.count;
+          pack->mask = header.nslots - 1;
+          ret = pack;
+        } else mmfseterror("could not open pack: not a valid pack archive");
+      } else mmfseterror("could not open pack: file is too small");
+      if (ret == NULL) mmfclose(pack->file);
+    }
+    if (ret == NULL) free(pack);
+  } else mmfseterror("could not allocate space for MMFPACK: %s", strerror(errno));
+
+  return ret;
+}
+
+const void* mmfpack_get(MMFPACK* pack, const char* key, size_t* size)
+{
+  size_t keylen = strlen(key);
+  uint64_t hash = mmf_hash64(key, keylen);
+  uint64_t at = hash & pack->mask;
+  uint32_t slot;
+
+  while ((slot = pack->slots[at]) != 0) {
+    const struct mmfpack_entry* e = &pack->entries[slot - 1];
+    if (e->hash == hash && e->namelen == keylen && memcmp(pack->names + e->name, key, keylen) == 0) {
+      if (size != NULL) *size = (size_t)e->size;
+      return pack->base + e->offset;
+    }
+    at = (at + 1) & pack->mask;
+  }
+
+  return NULL;
+}
+
+size_t mmfpack_count(MMFPACK* pack)
+{
+  return (size_t)pack->count;
+}
+
+void mmfpack_close(MMFPACK* pack)
+{
+  mmfclose(pack->file);
+  free(pack);
+}
+
+// ----------------------------------------------------------------------------
+// Tar archives: regular files of a mapped ustar/pax/GNU tar exposed in place.
+// ----------------------------------------------------------------------------
+
+struct mmftar_entry {
+  size_t name;
+  uint64_t offset;
+  uint64_t size;
+};
+
+struct MMFTAR_impl {
+  MMFILE* file;
+  const char* base;
+  struct mmftar_entry* entries;
+  size_t count, entriescap;
+  char* names;
+  size_t namessize, namescap;
+  size_t* slots;
+  size_t mask;
+};
+
+static bool mmftar_parse_number(const unsigned char* field, size_t len, uint64_t* value)
+{
+  uint64_t v = 0;
+  size_t i = 0;
+
+  if (field[0] & 0x80) {
+    // GNU base-256 extension for values that do not fit into octal digits
+    v = field[0] & 0x3f;
+    for (i = 1; i < len; i++) {
+      if (v >> 56) return false;
+      v = (v << 8) | field[i];
+    }
+  }
+  else {
+    while (i < len && field[i] == ' ') i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+      if (v >> 61) return false;
+      v = (v << 3) | (uint64_t)(field[i] - '0');
+    }
+  }
+
+  *value = v;
+  return true;
+}
+
+static bool mmftar_checksum_ok(const unsigned char* header)
+{
+  uint64_t stored, sum = 0;
+  int i;
+  for (i = 0; i < 512; i++) {
+    sum += (i >= 148 && i < 156) ? ' ' : header[i];
+  }
+
+  return mmftar_parse_number(header + 148, 8, &stored) && stored == sum;
+}
+
+static bool mmftar_add_name(MMFTAR* tar, const char* part1, size_t len1, const char* part2, size_t len2)
+{
+  size_t total = len1 + (len1 > 0 ? 1 : 0) + len2 + 1;
+  char* at;
+  if (!mmf_reserve((void**)&tar->names, &tar->namescap, tar->namessize + total, 1)) return false;
+
+  at = tar->names + tar->namessize;
+  if (len1 > 0) {
+    memcpy(at, part1, len1);
+    at[len1] = '/';
+    at += len1 + 1;
+  }
+  memcpy(at, part2, len2);
+  at[len2] = '\0';
+  return true;
+}
+
+// Extracts "path" and "size" keywords from pax extended header records of the
+// form "<length> <keyword>=<value>\n".
+static void mmftar_parse_pax(const char* p, size_t len, const char** path, size_t* pathlen, uint64_t* size, bool* hassize)
+{
+  size_t pos = 0;
+  while (pos < len) {
+    size_t reclen = 0, i = pos;
+    while (i < len && p[i] >= '0' && p[i] <= '9') reclen = reclen * 10 + (size_t)(p[i++] - '0');
+    if (reclen == 0 || i >= len || p[i] != ' ' || reclen > len - pos) break;
+
+    // The record must end past its length field, with a newline
+    i++;
+    if (i >= pos + reclen || p[pos + reclen - 1] != '\n') break;
+    if (pos + reclen - i > 5 && memcmp(p + i, "path=", 5) == 0) {
+      *path = p + i + 5;
+      *pathlen = pos + reclen - 1 - (i + 5);
+    }
+    else if (pos + reclen - i > 5 && memcmp(p + i, "size=", 5) == 0) {
+      uint64_t v = 0;
+      for (i += 5; i < pos + reclen && p[i] >= '0' && p[i] <= '9'; i++) v = v * 10 + (uint64_t)(p[i] - '0');
+      *size = v;
+      *hassize = true;
+    }
+    pos += reclen;
+  }
+}
+
+static bool mmftar_index(MMFTAR* tar, size_t size)
+{
+  const unsigned char* base = (const unsigned char*)tar->base;
+  const char* longname = NULL;
+  size_t longnamelen = 0;
+  uint64_t paxsize = 0;
+  bool haspaxsize = false;
+  uint64_t pos = 0;
+
+  while (pos + 512 <= size) {
+    const unsigned char* h = base + pos;
+    uint64_t membersize, data = pos + 512;
+    size_t i;
+    char type = (char)h[156];
+
+    for (i = 0; i < 512 && h[i] == 0; i++);
+    if (i == 512) return true;  // end-of-archive marker
+
+    if (!mmftar_checksum_ok(h)) {
+      mmfseterror("could not index tar: bad header checksum at offset %llu", (unsigned long long)pos);
+      return false;
+    }
+
+    if (!mmftar_parse_number(h + 124, 12, &membersize)) {
+      mmfseterror("could not index tar: bad member size at offset %llu", (unsigned long long)pos);
+      return false;
+    }
+    if (haspaxsize) membersize = paxsize;
+    if (membersize > size - data) {
+      mmfseterror("could not index tar: member at offset %llu is truncated", (unsigned long long)pos);
+      return false;
+    }
+
+    switch (type) {
+      case 'L':
+        // GNU long name for the next member
+        longname = (const char*)base + data;
+        for (longnamelen = 0; longnamelen < membersize && longname[longnamelen] != '\0'; longnamelen++);
+        break;
+
+      case 'x':
+        mmftar_parse_pax((const char*)base + data, (size_t)membersize, &longname, &longnamelen, &paxsize, &haspaxsize);
+        break;
+
+      case 'g':
+        break;
+
+      case '0': case '7': case '\0': {
+        struct mmftar_entry e;
+        bool ok;
+        if (!mmf_reserve((void**)&tar->entries, &tar->entriescap, tar->count + 1, sizeof(*tar->entries))) {
+          mmfseterror("could not allocate space for tar index: %s", strerror(errno));
+          return false;
+        }
+
+        e.name = tar->namessize;
+        e.offset = data;
+        e.size = membersize;
+        if (longname != NULL) {
+          ok = mmftar_add_name(tar, NULL, 0, longname, longnamelen);
+          tar->namessize += longnamelen + 1;
+        }
+        else {
+          const char* name = (const char*)h;
+          const char* prefix = (const char*)h + 345;
+          size_t namelen = 0, prefixlen = 0;
+          while (namelen < 100 && name[namelen] != '\0') namelen++;
+          if (memcmp(h + 257, "ustar", 5) == 0) {
+            while (prefixlen < 155 && prefix[prefixlen] != '\0') prefixlen++;
+          }
+          ok = mmftar_add_name(tar, prefix, prefixlen, name, namelen);
+          tar->namessize += prefixlen + (prefixlen > 0 ? 1 : 0) + namelen + 1;
+        }
+
+        if (!ok) {
+          mmfseterror("could not allocate space for tar names: %s", strerror(errno));
+          return false;
+        }
+        tar->entries[tar->count++] = e;
+        longname = NULL;
+        haspaxsize = false;
+        break;
+      }
+
+      default:
+        // Directories, links, devices: nothing to expose
+        longname = NULL;
+        haspaxsize = false;
+        break;
+    }
+
+    pos = data + (membersize + 511) / 512 * 512;
+  }
+
+  return true;
+}
+
+MMFTAR* mmftar_open(const char* name)
+{
+  MMFTAR* ret = NULL;
+  MMFTAR* tar = calloc(1, sizeof(*tar));
+  if (tar != NULL) {
+    tar->file = mmfopen(name, "r");
+    if (tar->file != NULL) {
+      tar->base = mmfdata(tar->file);
+      if (mmftar_index(tar, mmfsize(tar->file))) {
+        size_t i, nslots = 2;
+        while (nslots < tar->count * 2) nslots *= 2;
+        tar->slots = calloc(nslots, sizeof(*tar->slots));
+        if (tar->slots != NULL) {
+          tar->mask = nslots - 1;
+          for (i = tar->count; i-- > 0;) {
+            const char* member = tar->names + tar->entries[i].name;
+            size_t at = (size_t)mmf_hash64(member, strlen(member)) & tar->mask;
+            while (tar->slots[at] != 0) at = (at + 1) & tar->mask;
+            tar->slots[at] = i + 1;
+          }
+          ret = tar;
+        } else mmfseterror("could not allocate space for tar slots: %s", strerror(errno));
+      }
+      if (ret == NULL) mmfclose(tar->file);
+    }
+    if (ret == NULL) {
+      free(tar->entries);
+      free(tar->names);
+      free(tar);
+    }
+  } else mmfseterror("could not allocate space for MMFTAR: %s", strerror(errno));
+
+  return ret;
+}
+
+size_t mmftar_count(MMFTAR* tar)
+{
+  return tar->count;
+}
+
+const char* mmftar_name(MMFTAR* tar, size_t i)
+{
+  return tar->names + tar->entries[i].name;
+}
+
+const void* mmftar_data(MMFTAR* tar, size_t i, size_t* size)
+{
+  if (size != NULL) *size = (size_t)tar->entries[i].size;
+  return tar->base + tar->entries[i].offset;
+}
+
+// When a path occurs several times the last member wins, as it would on
+// extraction: mmftar_open inserts members into the table in reverse order.
+size_t mmftar_find(MMFTAR* tar, const char* name)
+{
+  size_t at = (size_t)mmf_hash64(name, strlen(name)) & tar->mask;
+  size_t slot;
+  while ((slot = tar->slots[at]) != 0) {
+    if (strcmp(tar->names + tar->entries[slot - 1].name, name) == 0) return slot - 1;
+    at = (at + 1) & tar->mask;
+  }
+
+  return tar->count;
+}
+
+void mmftar_close(MMFTAR* tar)
+{
+  mmfclose(tar->file);
+  free(tar->entries);
+  free(tar->names);
+  free(tar->slots);
+  free(tar);
+}
+
+// ----------------------------------------------------------------------------
+// Content-addressed blob store: blobs live in preallocated segment files
+// ("seg000000", "seg000001", ...) and are found through an open-addressing
+// table in a mapped "index" file. Blobs are keyed by their 128-bit hash alone,
+// so two different blobs with equal hashes are treated as one.
+// ----------------------------------------------------------------------------
+
+#define MMFSTORE_ALIGNMENT 64
+#define MMFSTORE_MINSLOTS 1024
+
+static const char mmfstore_magic[8] = { 'M', 'M', 'F', 'S', 'T', 'O', 'R', '1' };
+
+struct mmfstore_header {
+  char magic[8];
+  uint64_t nslots;
+  uint64_t count;
+  uint64_t nsegments;
+  uint64_t tailused;
+  uint64_t reserved[3];
+};
+
+struct mmfstore_slot {
+  uint64_t lo, hi;
+  uint64_t offset;
+  uint64_t size;
+  uint32_t segment;
+  uint32_t used;
+};
+
+struct MMFSTORE_impl {
+  char* dir;
+  size_t segment_size;
+  MMFILE* index;
+  struct mmfstore_header* header;
+  struct mmfstore_slot* slots;
+  MMFILE** segments;
+  size_t segmentscap;
+  uint64_t unflushed;                                      // First segment written since the last flush
+};
+
+MMFHASH mmfhash128(const void* data, size_t size)
+{
+  uint64_t h[2];
+  MMFHASH ret;
+  mmf_hash128(data, size, 0, h);
+  ret.lo = h[0];
+  ret.hi = h[1];
+  return ret;
+}
+
+static char* mmfstore_path(MMFSTORE* store, const char* file, uint64_t n)
+{
+  static char path[4096];
+  if (file != NULL) snprintf(path, sizeof(path), "%s/%s", store->dir, file);
+  else snprintf(path, sizeof(path), "%s/seg%06llu", store->dir, (unsigned long long)n);
+  return path;
+}
+
+static MMFILE* mmfstore_create_index(const char* path, uint64_t nslots)
+{
+  MMFILE* index = mmfcreate(path, sizeof(struct mmfstore_header) + (size_t)nslots * sizeof(struct mmfstore_slot));
+  if (index != NULL) {
+    struct mmfstore_header* header = mmfdata(index);
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, mmfstore_magic, sizeof(header->magic));
+    header->nslots = nslots;
+  }
+
+  return index;
+}
+
+static struct mmfstore_slot* mmfstore_probe(struct mmfstore_slot* slots, uint64_t nslots, MMFHASH key)
+{
+  uint64_t at = key.lo & (nslots - 1);
+  while (slots[at].used && (slots[at].lo != key.lo || slots[at].hi != key.hi)) {
+    at = (at + 1) & (nslots - 1);
+  }
+
+  return &slots[at];
+}
+
+// Doubles the table: a new index file is filled next to the old one and then
+// renamed over it.
+static bool mmfstore_grow(MMFSTORE* store)
+{
+  char tmppath[4096], path[4096];
+  uint64_t i, nslots = store->header->nslots * 2;
+  MMFILE* index;
+
+  snprintf(tmppath, sizeof(tmppath), "%s", mmfstore_path(store, "index.tmp", 0));
+  snprintf(path, sizeof(path), "%s", mmfstore_path(store, "index", 0));
+  index = mmfstore_create_index(tmppath, nslots);
+  if (index != NULL) {
+    struct mmfstore_header* header = mmfdata(index);
+    struct mmfstore_slot* slots = (struct mmfstore_slot*)(header + 1);
+    for (i = 0; i < store->header->nslots; i++) {
+      if (store->slots[i].used) {
+        MMFHASH key;
+        key.lo = store->slots[i].lo;
+        key.hi = store->slots[i].hi;
+        *mmfstore_probe(slots, nslots, key) = store->slots[i];
+      }
+    }
+    header->count = store->header->count;
+    header->nsegments = store->header->nsegments;
+    header->tailused = store->header->tailused;
+
+    if (mmfflush(index) == 0) {
+      mmfclose(store->index);
+      if (rename(tmppath, path) != 0) {
+        remove(path);
+        rename(tmppath, path);
+      }
+      store->index = index;
+      store->header = header;
+      store->slots = slots;
+      return true;
+    }
+    mmfclose(index);
+    remove(tmppath);
+  }
+
+  return false;
+}
+
+static bool mmfstore_add_segment(MMFSTORE* store, size_t size)
+{
+  uint64_t n = store->header->nsegments;
+  MMFILE* segment;
+  if (!mmf_reserve((void**)&store->segments, &store->segmentscap, (size_t)n + 1, sizeof(*store->segments))) {
+    mmfseterror("could not allocate space for segments: %s", strerror(errno));
+    return false;
+  }
+
+  segment = mmfcreate(mmfstore_path(store, NULL, n), size);
+  if (segment == NULL) return false;
+
+  store->segments[n] = segment;
+  store->header->nsegments = n + 1;
+  store->header->tailused = 0;
+  return true;
+}
+
+// Checks an opened index against its segments: every used slot must lie
+// inside its segment, and some slot must be empty so that probing ends.
+static bool mmfstore_valid(MMFSTORE* store)
+{
+  const struct mmfstore_header* h = store->header;
+  uint64_t i, empty = 0;
+
+  if (h->nsegments > 0 && h->tailused > mmfsize(store->segments[h->nsegments - 1])) return false;
+  for (i = 0; i < h->nslots; i++) {
+    const struct mmfstore_slot* slot = &store->slots[i];
+    if (!slot->used) empty++;
+    else if (slot->segment >= h->nsegments || slot->offset > mmfsize(store->segments[slot->segment]) ||
+             slot->size > mmfsize(store->segments[slot->segment]) - slot->offset) return false;
+  }
+  return empty > 0;
+}
+
+MMFSTORE* mmfstore_open(const char* dir, size_t segment_size)
+{
+  MMFSTORE* ret = NULL;
+  MMFSTORE* store = calloc(1, sizeof(*store));
+  if (store != NULL) {
+    store->dir = malloc(strlen(dir) + 1);
+    store->segment_size = segment_size > 0 ? segment_size : (size_t)1 << 30;
+    if (store->dir != NULL) {
+      const char* path;
+      FILE* probe;
+      strcpy(store->dir, dir);
+      path = mmfstore_path(store, "index", 0);
+      probe = fopen(path, "rb");
+      if (probe != NULL) {
+        fclose(probe);
+        store->index = mmfopen(path, "r+");
+      }
+      else store->index = mmfstore_create_index(path, MMFSTORE_MINSLOTS);
+
+      if (store->index != NULL) {
+        struct mmfstore_header* header = mmfdata(store->index);
+        size_t size = mmfsize(store->index);
+        if (size >= sizeof(*header) && memcmp(header->magic, mmfstore_magic, sizeof(header->magic)) == 0 &&
+            header->nslots > 0 && (header->nslots & (header->nslots - 1)) == 0 &&
+            header->nslots == (size - sizeof(*header)) / sizeof(struct mmfstore_slot)) {
+          bool ok = mmf_reserve((void**)&store->segments, &store->segmentscap, (size_t)header->nsegments, sizeof(*store->segments));
+          uint64_t i, opened = 0;
+          store->header = header;
+          store->slots = (struct mmfstore_slot*)(header + 1);
+          store->unflushed = header->nsegments > 0 ? header->nsegments - 1 : 0;
+          if (!ok) mmfseterror("could not allocate space for segments: %s", strerror(errno));
+          for (i = 0; ok && i < header->nsegments; i++) {
+            store->segments[i] = mmfopen(mmfstore_path(store, NULL, i), "r+");
+            if (store->segments[i] != NULL) opened++;
+            else ok = false;
+          }
+          if (ok && !mmfstore_valid(store)) {
+            mmfseterror("could not open store: index refers to data outside its segments");
+            ok = false;
+          }
+          if (ok) ret = store;
+          else for (i = 0; i < opened; i++) mmfclose(store->segments[i]);
+        } else mmfseterror("could not open store: index is not a valid store index");
+        if (ret == NULL) mmfclose(store->index);
+      }
+    } else mmfseterror("could not allocate space for store path: %s", strerror(errno));
+    if (ret == NULL) {
+      free(store->segments);
+      free(store->dir);
+      free(store);
+    }
+  } else mmfseterror("could not allocate space for MMFSTORE: %s", strerror(errno));
+
+  return ret;
+}
+
+int mmfstore_put(MMFSTORE* store, const void* data, size_t size, MMFHASH* key)
+{
+  MMFHASH hash = mmfhash128(data, size);
+  struct mmfstore_slot* slot = mmfstore_probe(store->slots, store->header->nslots, hash);
+  if (key != NULL) *key = hash;
+  if (slot->used) return 0;
+
+  if ((store->header->count + 1) * 2 > store->header->nslots) {
+    if (!mmfstore_grow(store)) return -1;
+    slot = mmfstore_probe(store->slots, store->header->nslots, hash);
+  }
+
+  {
+    uint64_t n = store->header->nsegments;
+    uint64_t offset = (store->header->tailused + MMFSTORE_ALIGNMENT - 1) / MMFSTORE_ALIGNMENT * MMFSTORE_ALIGNMENT;
+    if (n == 0 || offset + size > mmfsize(store->segments[n - 1])) {
+      if (!mmfstore_add_segment(store, size > store->segment_size ? size : store->segment_size)) return -1;
+      n++;
+      offset = 0;
+    }
+
+    memcpy((char*)mmfdata(store->segments[n - 1]) + offset, data, size);
+    slot->lo = hash.lo;
+    slot->hi = hash.hi;
+    slot->offset = offset;
+    slot->size = size;
+    slot->segment = (uint32_t)(n - 1);
+    slot->used = 1;
+    store->header->tailused = offset + size;
+    store->header->count++;
+  }
+
+  return 0;
+}
+
+const void* mmfstore_get(MMFSTORE* store, MMFHASH key, size_t* size)
+{
+  const struct mmfstore_slot* slot = mmfstore_probe(store->slots, store->header->nslots, key);
+  if (!slot->used) return NULL;
+
+  if (size != NULL) *size = (size_t)slot->size;
+  return (const char*)mmfdata(store->segments[slot->segment]) + slot->offset;
+}
+
+// Writes every segment filled since the last flush, not only the one being
+// filled now, and then the index. The index is a shared mapping whose pages
+// the kernel may write back at any time, so after a crash it can refer to
+// blobs that never reached the disk; the order here gives no guarantee.
+int mmfstore_flush(MMFSTORE* store)
+{
+  uint64_t n = store->header->nsegments, i;
+  for (i = store->unflushed; i < n; i++) {
+    if (mmfflush(store->segments[i]) != 0) return -1;
+  }
+  if (mmfflush(store->index) != 0) return -1;
+  store->unflushed = n > 0 ? n - 1 : 0;
+  return 0;
+}
+
+void mmfstore_close(MMFSTORE* store)
+{
+  uint64_t i;
+  for (i = 0; i < store->header->nsegments; i++) mmfclose(store->segments[i]);
+  mmfclose(store->index);
+  free(store->segments);
+  free(store->dir);
+  free(store);
+}
+
+// ----------------------------------------------------------------------------
+// Sorted string tables.
+//
+// Layout: header, data blocks, separator keys, block index, bloom filter.
+// A data block is a run of entries followed by an array of u32 restart
+// offsets and a u32 restart count. Each entry is varint shared prefix length,
+// varint suffix length, varint value length, key suffix, value. Every
+// MMFSST_RESTART-th entry stores its key in full. The block index holds the
+// last key of every block, so a point lookup binary searches the index, then
+// the restarts of one block, then scans at most MMFSST_RESTART entries.
+// ----------------------------------------------------------------------------
+
+#define MMFSST_RESTART 16
+
+static const char mmfsst_magic[8] = { 'M', 'M', 'F', 'S', 'S', 'T', '0', '1' };
+
+struct mmfsst_header {
+  char magic[8];
+  uint64_t count;
+  uint64_t nblocks;
+  uint64_t index;
+  uint64_t keys;
+  uint64_t bloom;
+  uint64_t bloombits;
+  uint32_t bloomk;
+  uint32_t maxkeylen;
+};
+
+struct mmfsst_index {
+  uint64_t offset;
+  uint64_t keyoffset;
+  uint32_t size;
+  uint32_t keylen;
+};
+
+struct MMFSSTW_impl {
+  FILE* out;
+  uint64_t pos;
+  size_t block_size;
+  unsigned bloombits;
+  unsigned char* block;
+  size_t blocksize, blockcap;
+  uint32_t* restarts;
+  size_t nrestarts, restartscap;
+  unsigned char* last;
+  size_t lastlen, lastcap;
+  size_t inblock;
+  struct mmfsst_index* index;
+  size_t nblocks, indexcap;
+  unsigned char* keys;
+  size_t keyssize, keyscap;
+  uint64_t* hashes;
+  size_t count, hashescap;
+  size_t maxkeylen;
+  bool failed;
+};
+
+struct MMFSST_impl {
+  MMFILE* file;
+  const unsigned char* base;
+  struct mmfsst_header header;
+  const struct mmfsst_index* index;
+  const unsigned char* keys;
+  const unsigned char* bloom;
+  uint32_t scanlock;                                       // Guards scanners and the advice that follows it
+  size_t scanners;                                         // Open iterators with data blocks advised sequential
+};
+
+struct MMFSSTITER_impl {
+  MMFSST* t;
+  uint64_t blockno;
+  const unsigned char* p;
+  const unsigned char* end;
+  unsigned char* key;
+  size_t keylen;
+  const unsigned char* value;
+  size_t valuelen;
+  bool pending;
+  bool scanning;                                           // Counted in t->scanners
+};
+
+static int mmfsst_compare(const void* a, size_t alen, const void* b, size_t blen)
+{
+  int c = alen > 0 && blen > 0 ? memcmp(a, b, alen < blen ? alen : blen) : 0;
+  if (c != 0) return c;
+  return alen < blen ? -1 : alen > blen ? 1 : 0;
+}
+
+static void mmfsst_bloom_probes(const void* key, size_t keylen, uint64_t* h1, uint64_t* h2)
+{
+  uint64_t h[2];
+  mmf_hash128(key, keylen, 0, h);
+  *h1 = h[0];
+  *h2 = h[1] | 1;
+}
+
+MMFSSTW* mmfsst_create(const char* name, size_t block_size, unsigned bloom_bits_per_key)
+{
+  MMFSSTW* ret = NULL;
+  MMFSSTW* w = calloc(1, sizeof(*w));
+  if (w != NULL) {
+    w->block_size = block_size > 0 ? block_size : 4096;
+    w->bloombits = bloom_bits_per_key;
+    w->out = fopen(name, "wb");
+    if (w->out != NULL) {
+      struct mmfsst_header header;
+      memset(&header, 0, sizeof(header));
+      if (fwrite(&header, sizeof(header), 1, w->out) == 1) {
+        w->pos = sizeof(header);
+        ret = w;
+      } else mmfseterror("could not write table header: %s", strerror(errno));
+      if (ret == NULL) fclose(w->out);
+    } else mmfseterror("could not create the file: %s", strerror(errno));
+    if (ret == NULL) free(w);
+  } else mmfseterror("could not allocate space for MMFSSTW: %s", strerror(errno));
+
+  return ret;
+}
+
+static bool mmfsst_flush_block(MMFSSTW* w)
+{
+  struct mmfsst_index e;
+  uint32_t n = (uint32_t)w->nrestarts;
+
+  if (w->inblock == 0) return true;
+  if (!mmf_reserve((void**)&w->index, &w->indexcap, w->nblocks + 1, sizeof(*w->index)) ||
+      !mmf_reserve((void**)&w->keys, &w->keyscap, w->keyssize + w->lastlen, 1)) {
+    mmfseterror("could not allocate space for block index: %s", strerror(errno));
+    return false;
+  }
+
+  if (fwrite(w->block, 1, w->blocksize, w->out) != w->blocksize ||
+      fwrite(w->restarts, sizeof(*w->restarts), n, w->out) != n ||
+      fwrite(&n, sizeof(n), 1, w->out) != 1) {
+    mmfseterror("could not write data block: %s", strerror(errno));
+    return false;
+  }
+
+  e.offset = w->pos;
+  e.size = (uint32_t)(w->blocksize + (n + 1) * sizeof(uint32_t));
+  e.keyoffset = w->keyssize;
+  e.keylen = (uint32_t)w->lastlen;
+  memcpy(w->keys + w->keyssize, w->last, w->lastlen);
+  w->keyssize += w->lastlen;
+  w->index[w->nblocks++] = e;
+  w->pos += e.size;
+  w->blocksize = 0;
+  w->nrestarts = 0;
+  w->inblock = 0;
+  return true;
+}
+
+int mmfsst_add(MMFSSTW* w, const void* key, size_t keylen, const void* value, size_t valuelen)
+{
+  unsigned char head[30];
+  size_t shared = 0, headlen;
+
+  if (w->failed) return -1;
+  if (w->count > 0 && mmfsst_compare(w->last, w->lastlen, key, keylen) >= 0) {
+    mmfseterror("could not add entry: keys must be added in strictly ascending order");
+    w->failed = true;
+    return -1;
+  }
+
+  if (w->inblock > 0 && w->blocksize + keylen + valuelen + (w->nrestarts + 2) * sizeof(uint32_t) > w->block_size) {
+    if (!mmfsst_flush_block(w)) {
+      w->failed = true;
+      return -1;
+    }
+  }
+
+  if (w->inblock % MMFSST_RESTART == 0) {
+    if (!mmf_reserve((void**)&w->restarts, &w->restartscap, w->nrestarts + 1, sizeof(*w->restarts))) {
+      mmfseterror("could not allocate space for restarts: %s", strerror(errno));
+      w->failed = true;
+      return -1;
+    }
+    w->restarts[w->nrestarts++] = (uint32_t)w->blocksize;
+  }
+  else {
+    const unsigned char* k = key;
+    size_t limit = keylen < w->lastlen ? keylen : w->lastlen;
+    while (shared < limit && k[shared] == w->last[shared]) shared++;
+  }
+
+  headlen = mmf_put_varint(head, shared);
+  headlen += mmf_put_varint(head + headlen, keylen - shared);
+  headlen += mmf_put_varint(head + headlen, valuelen);
+  if (!mmf_reserve((void**)&w->block, &w->blockcap, w->blocksize + headlen + keylen + valuelen, 1) ||
+      !mmf_reserve((void**)&w->last, &w->lastcap, keylen, 1) ||
+      (w->bloombits > 0 && !mmf_reserve((void**)&w->hashes, &w->hashescap, (w->count + 1) * 2, sizeof(*w->hashes)))) {
+    mmfseterror("could not allocate space for entry: %s", strerror(errno));
+    w->failed = true;
+    return -1;
+  }
+
+  memcpy(w->block + w->blocksize, head, headlen);
+  memcpy(w->block + w->blocksize + headlen, (const unsigned char*)key + shared, keylen - shared);
+  memcpy(w->block + w->blocksize + headlen + keylen - shared, value, valuelen);
+  w->blocksize += headlen + keylen - shared + valuelen;
+  memcpy(w->last, key, keylen);
+  w->lastlen = keylen;
+  if (w->bloombits > 0) mmfsst_bloom_probes(key, keylen, &w->hashes[w->count * 2], &w->hashes[w->count * 2 + 1]);
+  if (keylen > w->maxkeylen) w->maxkeylen = keylen;
+  w->inblock++;
+  w->count++;
+  return 0;
+}
+
+int mmfsst_finish(MMFSSTW* w)
+{
+  int ret = -1;
+  struct mmfsst_header header;
+  unsigned char* bloom = NULL;
+  bool ok = !w->failed && mmfsst_flush_block(w);
+
+  memset(&header, 0, sizeof(header));
+  if (ok && w->bloombits > 0 && w->count > 0) {
+    uint64_t i, j;
+    header.bloombits = ((uint64_t)w->count * w->bloombits + 63) / 64 * 64;
+    header.bloomk = (uint32_t)(w->bloombits * 69 / 100);
+    if (header.bloomk < 1) header.bloomk = 1;
+    if (header.bloomk > 30) header.bloomk = 30;
+    bloom = calloc((size_t)(header.bloombits / 8), 1);
+    if (bloom != NULL) {
+      for (i = 0; i < w->count; i++) {
+        uint64_t h = w->hashes[i * 2], delta = w->hashes[i * 2 + 1];
+        for (j = 0; j < header.bloomk; j++, h += delta) {
+          uint64_t bit = h % header.bloombits;
+          bloom[bit / 8] |= (unsigned char)(1u << (bit % 8));
+        }
+      }
+    }
+    else {
+      mmfseterror("could not allocate space for bloom filter: %s", strerror(errno));
+      ok = false;
+    }
+  }
+
+  if (ok) {
+    memcpy(header.magic, mmfsst_magic, sizeof(header.magic));
+    header.count = w->count;
+    header.nblocks = w->nblocks;
+    header.maxkeylen = (uint32_t)w->maxkeylen;
+    header.keys = w->pos;
+    ok = w->keyssize == 0 || fwrite(w->keys, 1, w->keyssize, w->out) == w->keyssize;
+    w->pos += w->keyssize;
+    ok = ok && mmf_write_padding(w->out, &w->pos, 8);
+    header.index = w->pos;
+    ok = ok && (w->nblocks == 0 || fwrite(w->index, sizeof(*w->index), w->nblocks, w->out) == w->nblocks);
+    w->pos += w->nblocks * sizeof(*w->index);
+    header.bloom = w->pos;
+    if (bloom != NULL) ok = ok && fwrite(bloom, 1, (size_t)(header.bloombits / 8), w->out) == header.bloombits / 8;
+    if (ok) {
+      rewind(w->out);
+      ok = fwrite(&header, sizeof(header), 1, w->out) == 1;
+    }
+    if (ok) ret = 0;
+    else mmfseterror("could not write table index: %s", strerror(errno));
+  }
+
+  if (fclose(w->out) != 0 && ret == 0) {
+    mmfseterror("could not close the file: %s", strerror(errno));
+    ret = -1;
+  }
+
+  free(bloom);
+  free(w->block);
+  free(w->restarts);
+  free(w->last);
+  free(w->index);
+  free(w->keys);
+  free(w->hashes);
+  free(w);
+  return ret;
+}
+
+MMFSST* mmfsst_open(const char* name)
+{
+  MMFSST* ret = NULL;
+  MMFSST* t = calloc(1, sizeof(*t));
+  if (t != NULL) {
+    t->file = mmfopen(name, "r");
+    if (t->file != NULL) {
+      size_t size = mmfsize(t->file);
+      struct mmfsst_header* h = &t->header;
+      t->base = mmfdata(t->file);
+      if (size >= sizeof(*h)) memcpy(h, t->base, sizeof(*h));
+      if (size >= sizeof(*h) && memcmp(h->magic, mmfsst_magic, sizeof(h->magic)) == 0 &&
+          h->index <= size && h->nblocks <= (size - h->index) / sizeof(struct mmfsst_index) &&
+          h->keys <= size && h->bloom <= size && h->bloombits / 8 <= size - h->bloom) {
+        t->index = (const struct mmfsst_index*)(t->base + h->index);
+        t->keys = t->base + h->keys;
+        t->bloom = h->bloombits > 0 ? t->base + h->bloom : NULL;
+        // Point lookups dominate, so read-ahead on data blocks would only
+        // pull in pages nobody asked for. Range scans turn it back on.
+        mmfadvise(t->file, sizeof(*h), (size_t)(h->keys - sizeof(*h)), MMF_ADVICE_RANDOM);
+        ret = t;
+      } else mmfseterror("could not open table: not a valid sorted string table");
+      if (ret == NULL) mmfclose(t->file);
+    }
+    if (ret == NULL) free(t);
+  } else mmfseterror("could not allocate space for MMFSST: %s", strerror(errno));
+
+  return ret;
+}
+
+// Returns the number of the first block whose last key is not less than the
+// specified key, or nblocks if there is none.
+static uint64_t mmfsst_find_block(MMFSST* t, const void* key, size_t keylen)
+{
+  uint64_t lo = 0, hi = t->header.nblocks;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    const struct mmfsst_index* e = &t->index[mid];
+    if (mmfsst_compare(t->keys + e->keyoffset, e->keylen, key, keylen) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+
+  return lo;
+}
+
+static const unsigned char* mmfsst_entry(const unsigned char* p, const unsigned char* end,
+                                         uint64_t* shared, uint64_t* suffixlen, uint64_t* valuelen)
+{
+  if (!mmf_get_varint(&p, end, shared) || !mmf_get_varint(&p, end, suffixlen) ||
+      !mmf_get_varint(&p, end, valuelen) || *suffixlen > (uint64_t)(end - p) ||
+      *valuelen > (uint64_t)(end - p) - *suffixlen) {
+    return NULL;
+  }
+
+  return p;
+}
+
+// Positions p/end at the last restart of a block whose key is not greater than
+// the specified key.
+static void mmfsst_block_bounds(MMFSST* t, uint64_t blockno, const void* key, size_t keylen,
+                                const unsigned char** p, const unsigned char** end)
+{
+  const struct mmfsst_index* e = &t->index[blockno];
+  const unsigned char* block = t->base + e->offset;
+  uint32_t nrestarts, lo = 0, hi;
+  const unsigned char* restarts;
+
+  memcpy(&nrestarts, block + e->size - sizeof(uint32_t), sizeof(nrestarts));
+  restarts = block + e->size - (nrestarts + 1) * sizeof(uint32_t);
+  *end = restarts;
+  hi = nrestarts;
+  while (key != NULL && hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2, at;
+    uint64_t shared, suffixlen, valuelen;
+    const unsigned char* q;
+    memcpy(&at, restarts + mid * sizeof(uint32_t), sizeof(at));
+    q = mmfsst_entry(block + at, restarts, &shared, &suffixlen, &valuelen);
+    if (q != NULL && mmfsst_compare(q, (size_t)suffixlen, key, keylen) <= 0) lo = mid;
+    else hi = mid;
+  }
+
+  if (nrestarts > 0) {
+    uint32_t at;
+    memcpy(&at, restarts + lo * sizeof(uint32_t), sizeof(at));
+    *p = block + at;
+  }
+  else *p = restarts;
+}
+
+const void* mmfsst_get(MMFSST* t, const void* key, size_t keylen, size_t* valuelen)
+{
+  const unsigned char* target = key;
+  const unsigned char *p, *end;
+  uint64_t blockno;
+  size_t match = 0;
+
+  if (t->bloom != NULL) {
+    uint64_t h, delta, j;
+    mmfsst_bloom_probes(key, keylen, &h, &delta);
+    for (j = 0; j < t->header.bloomk; j++, h += delta) {
+      uint64_t bit = h % t->header.bloombits;
+      if (!(t->bloom[bit / 8] & (1u << (bit % 8)))) return NULL;
+    }
+  }
+
+  blockno = mmfsst_find_block(t, key, keylen);
+  if (blockno >= t->header.nblocks) return NULL;
+  mmfsst_block_bounds(t, blockno, key, keylen, &p, &end);
+
+  // Keys are compared without being rebuilt: `match` is the length of common
+  // prefix of the target and the previous key, which is known to be smaller.
+  while (p < end) {
+    uint64_t shared, suffixlen, vlen;
+    const unsigned char* suffix = mmfsst_entry(p, end, &shared, &suffixlen, &vlen);
+    if (suffix == NULL) return NULL;
+    p = suffix + suffixlen + vlen;
+
+    if (shared < match) return NULL;   // this key is already greater
+    if (shared == match) {
+      size_t m = 0, rest = keylen - match;
+      while (m < suffixlen && m < rest && suffix[m] == target[match + m]) m++;
+      if (m == suffixlen && m == rest) {
+        if (valuelen != NULL) *valuelen = (size_t)vlen;
+        return suffix + suffixlen;
+      }
+      if (m == rest || (m < suffixlen && suffix[m] > target[match + m])) return NULL;
+      match += m;
+    }
+  }
+
+  return NULL;
+}
+
+MMFSSTITER* mmfsst_seek(MMFSST* t, const void* key, size_t keylen)
+{
+  MMFSSTITER* it = calloc(1, sizeof(*it));
+  if (it != NULL) {
+    it->key = malloc(t->header.maxkeylen > 0 ? t->header.maxkeylen : 1);
+    if (it->key != NULL) {
+      it->t = t;
+      it->blockno = key != NULL ? mmfsst_find_block(t, key, keylen) : 0;
+      if (it->blockno < t->header.nblocks) {
+        // Ranges of open iterators overlap, so random access comes back only
+        // once the last of them is closed
+        size_t start = (size_t)t->index[it->blockno].offset;
+        while (!mmf_atomic_cas32(&t->scanlock, 0, 1)) mmf_yield();
+        t->scanners++;
+        it->scanning = true;
+        mmfadvise(t->file, start, (size_t)(t->header.keys - start), MMF_ADVICE_SEQUENTIAL);
+        mmf_atomic_store32(&t->scanlock, 0);
+        mmfsst_block_bounds(t, it->blockno, key, keylen, &it->p, &it->end);
+        while (key != NULL && mmfsst_next(it, NULL, NULL, NULL, NULL) &&
+               mmfsst_compare(it->key, it->keylen, key, keylen) < 0);
+        it->pending = key != NULL && it->p != NULL;
+      }
+    }
+    else {
+      mmfseterror("could not allocate space for iterator key: %s", strerror(errno));
+      free(it);
+      it = NULL;
+    }
+  } else mmfseterror("could not allocate space for MMFSSTITER: %s", strerror(errno));
+
+  return it;
+}
+
+int mmfsst_next(MMFSSTITER* it, const void** key, size_t* keylen, const void** value, size_t* valuelen)
+{
+  MMFSST* t = it->t;
+  if (it->pending) {
+    it->pending = false;
+  }
+  else {
+    uint64_t shared, suffixlen, vlen;
+    const unsigned char* suffix;
+    while (it->p != NULL && it->p >= it->end) {
+      if (++it->blockno >= t->header.nblocks) it->p = NULL;
+      else mmfsst_block_bounds(t, it->blockno, NULL, 0, &it->p, &it->end);
+    }
+    if (it->p == NULL || it->blockno >= t->header.nblocks) return 0;
+
+    suffix = mmfsst_entry(it->p, it->end, &shared, &suffixlen, &vlen);
+    if (suffix == NULL || shared > it->keylen || shared + suffixlen > t->header.maxkeylen) {
+      it->p = NULL;
+      return 0;
+    }
+
+    memcpy(it->key + shared, suffix, (size_t)suffixlen);
+    it->keylen = (size_t)(shared + suffixlen);
+    it->value = suffix + suffixlen;
+    it->valuelen = (size_t)vlen;
+    it->p = suffix + suffixlen + vlen;
+  }
+
+  if (key != NULL) *key = it->key;
+  if (keylen != NULL) *keylen = it->keylen;
+  if (value != NULL) *value = it->value;
+  if (valuelen != NULL) *valuelen = it->valuelen;
+  return 1;
+}
+
+void mmfsst_iter_close(MMFSSTITER* it)
+{
+  MMFSST* t = it->t;
+  if (it->scanning) {
+    while (!mmf_atomic_cas32(&t->scanlock, 0, 1)) mmf_yield();
+    if (--t->scanners == 0) {
+      mmfadvise(t->file, sizeof(t->header), (size_t)(t->header.keys - sizeof(t->header)), MMF_ADVICE_RANDOM);
+    }
+    mmf_atomic_store32(&t->scanlock, 0);
+  }
+
+  free(it->key);
+  free(it);
+}
+
+size_t mmfsst_count(MMFSST* t)
+{
+  return (size_t)t->header.count;
+}
+
+void mmfsst_close(MMFSST* t)
+{
+  mmfclose(t->file);
+  free(t);
+}
+
+// ----------------------------------------------------------------------------
+// Filter files: a 64-byte header followed by the filter data, so the data is
+// cache-line aligned inside the mapping.
+//
+// The blocked bloom filter is an array of 512-bit blocks. A key selects one
+// block by the high 64 bits of hash * nblocks and sets k bits in it, taking
+// 9 bits of a remixed hash per probe.
+//
+// The binary fuse filter follows "Binary Fuse Filters: Fast and Smaller Than
+// Xor Filters" (Graf and Lemire, 2022). Its construction peels a hypergraph
+// sequentially; only the bloom filter is built in parallel.
+// ----------------------------------------------------------------------------
+
+static const char mmffilter_magic[8] = { 'M', 'M', 'F', 'F', 'I', 'L', 'T', '2' };
+
+struct mmffilter_header {
+  char magic[8];
+  uint32_t kind;
+  uint32_t k;
+  uint64_t nblocks;
+  uint64_t seed;
+  uint32_t segment_length;
+  uint32_t segment_length_mask;
+  uint32_t segment_count;
+  uint32_t segment_count_length;
+  uint32_t array_length;
+  uint32_t reserved[3];
+};
+
+// Fails to compile if the header stops being 64 bytes long
+typedef char mmffilter_header_size_check[sizeof(struct mmffilter_header) == 64 ? 1 : -1];
+
+struct MMFFILTER_impl {
+  MMFILE* file;
+  struct mmffilter_header header;
+  const uint64_t* blocks;
+  const uint8_t* fingerprints;
+};
+
+uint64_t mmfhash64(const void* data, size_t size)
+{
+  return mmf_hash64(data, size);
+}
+
+static uint64_t mmf_mulhi(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+  __extension__ typedef unsigned __int128 mmf_u128;
+  return (uint64_t)(((mmf_u128)a * b) >> 64);
+#else
+  uint64_t alo = a & 0xffffffff, ahi = a >> 32, blo = b & 0xffffffff, bhi = b >> 32;
+  uint64_t mid1 = ahi * blo, mid2 = alo * bhi;
+  uint64_t carry = ((alo * blo >> 32) + (mid1 & 0xffffffff) + (mid2 & 0xffffffff)) >> 32;
+  return ahi * bhi + (mid1 >> 32) + (mid2 >> 32) + carry;
+#endif
+}
+
+static int mmf_popcount64(uint64_t x)
+{
+#if defined(__GNUC__)
+  return __builtin_popcountll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  return (int)__popcnt64(x);
+#else
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// Index of the lowest set bit, x must not be zero.
+static int mmf_ctz64(uint64_t x)
+{
+#if defined(__GNUC__)
+  return __builtin_ctzll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  unsigned long index;
+  _BitScanForward64(&index, x);
+  return (int)index;
+#else
+  int n = 0;
+  while (!(x & 1)) {
+    x >>= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
+// Natural logarithm for the filter sizing formulas, so that the library does
+// not need to be linked with libm.
+static double mmf_log(double x)
+{
+  double y, y2, term, sum = 0.0;
+  int i, e = 0;
+  while (x >= 2.0) { x /= 2.0; e++; }
+  while (x < 1.0) { x *= 2.0; e--; }
+
+  y = (x - 1.0) / (x + 1.0);
+  y2 = y * y;
+  term = y;
+  for (i = 1; i < 40; i += 2) {
+    sum += term / i;
+    term *= y2;
+  }
+
+  return 2.0 * sum + e * 0.6931471805599453;
+}
+
+static void mmfbloom_mask(uint64_t hash, uint32_t k, uint64_t mask[8])
+{
+  uint64_t h = mmf_fmix64(hash);
+  uint32_t i, used = 0;
+  memset(mask, 0, 8 * sizeof(*mask));
+  for (i = 0; i < k; i++) {
+    uint32_t bit;
+    if (used + 9 > 64) {
+      h = mmf_fmix64(h + 0x9e3779b97f4a7c15ULL);
+      used = 0;
+    }
+    bit = (uint32_t)(h >> used) & 511;
+    used += 9;
+    mask[bit >> 6] |= (uint64_t)1 << (bit & 63);
+  }
+}
+
+static uint64_t mmfbloom_block(uint64_t hash, uint64_t nblocks)
+{
+  return mmf_mulhi(hash, nblocks);
+}
+
+struct mmfbloom_job {
+  uint64_t* blocks;
+  uint64_t nblocks;
+  uint32_t k;
+  const uint64_t* hashes;
+  size_t n;
+};
+
+static void mmfbloom_build_part(void* arg, int tid, int nthreads)
+{
+  struct mmfbloom_job* job = arg;
+  size_t i, begin, end;
+  mmf_split(job->n, tid, nthreads, &begin, &end);
+  for (i = begin; i < end; i++) {
+    uint64_t mask[8];
+    uint64_t* block = job->blocks + mmfbloom_block(job->hashes[i], job->nblocks) * 8;
+    int w;
+    mmfbloom_mask(job->hashes[i], job->k, mask);
+    for (w = 0; w < 8; w++) {
+      if (mask[w] != 0 && (block[w] & mask[w]) != mask[w]) mmf_atomic_or64(&block[w], mask[w]);
+    }
+  }
+}
+
+static uint64_t mmf_splitmix64(uint64_t* state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static uint32_t mmffuse_index(const struct mmffilter_header* h, uint64_t hash, int i)
+{
+  uint64_t at = mmf_mulhi(hash, h->segment_count_length) + (uint64_t)i * h->segment_length;
+  uint64_t low = hash & (((uint64_t)1 << 36) - 1);
+  at ^= (low >> (36 - 18 * i)) & h->segment_length_mask;
+  return (uint32_t)at;
+}
+
+static uint8_t mmffuse_fingerprint(uint64_t hash)
+{
+  return (uint8_t)(hash ^ (hash >> 32));
+}
+
+static void mmffuse_size(struct mmffilter_header* h, uint32_t size)
+{
+  uint32_t capacity, initcount;
+  double factor;
+
+  h->segment_length = size == 0 ? 4 : (uint32_t)1 << (int)(mmf_log((double)size) / mmf_log(3.33) + 2.25);
+  if (h->segment_length > 262144) h->segment_length = 262144;
+  h->segment_length_mask = h->segment_length - 1;
+  factor = size <= 1 ? 0.0 : 0.875 + 0.25 * mmf_log(1000000.0) / mmf_log((double)size);
+  if (size > 1 && factor < 1.125) factor = 1.125;
+  capacity = size <= 1 ? 0 : (uint32_t)((double)size * factor + 0.5);
+  // Unsigned wrap-around below is intended: small filters end up with one segment
+  initcount = (capacity + h->segment_length - 1) / h->segment_length - 2;
+  h->array_length = (initcount + 2) * h->segment_length;
+  h->segment_count = (h->array_length + h->segment_length - 1) / h->segment_length;
+  h->segment_count = h->segment_count <= 2 ? 1 : h->segment_count - 2;
+  h->array_length = (h->segment_count + 2) * h->segment_length;
+  h->segment_count_length = h->segment_count * h->segment_length;
+}
+
+static bool mmffuse_populate(struct mmffilter_header* h, uint8_t* fingerprints, const uint64_t* keys, uint32_t size)
+{
+  uint32_t capacity = h->array_length;
+  uint64_t* reverse_order = calloc((size_t)size + 1, sizeof(uint64_t));
+  uint32_t* alone = calloc(capacity, sizeof(uint32_t));
+  uint8_t* t2count = calloc(capacity, sizeof(uint8_t));
+  uint8_t* reverse_h = calloc((size_t)size + 1, sizeof(uint8_t));
+  uint64_t* t2hash = calloc(capacity, sizeof(uint64_t));
+  uint32_t block_bits = 1, block, *start_pos;
+  uint64_t rng = 0x726b2b9d438b9d4dULL;
+  uint32_t stacksize = 0, duplicates = 0, i, loop;
+  bool ok = false;
+
+  while (((uint32_t)1 << block_bits) < h->segment_count) block_bits++;
+  block = (uint32_t)1 << block_bits;
+  start_pos = calloc(block, sizeof(uint32_t));
+
+  if (reverse_order == NULL || alone == NULL || t2count == NULL || reverse_h == NULL || t2hash == NULL || start_pos == NULL) {
+    mmfseterror("could not allocate space for filter construction: %s", strerror(errno));
+    size = 0;
+    loop = 100;
+  }
+  else {
+    h->seed = mmf_splitmix64(&rng);
+    reverse_order[size] = 1;
+    loop = 0;
+  }
+
+  for (; loop < 100; loop++) {
+    uint32_t qsize = 0;
+    bool error = false;
+
+    for (i = 0; i < block; i++) start_pos[i] = (uint32_t)(((uint64_t)i * size) >> block_bits);
+    for (i = 0; i < size; i++) {
+      uint64_t hash = mmf_fmix64(keys[i] + h->seed);
+      uint64_t segment = hash >> (64 - block_bits);
+      while (reverse_order[start_pos[segment]] != 0) segment = (segment + 1) & (block - 1);
+      reverse_order[start_pos[segment]] = hash;
+      start_pos[segment]++;
+    }
+
+    duplicates = 0;
+    for (i = 0; i < size; i++) {
+      uint64_t hash = reverse_order[i];
+      uint32_t h0 = mmffuse_index(h, hash, 0), h1 = mmffuse_index(h, hash, 1), h2 = mmffuse_index(h, hash, 2);
+      t2count[h0] += 4;
+      t2hash[h0] ^= hash;
+      t2count[h1] += 4;
+      t2count[h1] ^= 1;
+      t2hash[h1] ^= hash;
+      t2count[h2] += 4;
+      t2hash[h2] ^= hash;
+      t2count[h2] ^= 2;
+      if ((t2hash[h0] & t2hash[h1] & t2hash[h2]) == 0) {
+        if ((t2hash[h0] == 0 && t2count[h0] == 8) || (t2hash[h1] == 0 && t2count[h1] == 8) ||
+            (t2hash[h2] == 0 && t2count[h2] == 8)) {
+          // The same key twice: undo it
+          duplicates++;
+          t2count[h0] -= 4;
+          t2hash[h0] ^= hash;
+          t2count[h1] -= 4;
+          t2count[h1] ^= 1;
+          t2hash[h1] ^= hash;
+          t2count[h2] -= 4;
+          t2count[h2] ^= 2;
+          t2hash[h2] ^= hash;
+        }
+      }
+      if (t2count[h0] < 4 || t2count[h1] < 4 || t2count[h2] < 4) error = true;
+    }
+
+    if (!error) {
+      for (i = 0; i < capacity; i++) {
+        alone[qsize] = i;
+        if ((t2count[i] >> 2) == 1) qsize++;
+      }
+
+      stacksize = 0;
+      while (qsize > 0) {
+        uint32_t index = alone[--qsize];
+        if ((t2count[index] >> 2) == 1) {
+          uint64_t hash = t2hash[index];
+          uint32_t h012[5], other;
+          uint8_t found = t2count[index] & 3;
+          h012[0] = mmffuse_index(h, hash, 0);
+          h012[1] = mmffuse_index(h, hash, 1);
+          h012[2] = mmffuse_index(h, hash, 2);
+          h012[3] = h012[0];
+          h012[4] = h012[1];
+          reverse_h[stacksize] = found;
+          reverse_order[stacksize] = hash;
+          stacksize++;
+
+          other = h012[found + 1];
+          alone[qsize] = other;
+          if ((t2count[other] >> 2) == 2) qsize++;
+          t2count[other] -= 4;
+          t2count[other] ^= (uint8_t)(found + 1 > 2 ? found + 1 - 3 : found + 1);
+          t2hash[other] ^= hash;
+
+          other = h012[found + 2];
+          alone[qsize] = other;
+          if ((t2count[other] >> 2) == 2) qsize++;
+          t2count[other] -= 4;
+          t2count[other] ^= (uint8_t)(found + 2 > 2 ? found + 2 - 3 : found + 2);
+          t2hash[other] ^= hash;
+        }
+      }
+
+      if (stacksize + duplicates == size) {
+        ok = true;
+        break;
+      }
+    }
+
+    memset(reverse_order, 0, sizeof(uint64_t) * size);
+    memset(t2count, 0, capacity);
+    memset(t2hash, 0, sizeof(uint64_t) * capacity);
+    h->seed = mmf_splitmix64(&rng);
+  }
+
+  if (ok) {
+    for (i = stacksize; i-- > 0;) {
+      uint64_t hash = reverse_order[i];
+      uint8_t found = reverse_h[i];
+      uint32_t h012[5];
+      h012[0] = mmffuse_index(h, hash, 0);
+      h012[1] = mmffuse_index(h, hash, 1);
+      h012[2] = mmffuse_index(h, hash, 2);
+      h012[3] = h012[0];
+      h012[4] = h012[1];
+      fingerprints[h012[found]] = (uint8_t)(mmffuse_fingerprint(hash) ^ fingerprints[h012[found + 1]] ^ fingerprints[h012[found + 2]]);
+    }
+  }
+  else if (loop >= 100 && size > 0) mmfseterror("could not build fuse filter: construction did not converge");
+
+  free(reverse_order);
+  free(alone);
+  free(t2count);
+  free(reverse_h);
+  free(t2hash);
+  free(start_pos);
+  return ok;
+}
+
+int mmffilter_build(const char* name, int kind, const uint64_t* hashes, size_t n, unsigned bits_per_key, int nthreads)
+{
+  int ret = -1;
+  struct mmffilter_header header;
+  size_t datasize = 0;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, mmffilter_magic, sizeof(header.magic));
+  header.kind = (uint32_t)kind;
+  switch (kind) {
+    case MMF_FILTER_BLOOM:
+      if (bits_per_key == 0) bits_per_key = 10;
+      header.k = bits_per_key * 69 / 100;
+      if (header.k < 1) header.k = 1;
+      if (header.k > 16) header.k = 16;
+      header.nblocks = ((uint64_t)n * bits_per_key + 511) / 512;
+      if (header.nblocks == 0) header.nblocks = 1;
+      datasize = (size_t)header.nblocks * 64;
+      break;
+
+    case MMF_FILTER_FUSE8:
+      if (n <= 0xffffffffu) {
+        mmffuse_size(&header, (uint32_t)n);
+        datasize = header.array_length;
+      } else mmfseterror("could not build fuse filter: too many keys");
+      break;
+
+    default:
+      mmfseterror("could not build filter: unknown filter kind %d", kind);
+      break;
+  }
+
+  if (datasize > 0) {
+    MMFILE* file = mmfcreate(name, sizeof(header) + datasize);
+    if (file != NULL) {
+      char* mem = mmfdata(file);
+      bool ok = true;
+      if (kind == MMF_FILTER_BLOOM) {
+        struct mmfbloom_job job;
+        job.blocks = (uint64_t*)(mem + sizeof(header));
+        job.nblocks = header.nblocks;
+        job.k = header.k;
+        job.hashes = hashes;
+        job.n = n;
+        mmf_parallel(nthreads > 0 ? nthreads : mmf_cpu_count(), mmfbloom_build_part, &job);
+      }
+      else {
+        ok = mmffuse_populate(&header, (uint8_t*)mem + sizeof(header), hashes, (uint32_t)n);
+      }
+
+      memcpy(mem, &header, sizeof(header));
+      if (ok && mmfflush(file) == 0) ret = 0;
+      mmfclose(file);
+      if (ret != 0) remove(name);
+    }
+  }
+
+  return ret;
+}
+
+MMFFILTER* mmffilter_open(const char* name)
+{
+  MMFFILTER* ret = NULL;
+  MMFFILTER* f = calloc(1, sizeof(*f));
+  if (f != NULL) {
+    f->file = mmfopen(name, "r");
+    if (f->file != NULL) {
+      struct mmffilter_header* h = &f->header;
+      size_t size = mmfsize(f->file);
+      const char* data = (const char*)mmfdata(f->file) + sizeof(*h);
+      if (size >= sizeof(*h)) memcpy(h, mmfdata(f->file), sizeof(*h));
+      if (size >= sizeof(*h) && memcmp(h->magic, mmffilter_magic, sizeof(h->magic)) == 0) {
+        size -= sizeof(*h);
+        if (h->kind == MMF_FILTER_BLOOM && h->nblocks > 0 && h->nblocks <= size / 64) {
+          f->blocks = (const uint64_t*)data;
+          ret = f;
+        }
+        // Probes stay below segment_count_length + 2 * segment_length only for
+        // power-of-two segments that the segment count is a whole number of
+        else if (h->kind == MMF_FILTER_FUSE8 && h->array_length <= size && h->segment_length > 0 &&
+                 (h->segment_length & (h->segment_length - 1)) == 0 && h->segment_length_mask == h->segment_length - 1 &&
+                 h->segment_count_length % h->segment_length == 0 &&
+                 (uint64_t)h->segment_count_length + 2 * (uint64_t)h->segment_length <= h->array_length) {
+          f->fingerprints = (const uint8_t*)data;
+          ret = f;
+        } else mmfseterror("could not open filter: filter parameters do not match file size");
+        if (ret != NULL) mmfadvise(f->file, 0, 0, MMF_ADVICE_RANDOM);
+      } else mmfseterror("could not open filter: not a valid filter file");
+      if (ret == NULL) mmfclose(f->file);
+    }
+    if (ret == NULL) free(f);
+  } else mmfseterror("could not allocate space for MMFFILTER: %s", strerror(errno));
+
+  return ret;
+}
+
+int mmffilter_contains(MMFFILTER* f, uint64_t hash)
+{
+  const struct mmffilter_header* h = &f->header;
+  if (h->kind == MMF_FILTER_BLOOM) {
+    const uint64_t* block = f->blocks + mmfbloom_block(hash, h->nblocks) * 8;
+    uint64_t mask[8];
+    mmfbloom_mask(hash, h->k, mask);
+#if defined(__AVX2__)
+    {
+      __m256i b0 = _mm256_loadu_si256((const __m256i*)block), b1 = _mm256_loadu_si256((const __m256i*)block + 1);
+      __m256i m0 = _mm256_loadu_si256((const __m256i*)mask), m1 = _mm256_loadu_si256((const __m256i*)mask + 1);
+      return _mm256_testc_si256(b0, m0) & _mm256_testc_si256(b1, m1);
+    }
+#else
+    {
+      uint64_t missing = 0;
+      int w;
+      for (w = 0; w < 8; w++) missing |= mask[w] & ~block[w];
+      return missing == 0;
+    }
+#endif
+  }
+  else {
+    uint64_t mixed = mmf_fmix64(hash + h->seed);
+    uint8_t x = mmffuse_fingerprint(mixed);
+    x ^= f->fingerprints[mmffuse_index(h, mixed, 0)];
+    x ^= f->fingerprints[mmffuse_index(h, mixed, 1)];
+    x ^= f->fingerprints[mmffuse_index(h, mixed, 2)];
+    return x == 0;
+  }
+}
+
+void mmffilter_close(MMFFILTER* f)
+{
+  mmfclose(f->file);
+  free(f);
+}
+
+// ----------------------------------------------------------------------------
+// Minimal perfect hash tables, BBHash style ("Fast and scalable minimal
+// perfect hashing for massive key sets", Limasset et al., 2017).
+//
+// Every level is a bit array of about MMFPHF_GAMMA bits per key still
+// unplaced. A key whose level position is not shared with another key sets
+// that bit and is placed; colliding keys move on to the next level. The index
+// of a key is the rank of its bit across all levels. Bits are stored in
+// 64-byte lines of one rank word followed by 448 bits, so a level probe and
+// the rank come from one cache line. Each key then owns a record holding its
+// value offset and a 16-bit fingerprint of the key hash; keys themselves are
+// not stored. Layout: header, level table, lines, records (n + 1), values.
+// ----------------------------------------------------------------------------
+
+#define MMFPHF_GAMMA 2
+#define MMFPHF_MAXLEVELS 48
+#define MMFPHF_LINEBITS 448
+
+static const char mmfphf_magic[8] = { 'M', 'M', 'F', 'P', 'H', 'F', '0', '1' };
+
+struct mmfphf_header {
+  char magic[8];
+  uint64_t count;
+  uint64_t nlevels;
+  uint64_t nlines;
+  uint64_t lines;
+  uint64_t records;
+  uint64_t values;
+  uint64_t reserved;
+};
+
+struct mmfphf_level {
+  uint64_t first;
+  uint64_t nbits;
+};
+
+struct MMFPHF_impl {
+  MMFILE* file;
+  const char* base;
+  struct mmfphf_header header;
+  const struct mmfphf_level* levels;
+  const uint64_t* lines;
+  const uint64_t* records;
+};
+
+static uint64_t mmfphf_position(uint64_t lo, uint64_t hi, uint64_t level, uint64_t nbits)
+{
+  return mmf_mulhi(mmf_fmix64(lo + (level + 1) * (hi | 1)), nbits);
+}
+
+static uint16_t mmfphf_fingerprint(uint64_t lo)
+{
+  return (uint16_t)(lo >> 48);
+}
+
+// Returns the rank of global bit `pos` if it is set, or UINT64_MAX.
+static uint64_t mmfphf_rank(const uint64_t* lines, uint64_t pos)
+{
+  const uint64_t* line = lines + pos / MMFPHF_LINEBITS * 8;
+  uint64_t off = pos % MMFPHF_LINEBITS, rank = line[0];
+  uint64_t w = off / 64, bit = (uint64_t)1 << (off % 64), i;
+  if (!(line[1 + w] & bit)) return UINT64_MAX;
+
+  for (i = 0; i < w; i++) rank += (uint64_t)mmf_popcount64(line[1 + i]);
+  return rank + (uint64_t)mmf_popcount64(line[1 + w] & (bit - 1));
+}
+
+static uint64_t mmfphf_lookup(const struct mmfphf_level* levels, uint64_t nlevels, const uint64_t* lines, uint64_t lo, uint64_t hi)
+{
+  uint64_t level;
+  for (level = 0; level < nlevels; level++) {
+    uint64_t pos = mmfphf_position(lo, hi, level, levels[level].nbits);
+    uint64_t rank = mmfphf_rank(lines, levels[level].first + pos);
+    if (rank != UINT64_MAX) return rank;
+  }
+
+  return UINT64_MAX;
+}
+
+struct mmfphf_job {
+  int phase;
+  const MMFPHFITEM* items;
+  size_t n;
+  uint64_t* hashes;        // lo, hi pairs
+  uint64_t* remaining;
+  uint64_t* next;
+  size_t nremaining;
+  size_t* partcounts;
+  uint64_t* taken;
+  uint64_t* collided;
+  uint64_t level, nbits;
+  const struct mmfphf_level* levels;
+  uint64_t nlevels;
+  const uint64_t* lines;
+  uint64_t* slots;
+  uint64_t* records;
+  char* values;
+  bool failed;
+};
+
+static void mmfphf_build_part(void* arg, int tid, int nthreads)
+{
+  struct mmfphf_job* job = arg;
+  size_t i, begin, end, at;
+
+  switch (job->phase) {
+    case 0:
+      // Hash every key
+      mmf_split(job->n, tid, nthreads, &begin, &end);
+      for (i = begin; i < end; i++) {
+        mmf_hash128(job->items[i].key, job->items[i].keylen, 0, &job->hashes[i * 2]);
+        job->remaining[i] = i;
+      }
+      break;
+
+    case 1:
+      // Mark level positions, noting the ones hit twice
+      mmf_split(job->nremaining, tid, nthreads, &begin, &end);
+      for (i = begin; i < end; i++) {
+        const uint64_t* h = &job->hashes[job->remaining[i] * 2];
+        uint64_t pos = mmfphf_position(h[0], h[1], job->level, job->nbits);
+        uint64_t bit = (uint64_t)1 << (pos % 64);
+        if (mmf_atomic_or64(&job->taken[pos / 64], bit) & bit) mmf_atomic_or64(&job->collided[pos / 64], bit);
+      }
+      break;
+
+    case 2:
+      // Count keys that collided, per part
+      mmf_split(job->nremaining, tid, nthreads, &begin, &end);
+      job->partcounts[tid] = 0;
+      for (i = begin; i < end; i++) {
+        const uint64_t* h = &job->hashes[job->remaining[i] * 2];
+        uint64_t pos = mmfphf_position(h[0], h[1], job->level, job->nbits);
+        if (job->collided[pos / 64] & ((uint64_t)1 << (pos % 64))) job->partcounts[tid]++;
+      }
+      break;
+
+    case 3:
+      // Move keys that collided to the next level, keeping their order
+      mmf_split(job->nremaining, tid, nthreads, &begin, &end);
+      at = job->partcounts[tid];
+      for (i = begin; i < end; i++) {
+        const uint64_t* h = &job->hashes[job->remaining[i] * 2];
+        uint64_t pos = mmfphf_position(h[0], h[1], job->level, job->nbits);
+        if (job->collided[pos / 64] & ((uint64_t)1 << (pos % 64))) job->next[at++] = job->remaining[i];
+      }
+      break;
+
+    case 4:
+      // Find the final slot of every key and record its value length
+      mmf_split(job->n, tid, nthreads, &begin, &end);
+      for (i = begin; i < end; i++) {
+        uint64_t slot = mmfphf_lookup(job->levels, job->nlevels, job->lines, job->hashes[i * 2], job->hashes[i * 2 + 1]);
+        if (slot >= job->n) {
+          job->failed = true;
+          continue;
+        }
+        job->slots[i] = slot;
+        job->records[slot] = job->items[i].valuelen;
+      }
+      break;
+
+    case 5:
+      // Fill records and copy values into place
+      mmf_split(job->n, tid, nthreads, &begin, &end);
+      for (i = begin; i < end; i++) {
+        uint64_t slot = job->slots[i];
+        uint64_t offset = job->records[slot] >> 16;
+        memcpy(job->values + offset, job->items[i].value, job->items[i].valuelen);
+        job->records[slot] = (offset << 16) | mmfphf_fingerprint(job->hashes[i * 2]);
+      }
+      break;
+  }
+}
+
+int mmfphf_build(const char* name, const MMFPHFITEM* items, size_t n, int nthreads)
+{
+  int ret = -1;
+  struct mmfphf_job job;
+  struct mmfphf_level levels[MMFPHF_MAXLEVELS];
+  uint64_t** levelbits = calloc(MMFPHF_MAXLEVELS, sizeof(*levelbits));
+  uint64_t nlevels = 0, totalbits = 0, i;
+  bool ok = levelbits != NULL;
+
+  if (nthreads <= 0) nthreads = mmf_cpu_count();
+  memset(&job, 0, sizeof(job));
+  job.items = items;
+  job.n = n;
+  job.hashes = malloc((n > 0 ? n : 1) * 2 * sizeof(uint64_t));
+  job.remaining = malloc((n > 0 ? n : 1) * sizeof(uint64_t));
+  job.next = malloc((n > 0 ? n : 1) * sizeof(uint64_t));
+  job.partcounts = malloc((size_t)nthreads * sizeof(size_t));
+  ok = ok && job.hashes != NULL && job.remaining != NULL && job.next != NULL && job.partcounts != NULL;
+  if (!ok) mmfseterror("could not allocate space for perfect hash construction: %s", strerror(errno));
+
+  if (ok) {
+    job.phase = 0;
+    mmf_parallel(nthreads, mmfphf_build_part, &job);
+    job.nremaining = n;
+  }
+
+  while (ok && job.nremaining > 0) {
+    uint64_t words;
+    size_t sum = 0;
+    int t;
+    if (nlevels == MMFPHF_MAXLEVELS) {
+      mmfseterror("could not build perfect hash: %llu keys collide on every level, keys must be unique", (unsigned long long)job.nremaining);
+      ok = false;
+      break;
+    }
+
+    job.level = nlevels;
+    job.nbits = ((uint64_t)job.nremaining * MMFPHF_GAMMA + 63) / 64 * 64;
+    words = job.nbits / 64;
+    job.taken = calloc((size_t)words, sizeof(uint64_t));
+    job.collided = calloc((size_t)words, sizeof(uint64_t));
+    if (job.taken == NULL || job.collided == NULL) {
+      mmfseterror("could not allocate space for perfect hash level: %s", strerror(errno));
+      free(job.taken);
+      free(job.collided);
+      ok = false;
+      break;
+    }
+
+    job.phase = 1;
+    mmf_parallel(nthreads, mmfphf_build_part, &job);
+    job.phase = 2;
+    mmf_parallel(nthreads, mmfphf_build_part, &job);
+    for (t = 0; t < nthreads; t++) {
+      size_t c = job.partcounts[t];
+      job.partcounts[t] = sum;
+      sum += c;
+    }
+    job.phase = 3;
+    mmf_parallel(nthreads, mmfphf_build_part, &job);
+
+    for (i = 0; i < words; i++) job.taken[i] &= ~job.collided[i];
+    free(job.collided);
+    job.collided = NULL;
+    levelbits[nlevels] = job.taken;
+    levels[nlevels].first = totalbits;
+    levels[nlevels].nbits = job.nbits;
+    totalbits += job.nbits;
+    nlevels++;
+
+    {
+      uint64_t* swap = job.remaining;
+      job.remaining = job.next;
+      job.next = swap;
+      job.nremaining = sum;
+    }
+  }
+
+  if (ok) {
+    struct mmfphf_header header;
+    uint64_t nlines = (totalbits + MMFPHF_LINEBITS - 1) / MMFPHF_LINEBITS;
+    uint64_t valuessize = 0;
+    size_t filesize;
+    MMFILE* file;
+
+    for (i = 0; i < n; i++) valuessize += items[i].valuelen;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, mmfphf_magic, sizeof(header.magic));
+    header.count = n;
+    header.nlevels = nlevels;
+    header.nlines = nlines;
+    header.lines = (sizeof(header) + nlevels * sizeof(struct mmfphf_level) + 63) / 64 * 64;
+    header.records = header.lines + nlines * 64;
+    header.values = header.records + (n + 1) * sizeof(uint64_t);
+    filesize = (size_t)(header.values + valuessize);
+
+    file = mmfcreate(name, filesize);
+    if (file != NULL) {
+      char* mem = mmfdata(file);
+      uint64_t* lines = (uint64_t*)(mem + header.lines);
+      uint64_t rank = 0, l, offset = 0;
+      memcpy(mem, &header, sizeof(header));
+      memcpy(mem + sizeof(header), levels, (size_t)nlevels * sizeof(*levels));
+
+      // Scatter level bits into lines and compute line ranks
+      for (l = 0; l < nlevels; l++) {
+        for (i = 0; i < levels[l].nbits / 64; i++) {
+          uint64_t word = levelbits[l][i];
+          while (word != 0) {
+            uint64_t pos = levels[l].first + i * 64 + (uint64_t)mmf_ctz64(word);
+            lines[pos / MMFPHF_LINEBITS * 8 + 1 + pos % MMFPHF_LINEBITS / 64] |= (uint64_t)1 << (pos % 64);
+            word &= word - 1;
+          }
+        }
+      }
+      for (l = 0; l < nlines; l++) {
+        lines[l * 8] = rank;
+        for (i = 1; i < 8; i++) rank += (uint64_t)mmf_popcount64(lines[l * 8 + i]);
+      }
+
+      job.levels = levels;
+      job.nlevels = nlevels;
+      job.lines = lines;
+      job.records = (uint64_t*)(mem + header.records);
+      job.values = mem + header.values;
+      job.slots = job.next;  // no longer needed for remaining keys
+      job.phase = 4;
+      mmf_parallel(nthreads, mmfphf_build_part, &job);
+      if (!job.failed) {
+        for (i = 0; i < n; i++) {
+          uint64_t len = job.records[i];
+          job.records[i] = offset << 16;
+          offset += len;
+        }
+        job.records[n] = offset << 16;
+        job.phase = 5;
+        mmf_parallel(nthreads, mmfphf_build_part, &job);
+        if (mmfflush(file) == 0) ret = 0;
+      } else mmfseterror("could not build perfect hash: key placement is inconsistent");
+      mmfclose(file);
+      if (ret != 0) remove(name);
+    }
+  }
+
+  for (i = 0; levelbits != NULL && i < nlevels; i++) free(levelbits[i]);
+  free(levelbits);
+  free(job.hashes);
+  free(job.remaining);
+  free(job.next);
+  free(job.partcounts);
+  return ret;
+}
+
+MMFPHF* mmfphf_open(const char* name)
+{
+  MMFPHF* ret = NULL;
+  MMFPHF* t = calloc(1, sizeof(*t));
+  if (t != NULL) {
+    t->file = mmfopen(name, "r");
+    if (t->file != NULL) {
+      struct mmfphf_header* h = &t->header;
+      size_t size = mmfsize(t->file);
+      t->base = mmfdata(t->file);
+      if (size >= sizeof(*h)) memcpy(h, t->base, sizeof(*h));
+      if (size >= sizeof(*h) && memcmp(h->magic, mmfphf_magic, sizeof(h->magic)) == 0 &&
+          h->nlevels <= MMFPHF_MAXLEVELS && h->lines <= size && h->nlines <= (size - h->lines) / 64 &&
+          h->records <= size && h->count < (size - h->records) / sizeof(uint64_t) && h->values <= size) {
+        t->levels = (const struct mmfphf_level*)(t->base + sizeof(*h));
+        t->lines = (const uint64_t*)(t->base + h->lines);
+        t->records = (const uint64_t*)(t->base + h->records);
+        mmfadvise(t->file, 0, 0, MMF_ADVICE_RANDOM);
+        ret = t;
+      } else mmfseterror("could not open perfect hash: not a valid perfect hash table");
+      if (ret == NULL) mmfclose(t->file);
+    }
+    if (ret == NULL) free(t);
+  } else mmfseterror("could not allocate space for MMFPHF: %s", strerror(errno));
+
+  return ret;
+}
+
+const void* mmfphf_get(MMFPHF* t, const void* key, size_t keylen, size_t* valuelen)
+{
+  uint64_t h[2], slot;
+  mmf_hash128(key, keylen, 0, h);
+  slot = mmfphf_lookup(t->levels, t->header.nlevels, t->lines, h[0], h[1]);
+  if (slot >= t->header.count || (uint16_t)t->records[slot] != mmfphf_fingerprint(h[0])) return NULL;
+
+  if (valuelen != NULL) *valuelen = (size_t)((t->records[slot + 1] >> 16) - (t->records[slot] >> 16));
+  return t->base + t->header.values + (t->records[slot] >> 16);
+}
+
+size_t mmfphf_count(MMFPHF* t)
+{
+  return (size_t)t->header.count;
+}
+
+void mmfphf_close(MMFPHF* t)
+{
+  mmfclose(t->file);
+  free(t);
+}
+
+// ----------------------------------------------------------------------------
+// Static search trees (S-trees, see "Static B-Trees" at algorithmica.org).
+//
+// Keys are stored as an implicit B-tree of 64-byte nodes holding 8 keys each;
+// node k has children k * 9 + i + 1. A lookup reads one cache line per level,
+// log9(n) lines in total against log2(n) for binary search, and the first few
+// levels share a handful of pages that stay resident. Unused slots hold
+// UINT64_MAX. A parallel array gives the position of every slot's key in the
+// original sorted array and is read once, after the descent.
+// Layout: header, nodes, positions.
+// ----------------------------------------------------------------------------
+
+#define MMFSTREE_B 8
+
+#if defined(__GNUC__)
+#define MMF_PREFETCH(p) __builtin_prefetch(p)
+#elif defined(_M_X64)
+#define MMF_PREFETCH(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+#define MMF_PREFETCH(p) ((void)(p))
+#endif
+
+static const char mmfstree_magic[8] = { 'M', 'M', 'F', 'S', 'T', 'R', 'E', '1' };
+
+struct mmfstree_header {
+  char magic[8];
+  uint64_t count;
+  uint64_t nnodes;
+  uint64_t nodes;
+  uint64_t positions;
+  uint64_t reserved[3];
+};
+
+struct MMFSTREE_impl {
+  MMFILE* file;
+  uint64_t count;
+  uint64_t nnodes;
+  const uint64_t* nodes;
+  const uint64_t* positions;
+};
+
+struct mmfstree_builder {
+  const uint64_t* keys;
+  uint64_t n, next, nnodes;
+  uint64_t* nodes;
+  uint64_t* positions;
+};
+
+static void mmfstree_fill(struct mmfstree_builder* b, uint64_t k)
+{
+  int i;
+  if (k >= b->nnodes) return;
+
+  for (i = 0; i < MMFSTREE_B; i++) {
+    mmfstree_fill(b, k * (MMFSTREE_B + 1) + i + 1);
+    if (b->next < b->n) {
+      b->nodes[k * MMFSTREE_B + i] = b->keys[b->next];
+      b->positions[k * MMFSTREE_B + i] = b->next++;
+    }
+    else {
+      b->nodes[k * MMFSTREE_B + i] = UINT64_MAX;
+      b->positions[k * MMFSTREE_B + i] = b->n;
+    }
+  }
+  mmfstree_fill(b, k * (MMFSTREE_B + 1) + MMFSTREE_B + 1);
+}
+
+int mmfstree_build(const char* name, const uint64_t* keys, size_t n)
+{
+  int ret = -1;
+  struct mmfstree_header header;
+  MMFILE* file;
+  size_t i;
+
+  for (i = 1; i < n; i++) {
+    if (keys[i - 1] > keys[i]) {
+      mmfseterror("could not build search tree: keys are not sorted");
+      return -1;
+    }
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, mmfstree_magic, sizeof(header.magic));
+  header.count = n;
+  header.nnodes = (n + MMFSTREE_B - 1) / MMFSTREE_B;
+  header.nodes = sizeof(header);
+  header.positions = header.nodes + header.nnodes * MMFSTREE_B * sizeof(uint64_t);
+
+  file = mmfcreate(name, (size_t)(header.positions + header.nnodes * MMFSTREE_B * sizeof(uint64_t)));
+  if (file != NULL) {
+    char* mem = mmfdata(file);
+    struct mmfstree_builder b;
+    b.keys = keys;
+    b.n = n;
+    b.next = 0;
+    b.nnodes = header.nnodes;
+    b.nodes = (uint64_t*)(mem + header.nodes);
+    b.positions = (uint64_t*)(mem + header.positions);
+    mmfstree_fill(&b, 0);
+    memcpy(mem, &header, sizeof(header));
+    if (mmfflush(file) == 0) ret = 0;
+    mmfclose(file);
+    if (ret != 0) remove(name);
+  }
+
+  return ret;
+}
+
+MMFSTREE* mmfstree_open(const char* name)
+{
+  MMFSTREE* ret = NULL;
+  MMFSTREE* t = calloc(1, sizeof(*t));
+  if (t != NULL) {
+    t->file = mmfopen(name, "r");
+    if (t->file != NULL) {
+      struct mmfstree_header h;
+      size_t size = mmfsize(t->file);
+      const char* base = mmfdata(t->file);
+      if (size >= sizeof(h)) memcpy(&h, base, sizeof(h));
+      if (size >= sizeof(h) && memcmp(h.magic, mmfstree_magic, sizeof(h.magic)) == 0 &&
+          h.nodes == sizeof(h) && h.nnodes <= size / (MMFSTREE_B * sizeof(uint64_t) * 2) &&
+          h.positions == h.nodes + h.nnodes * MMFSTREE_B * sizeof(uint64_t) &&
+          h.count <= h.nnodes * MMFSTREE_B && h.positions + h.nnodes * MMFSTREE_B * sizeof(uint64_t) <= size) {
+        uint64_t top = 0, level = 1;
+        t->count = h.count;
+        t->nnodes = h.nnodes;
+        t->nodes = (const uint64_t*)(base + h.nodes);
+        t->positions = (const uint64_t*)(base + h.positions);
+        // Every lookup walks through the top levels: fetch the first five
+        // (7381 nodes, under half a megabyte) up front, leave the rest lazy.
+        while (level <= 6561) {
+          top += level;
+          level *= MMFSTREE_B + 1;
+        }
+        if (top > t->nnodes) top = t->nnodes;
+        mmfadvise(t->file, 0, 0, MMF_ADVICE_RANDOM);
+        if (top > 0) mmfadvise(t->file, (size_t)h.nodes, (size_t)top * MMFSTREE_B * sizeof(uint64_t), MMF_ADVICE_WILLNEED);
+        ret = t;
+      } else mmfseterror("could not open search tree: not a valid search tree");
+      if (ret == NULL) mmfclose(t->file);
+    }
+    if (ret == NULL) free(t);
+  } else mmfseterror("could not allocate space for MMFSTREE: %s", strerror(errno));
+
+  return ret;
+}
+
+// Returns a number of keys in the node that are less than x.
+static unsigned mmfstree_rank(const uint64_t* node, uint64_t x)
+{
+#if defined(__AVX2__)
+  const __m256i flip = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+  __m256i vx = _mm256_xor_si256(_mm256_set1_epi64x((long long)x), flip);
+  __m256i lo = _mm256_xor_si256(_mm256_load_si256((const __m256i*)node), flip);
+  __m256i hi = _mm256_xor_si256(_mm256_load_si256((const __m256i*)node + 1), flip);
+  int mlo = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(vx, lo)));
+  int mhi = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(vx, hi)));
+  return (unsigned)mmf_popcount64((uint64_t)(mlo | mhi << 4));
+#else
+  unsigned i, r = 0;
+  for (i = 0; i < MMFSTREE_B; i++) r += node[i] < x;
+  return r;
+#endif
+}
+
+size_t mmfstree_lower_bound(MMFSTREE* t, uint64_t key)
+{
+  uint64_t k = 0, found = UINT64_MAX;
+  while (k < t->nnodes) {
+    unsigned i = mmfstree_rank(t->nodes + k * MMFSTREE_B, key);
+    if (i < MMFSTREE_B) found = k * MMFSTREE_B + i;
+    k = k * (MMFSTREE_B + 1) + i + 1;
+  }
+
+  return found == UINT64_MAX ? (size_t)t->count : (size_t)t->positions[found];
+}
+
+// Runs up to 16 descents in lockstep, prefetching each next node so that the
+// misses of different keys overlap instead of queueing behind each other.
+void mmfstree_lower_bound_batch(MMFSTREE* t, const uint64_t* keys, size_t count, size_t* out)
+{
+  size_t base;
+  for (base = 0; base < count; base += 16) {
+    uint64_t k[16], found[16];
+    size_t j, m = count - base < 16 ? count - base : 16;
+    bool active = true;
+
+    for (j = 0; j < m; j++) {
+      k[j] = 0;
+      found[j] = UINT64_MAX;
+    }
+
+    while (active) {
+      active = false;
+      for (j = 0; j < m; j++) {
+        if (k[j] < t->nnodes) {
+          unsigned i = mmfstree_rank(t->nodes + k[j] * MMFSTREE_B, keys[base + j]);
+          if (i < MMFSTREE_B) found[j] = k[j] * MMFSTREE_B + i;
+          k[j] = k[j] * (MMFSTREE_B + 1) + i + 1;
+          if (k[j] < t->nnodes) {
+            MMF_PREFETCH(t->nodes + k[j] * MMFSTREE_B);
+            active = true;
+          }
+        }
+      }
+    }
+
+    for (j = 0; j < m; j++) {
+      if (found[j] != UINT64_MAX) MMF_PREFETCH(t->positions + found[j]);
+    }
+    for (j = 0; j < m; j++) {
+      out[base + j] = found[j] == UINT64_MAX ? (size_t)t->count : (size_t)t->positions[found[j]];
+    }
+  }
+}
+
+size_t mmfstree_count(MMFSTREE* t)
+{
+  return (size_t)t->count;
+}
+
+void mmfstree_close(MMFSTREE* t)
+{
+  mmfclose(t->file);
+  free(t);
+}
+
+// ----------------------------------------------------------------------------
+// String dictionaries: a byte trie with nodes numbered in breadth-first
+// order. Children of a node are then consecutive, so the whole structure is
+// three arrays: the label of the edge leading into every node, the first
+// child of every node (children of node i are first[i] .. first[i + 1] - 1,
+// sorted by label), and a bitmap of nodes that end a string. That is a bit
+// over five bytes per node, read in place with no load step.
+// Layout: header, first (nnodes + 1 u32), labels, terminal bitmap.
+// ----------------------------------------------------------------------------
+
+static const char mmftrie_magic[8] = { 'M', 'M', 'F', 'T', 'R', 'I', 'E', '1' };
+
+struct mmftrie_header {
+  char magic[8];
+  uint64_t count;
+  uint64_t nnodes;
+  uint64_t maxlen;
+  uint64_t first;
+  uint64_t labels;
+  uint64_t terminal;
+  uint64_t reserved;
+};
+
+struct MMFTRIEW_impl {
+  char* name;
+  // Builder trie: children are linked lists in label order
+  unsigned char* label;
+  uint32_t* child;
+  uint32_t* lastchild;
+  uint32_t* sibling;
+  uint64_t* terminal;
+  size_t nnodes, nodescap;
+  uint32_t* path;
+  size_t pathcap;
+  char* last;
+  size_t lastlen, lastcap;
+  uint64_t count;
+  bool failed;
+};
+
+struct MMFTRIE_impl {
+  MMFILE* file;
+  struct mmftrie_header header;
+  const uint32_t* first;
+  const unsigned char* labels;
+  const uint64_t* terminal;
+};
+
+// Appends a builder node and returns its number, or 0 when out of memory
+// (node 0 is the root, created first).
+static uint32_t mmftriew_node(MMFTRIEW* w, unsigned char label)
+{
+  size_t n = w->nnodes;
+  if (n >= 0xffffffffu) return 0;
+  if (n == w->nodescap) {
+    // Arrays are grown one by one; capacity is bumped only once all succeed
+    size_t cap = n > 0 ? n * 2 : 1024;
+    void* p;
+    if ((p = realloc(w->label, cap * sizeof(*w->label))) == NULL) return 0;
+    w->label = p;
+    if ((p = realloc(w->child, cap * sizeof(*w->child))) == NULL) return 0;
+    w->child = p;
+    if ((p = realloc(w->lastchild, cap * sizeof(*w->lastchild))) == NULL) return 0;
+    w->lastchild = p;
+    if ((p = realloc(w->sibling, cap * sizeof(*w->sibling))) == NULL) return 0;
+    w->sibling = p;
+    if ((p = realloc(w->terminal, (cap / 64 + 1) * sizeof(*w->terminal))) == NULL) return 0;
+    w->terminal = p;
+    w->nodescap = cap;
+  }
+
+  if (n % 64 == 0) w->terminal[n / 64] = 0;
+  w->label[n] = label;
+  w->child[n] = 0;
+  w->lastchild[n] = 0;
+  w->sibling[n] = 0;
+  w->nnodes++;
+  return (uint32_t)n;
+}
+
+static void mmftriew_free(MMFTRIEW* w)
+{
+  free(w->name);
+  free(w->label);
+  free(w->child);
+  free(w->lastchild);
+  free(w->sibling);
+  free(w->terminal);
+  free(w->path);
+  free(w->last);
+  free(w);
+}
+
+MMFTRIEW* mmftrie_create(const char* name)
+{
+  MMFTRIEW* ret = NULL;
+  MMFTRIEW* w = calloc(1, sizeof(*w));
+  if (w != NULL) {
+    w->name = malloc(strlen(name) + 1);
+    if (w->name != NULL) {
+      strcpy(w->name, name);
+      mmftriew_node(w, 0);
+      if (w->nnodes == 1) ret = w;
+      else mmfseterror("could not allocate space for trie nodes: %s", strerror(errno));
+    } else mmfseterror("could not allocate space for file name: %s", strerror(errno));
+    if (ret == NULL) mmftriew_free(w);
+  } else mmfseterror("could not allocate space for MMFTRIEW: %s", strerror(errno));
+
+  return ret;
+}
+
+int mmftrie_add(MMFTRIEW* w, const char* s, size_t len)
+{
+  size_t common = 0, i;
+  uint32_t node;
+
+  if (w->failed) return -1;
+  if (w->count > 0 && mmfsst_compare(w->last, w->lastlen, s, len) >= 0) {
+    mmfseterror("could not add string: strings must be added in strictly ascending order");
+    w->failed = true;
+    return -1;
+  }
+
+  if (!mmf_reserve((void**)&w->path, &w->pathcap, len + 1, sizeof(*w->path)) ||
+      !mmf_reserve((void**)&w->last, &w->lastcap, len, 1)) {
+    mmfseterror("could not allocate space for trie path: %s", strerror(errno));
+    w->failed = true;
+    return -1;
+  }
+
+  // path[d] is the node reached by the first d bytes of the previous string,
+  // and strings arrive sorted, so new nodes always become last children.
+  if (w->count > 0) {
+    while (common < len && common < w->lastlen && s[common] == w->last[common]) common++;
+  }
+  w->path[0] = 0;
+  node = w->path[common];
+  for (i = common; i < len; i++) {
+    uint32_t next = mmftriew_node(w, (unsigned char)s[i]);
+    if (next == 0) {
+      mmfseterror("could not allocate space for trie nodes: %s", strerror(errno));
+      w->failed = true;
+      return -1;
+    }
+    if (w->lastchild[node] != 0) w->sibling[w->lastchild[node]] = next;
+    else w->child[node] = next;
+    w->lastchild[node] = next;
+    node = next;
+    w->path[i + 1] = node;
+  }
+
+  w->terminal[node / 64] |= (uint64_t)1 << (node % 64);
+  if (len > 0) memcpy(w->last, s, len);
+  w->lastlen = len;
+  w->count++;
+  return 0;
+}
+
+int mmftrie_finish(MMFTRIEW* w)
+{
+  int ret = -1;
+  uint32_t* order = w->failed ? NULL : malloc(w->nnodes * sizeof(*order));
+
+  if (!w->failed && order != NULL) {
+    struct mmftrie_header header;
+    MMFILE* file;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, mmftrie_magic, sizeof(header.magic));
+    header.count = w->count;
+    header.nnodes = w->nnodes;
+    header.first = sizeof(header);
+    header.labels = header.first + (w->nnodes + 1) * sizeof(uint32_t);
+    header.terminal = (header.labels + w->nnodes + 7) / 8 * 8;
+
+    file = mmfcreate(w->name, (size_t)(header.terminal + (w->nnodes + 63) / 64 * sizeof(uint64_t)));
+    if (file != NULL) {
+      char* mem = mmfdata(file);
+      uint32_t* first = (uint32_t*)(mem + header.first);
+      unsigned char* labels = (unsigned char*)mem + header.labels;
+      uint64_t* terminal = (uint64_t*)(mem + header.terminal);
+      size_t head, tail = 1, levelend = 1, depth = 0;
+
+      order[0] = 0;
+      for (head = 0; head < tail; head++) {
+        uint32_t old = order[head], c;
+        if (head == levelend) {
+          depth++;
+          levelend = tail;
+        }
+        first[head] = (uint32_t)tail;
+        labels[head] = w->label[old];
+        if (w->terminal[old / 64] & ((uint64_t)1 << (old % 64))) {
+          terminal[head / 64] |= (uint64_t)1 << (head % 64);
+          header.maxlen = depth;
+        }
+        for (c = w->child[old]; c != 0; c = w->sibling[c]) order[tail++] = c;
+      }
+      first[w->nnodes] = (uint32_t)w->nnodes;
+
+      memcpy(mem, &header, sizeof(header));
+      if (mmfflush(file) == 0) ret = 0;
+      mmfclose(file);
+      if (ret != 0) remove(w->name);
+    }
+  }
+  else if (!w->failed) mmfseterror("could not allocate space for trie order: %s", strerror(errno));
+
+  free(order);
+  mmftriew_free(w);
+  return ret;
+}
+
+MMFTRIE* mmftrie_open(const char* name)
+{
+  MMFTRIE* ret = NULL;
+  MMFTRIE* t = calloc(1, sizeof(*t));
+  if (t != NULL) {
+    t->file = mmfopen(name, "r");
+    if (t->file != NULL) {
+      struct mmftrie_header* h = &t->header;
+      size_t size = mmfsize(t->file);
+      const char* base = mmfdata(t->file);
+      if (size >= sizeof(*h)) memcpy(h, base, sizeof(*h));
+      if (size >= sizeof(*h) && memcmp(h->magic, mmftrie_magic, sizeof(h->magic)) == 0 && h->nnodes > 0 &&
+          h->first == sizeof(*h) && h->labels == h->first + (h->nnodes + 1) * sizeof(uint32_t) &&
+          h->terminal >= h->labels + h->nnodes && h->terminal <= size &&
+          (h->nnodes + 63) / 64 <= (size - h->terminal) / sizeof(uint64_t)) {
+        t->first = (const uint32_t*)(base + h->first);
+        t->labels = (const unsigned char*)base + h->labels;
+        t->terminal = (const uint64_t*)(base + h->terminal);
+        ret = t;
+      } else mmfseterror("could not open dictionary: not a valid string dictionary");
+      if (ret == NULL) mmfclose(t->file);
+    }
+    if (ret == NULL) free(t);
+  } else mmfseterror("could not allocate space for MMFTRIE: %s", strerror(errno));
+
+  return ret;
+}
+
+static bool mmftrie_is_terminal(MMFTRIE* t, uint32_t node)
+{
+  return (t->terminal[node / 64] >> (node % 64)) & 1;
+}
+
+// Returns the child of a node along the label, or 0 (the root is nobody's child).
+static uint32_t mmftrie_child(MMFTRIE* t, uint32_t node, unsigned char label)
+{
+  uint32_t lo = t->first[node], hi = t->first[node + 1];
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (t->labels[mid] < label) lo = mid + 1;
+    else hi = mid;
+  }
+
+  return lo < t->first[node + 1] && t->labels[lo] == label ? lo : 0;
+}
+
+static uint32_t mmftrie_walk(MMFTRIE* t, const char* s, size_t len)
+{
+  uint32_t node = 0;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    node = mmftrie_child(t, node, (unsigned char)s[i]);
+    if (node == 0) return UINT32_MAX;
+  }
+
+  return node;
+}
+
+int mmftrie_contains(MMFTRIE* t, const char* s, size_t len)
+{
+  uint32_t node = mmftrie_walk(t, s, len);
+  return node != UINT32_MAX && mmftrie_is_terminal(t, node);
+}
+
+struct mmftrie_frame {
+  uint32_t node;
+  uint32_t child;
+};
+
+// Depth-first walk below `start`, whose path is already in buf[0 .. base).
+// With a query, rows[d] holds the edit distance row of the query against the
+// path down to depth d; subtrees whose whole row exceeds maxdist are skipped.
+static size_t mmftrie_dfs(MMFTRIE* t, uint32_t start, char* buf, size_t base, struct mmftrie_frame* stack,
+                          const char* query, size_t qlen, unsigned maxdist, unsigned* rows, MMFTRIECB cb, void* ctx)
+{
+  size_t found = 0;
+  long depth = 0;
+
+  if (mmftrie_is_terminal(t, start) && (query == NULL || rows[qlen] <= maxdist)) {
+    found++;
+    if (cb != NULL && cb(buf, base, ctx)) return found;
+  }
+
+  stack[0].node = start;
+  stack[0].child = t->first[start];
+  while (depth >= 0) {
+    struct mmftrie_frame* f = &stack[depth];
+    uint32_t c;
+    if (f->child >= t->first[f->node + 1]) {
+      depth--;
+      continue;
+    }
+
+    c = f->child++;
+    buf[base + (size_t)depth] = (char)t->labels[c];
+    if (query != NULL) {
+      const unsigned* prev = rows + (size_t)depth * (qlen + 1);
+      unsigned* row = rows + (size_t)(depth + 1) * (qlen + 1);
+      unsigned best;
+      size_t j;
+      row[0] = prev[0] + 1;
+      best = row[0];
+      for (j = 1; j <= qlen; j++) {
+        unsigned v = prev[j - 1] + ((unsigned char)query[j - 1] != t->labels[c]);
+        if (prev[j] + 1 < v) v = prev[j] + 1;
+        if (row[j - 1] + 1 < v) v = row[j - 1] + 1;
+        row[j] = v;
+        if (v < best) best = v;
+      }
+      if (best > maxdist) continue;
+    }
+
+    if (mmftrie_is_terminal(t, c) && (query == NULL || rows[(size_t)(depth + 1) * (qlen + 1) + qlen] <= maxdist)) {
+      found++;
+      if (cb != NULL && cb(buf, base + (size_t)depth + 1, ctx)) return found;
+    }
+
+    depth++;
+    stack[depth].node = c;
+    stack[depth].child = t->first[c];
+  }
+
+  return found;
+}
+
+size_t mmftrie_prefix(MMFTRIE* t, const char* prefix, size_t len, MMFTRIECB cb, void* ctx)
+{
+  size_t found = 0;
+  uint32_t node = mmftrie_walk(t, prefix, len);
+  if (node != UINT32_MAX) {
+    size_t depth = (size_t)t->header.maxlen >= len ? (size_t)t->header.maxlen - len : 0;
+    char* buf = malloc(len + depth + 1);
+    struct mmftrie_frame* stack = malloc((depth + 1) * sizeof(*stack));
+    if (buf != NULL && stack != NULL) {
+      memcpy(buf, prefix, len);
+      found = mmftrie_dfs(t, node, buf, len, stack, NULL, 0, 0, NULL, cb, ctx);
+    } else mmfseterror("could not allocate space for search: %s", strerror(errno));
+    free(buf);
+    free(stack);
+  }
+
+  return found;
+}
+
+size_t mmftrie_fuzzy(MMFTRIE* t, const char* s, size_t len, unsigned maxdist, MMFTRIECB cb, void* ctx)
+{
+  size_t found = 0, depth = (size_t)t->header.maxlen, j;
+  char* buf = malloc(depth + 1);
+  struct mmftrie_frame* stack = malloc((depth + 1) * sizeof(*stack));
+  unsigned* rows = malloc((depth + 2) * (len + 1) * sizeof(*rows));
+  if (buf != NULL && stack != NULL && rows != NULL) {
+    for (j = 0; j <= len; j++) rows[j] = (unsigned)j;
+    found = mmftrie_dfs(t, 0, buf, 0, stack, s, len, maxdist, rows, cb, ctx);
+  } else mmfseterror("could not allocate space for search: %s", strerror(errno));
+
+  free(buf);
+  free(stack);
+  free(rows);
+  return found;
+}
+
+size_t mmftrie_count(MMFTRIE* t)
+{
+  return (size_t)t->header.count;
+}
+
+void mmftrie_close(MMFTRIE* t)
+{
+  mmfclose(t->file);
+  free(t);
+}
+
+// ----------------------------------------------------------------------------
+// Inverted indexes: a pack archive with one posting list blob per term.
+// A list is cut into blocks of 128 document numbers. Full blocks are stored
+// as differences to the number four places back, bit-packed at the width of
+// the largest difference in four interleaved 32-bit lanes: entry i goes to
+// lane i % 4, so one 16-byte load yields a difference for every lane and the
+// numbers come back with a vector prefix sum. The last partial block is
+// stored as varint gaps. A skip entry {last number, offset} per block lets
+// intersection jump over blocks without decoding them.
+// Layout of a list: count, block count, skip entries, block data.
+// ----------------------------------------------------------------------------
+
+#define MMFIDX_BLOCK 128
+
+struct mmfidx_list_header {
+  uint32_t count;
+  uint32_t nblocks;
+};
+
+struct mmfidx_skip {
+  uint32_t last;
+  uint32_t offset;
+};
+
+struct MMFIDXW_impl {
+  MMFPACKW* pack;
+  unsigned char* buf;
+  size_t bufcap;
+};
+
+struct MMFIDX_impl {
+  MMFPACK* pack;
+};
+
+struct mmfidx_list {
+  uint32_t count;
+  uint32_t nblocks;
+  const struct mmfidx_skip* skip;
+  const unsigned char* data;
+  size_t datasize;
+};
+
+static unsigned mmfidx_width(uint32_t v)
+{
+  unsigned b = 0;
+  while (b < 32 && (v >> b) != 0) b++;
+  return b;
+}
+
+// Packs 128 differences at b bits each into b * 16 bytes of lane-interleaved words.
+static void mmfidx_pack(const uint32_t* deltas, unsigned b, unsigned char* out)
+{
+  unsigned lane, p;
+  memset(out, 0, (size_t)b * 16);
+  for (lane = 0; lane < 4; lane++) {
+    unsigned bit = 0;
+    for (p = 0; p < MMFIDX_BLOCK / 4; p++, bit += b) {
+      uint64_t v = (uint64_t)deltas[p * 4 + lane] << (bit % 32);
+      unsigned char* word = out + ((bit / 32) * 4 + lane) * 4;
+      uint32_t w;
+      memcpy(&w, word, 4);
+      w |= (uint32_t)v;
+      memcpy(word, &w, 4);
+      if (bit % 32 + b > 32) {
+        memcpy(&w, word + 16, 4);
+        w |= (uint32_t)(v >> 32);
+        memcpy(word + 16, &w, 4);
+      }
+    }
+  }
+}
+
+// Unpacks a full block and undoes the differences, `base` being the last
+// number of the previous block.
+static void mmfidx_unpack(const unsigned char* in, unsigned b, uint32_t base, uint32_t* out)
+{
+#if defined(__SSE2__) || defined(_M_X64)
+  const __m128i* src = (const __m128i*)in;
+  __m128i mask = _mm_set1_epi32(b < 32 ? (int)((1u << b) - 1) : -1);
+  __m128i prev = _mm_set1_epi32((int)base);
+  __m128i acc = b > 0 ? _mm_loadu_si128(src++) : _mm_setzero_si128();
+  unsigned bit = 0, p;
+  for (p = 0; p < MMFIDX_BLOCK / 4; p++) {
+    __m128i v = _mm_srl_epi32(acc, _mm_cvtsi32_si128((int)bit));
+    if (bit + b > 32) {
+      acc = _mm_loadu_si128(src++);
+      v = _mm_or_si128(v, _mm_sll_epi32(acc, _mm_cvtsi32_si128((int)(32 - bit))));
+      bit = bit + b - 32;
+    } else {
+      bit += b;
+      if (bit == 32 && p + 1 < MMFIDX_BLOCK / 4) {
+        acc = _mm_loadu_si128(src++);
+        bit = 0;
+      }
+    }
+    prev = _mm_add_epi32(prev, _mm_and_si128(v, mask));
+    _mm_storeu_si128((__m128i*)(out + p * 4), prev);
+  }
+#else
+  uint32_t mask = b < 32 ? (1u << b) - 1 : 0xffffffffu;
+  unsigned lane, p;
+  for (lane = 0; lane < 4; lane++) {
+    uint32_t value = base;
+    unsigned bit = 0;
+    for (p = 0; p < MMFIDX_BLOCK / 4; p++, bit += b) {
+      const unsigned char* word = in + ((bit / 32) * 4 + lane) * 4;
+      uint64_t v;
+      uint32_t w;
+      memcpy(&w, word, 4);
+      v = w;
+      if (bit % 32 + b > 32) {
+        memcpy(&w, word + 16, 4);
+        v |= (uint64_t)w << 32;
+      }
+      value += (uint32_t)(v >> (bit % 32)) & mask;
+      out[p * 4 + lane] = value;
+    }
+  }
+#endif
+}
+
+MMFIDXW* mmfidx_create(const char* name)
+{
+  MMFIDXW* ret = NULL;
+  MMFIDXW* w = calloc(1, sizeof(*w));
+  if (w != NULL) {
+    w->pack = mmfpack_create(name);
+    if (w->pack != NULL) ret = w;
+    else free(w);
+  } else mmfseterror("could not allocate space for MMFIDXW: %s", strerror(errno));
+
+  return ret;
+}
+
+int mmfidx_add(MMFIDXW* w, const char* term, const uint32_t* docs, size_t n)
+{
+  struct mmfidx_list_header header;
+  struct mmfidx_skip* skip;
+  size_t i, pos, nblocks = (n + MMFIDX_BLOCK - 1) / MMFIDX_BLOCK;
+  uint32_t deltas[MMFIDX_BLOCK];
+
+  for (i = 1; i < n; i++) {
+    if (docs[i] <= docs[i - 1]) {
+      mmfseterror("could not add term '%s': document numbers must be strictly ascending", term);
+      return -1;
+    }
+  }
+
+  // Worst case is 4 bytes per number in full blocks and 5 in the tail
+  if (!mmf_reserve((void**)&w->buf, &w->bufcap, sizeof(header) + nblocks * sizeof(*skip) + n * 5, 1)) {
+    mmfseterror("could not allocate space for posting list: %s", strerror(errno));
+    return -1;
+  }
+
+  header.count = (uint32_t)n;
+  header.nblocks = (uint32_t)nblocks;
+  memcpy(w->buf, &header, sizeof(header));
+  skip = (struct mmfidx_skip*)(w->buf + sizeof(header));
+  pos = sizeof(header) + nblocks * sizeof(*skip);
+  for (i = 0; i < n; i += MMFIDX_BLOCK) {
+    size_t k = i / MMFIDX_BLOCK, len = n - i < MMFIDX_BLOCK ? n - i : MMFIDX_BLOCK, j;
+    uint32_t base = i > 0 ? docs[i - 1] : 0;
+    skip[k].last = docs[i + len - 1];
+    skip[k].offset = (uint32_t)(pos - sizeof(header) - nblocks * sizeof(*skip));
+    if (len == MMFIDX_BLOCK) {
+      uint32_t maxdelta = 0;
+      unsigned b;
+      for (j = 0; j < MMFIDX_BLOCK; j++) {
+        deltas[j] = docs[i + j] - (j >= 4 ? docs[i + j - 4] : base);
+        maxdelta |= deltas[j];
+      }
+      b = mmfidx_width(maxdelta);
+      mmfidx_pack(deltas, b, w->buf + pos);
+      pos += (size_t)b * 16;
+    } else {
+      for (j = 0; j < len; j++) pos += mmf_put_varint(w->buf + pos, docs[i + j] - (j > 0 ? docs[i + j - 1] : base));
+    }
+  }
+
+  return mmfpack_add(w->pack, term, w->buf, pos);
+}
+
+int mmfidx_finish(MMFIDXW* w)
+{
+  int ret = mmfpack_finish(w->pack);
+  free(w->buf);
+  free(w);
+  return ret;
+}
+
+MMFIDX* mmfidx_open(const char* name)
+{
+  MMFIDX* ret = NULL;
+  MMFIDX* idx = calloc(1, sizeof(*idx));
+  if (idx != NULL) {
+    idx->pack = mmfpack_open(name);
+    if (idx->pack != NULL) ret = idx;
+    else free(idx);
+  } else mmfseterror("could not allocate space for MMFIDX: %s", strerror(errno));
+
+  return ret;
+}
+
+static bool mmfidx_find(MMFIDX* idx, const char* term, struct mmfidx_list* list)
+{
+  struct mmfidx_list_header header;
+  size_t size;
+  const unsigned char* blob = mmfpack_get(idx->pack, term, &size);
+
+  if (blob == NULL || size < sizeof(header)) return false;
+  memcpy(&header, blob, sizeof(header));
+  if (header.nblocks != (header.count + (uint64_t)MMFIDX_BLOCK - 1) / MMFIDX_BLOCK ||
+      header.nblocks > (size - sizeof(header)) / sizeof(struct mmfidx_skip)) {
+    mmfseterror("could not read posting list of '%s': list is corrupted", term);
+    return false;
+  }
+
+  list->count = header.count;
+  list->nblocks = header.nblocks;
+  list->skip = (const struct mmfidx_skip*)(blob + sizeof(header));
+  list->data = blob + sizeof(header) + header.nblocks * sizeof(struct mmfidx_skip);
+  list->datasize = size - sizeof(header) - header.nblocks * sizeof(struct mmfidx_skip);
+  return true;
+}
+
+// Decodes block k into out and returns the number of entries, or 0 if the block is corrupted.
+static size_t mmfidx_decode_block(const struct mmfidx_list* list, size_t k, uint32_t* out)
+{
+  size_t begin = list->skip[k].offset;
+  size_t end = k + 1 < list->nblocks ? list->skip[k + 1].offset : list->datasize;
+  size_t len = k + 1 < list->nblocks ? MMFIDX_BLOCK : list->count - k * MMFIDX_BLOCK;
+  uint32_t base = k > 0 ? list->skip[k - 1].last : 0;
+
+  if (begin > end || end > list->datasize) return 0;
+  if (len == MMFIDX_BLOCK) {
+    if ((end - begin) % 16 != 0 || end - begin > 32 * 16) return 0;
+    mmfidx_unpack(list->data + begin, (unsigned)((end - begin) / 16), base, out);
+  } else {
+    const unsigned char* p = list->data + begin;
+    size_t j;
+    for (j = 0; j < len; j++) {
+      uint64_t v;
+      if (!mmf_get_varint(&p, list->data + end, &v)) return 0;
+      base += (uint32_t)v;
+      out[j] = base;
+    }
+  }
+
+  return len;
+}
+
+size_t mmfidx_count(MMFIDX* idx, const char* term)
+{
+  struct mmfidx_list list;
+  return mmfidx_find(idx, term, &list) ? list.count : 0;
+}
+
+size_t mmfidx_decode(MMFIDX* idx, const char* term, uint32_t* out)
+{
+  struct mmfidx_list list;
+  size_t n = 0, k;
+  if (mmfidx_find(idx, term, &list)) {
+    for (k = 0; k < list.nblocks; k++) {
+      size_t len = mmfidx_decode_block(&list, k, out + n);
+      if (len == 0) {
+        mmfseterror("could not decode posting list of '%s': list is corrupted", term);
+        return 0;
+      }
+      n += len;
+    }
+  }
+
+  return n;
+}
+
+struct mmfidx_cursor {
+  const struct mmfidx_list* list;
+  size_t block;
+  size_t n, pos;
+  uint32_t buf[MMFIDX_BLOCK];
+};
+
+// Moves the cursor to the first number not less than target. Returns 1 if
+// it equals target, 0 if not, and -1 once the list (or its data) runs out.
+static int mmfidx_seek(struct mmfidx_cursor* c, uint32_t target)
+{
+  const struct mmfidx_list* list = c->list;
+  size_t lo, hi, step;
+
+  if (c->n == 0 || c->buf[c->n - 1] < target) {
+    // Gallop over the skip entries, then binary search the bracketed range
+    size_t k = c->n == 0 ? c->block : c->block + 1;
+    if (k >= list->nblocks) return -1;
+    for (step = 1; k + step < list->nblocks && list->skip[k + step].last < target; step *= 2) k += step;
+    lo = k;
+    hi = k + step < list->nblocks ? k + step : list->nblocks;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (list->skip[mid].last < target) lo = mid + 1;
+      else hi = mid;
+    }
+    if (lo >= list->nblocks) return -1;
+    c->block = lo;
+    c->n = mmfidx_decode_block(list, lo, c->buf);
+    c->pos = 0;
+    if (c->n == 0) return -1;
+  }
+
+  // The block holds an answer; gallop from the current position inside it
+  lo = c->pos;
+  for (step = 1; lo + step < c->n && c->buf[lo + step] < target; step *= 2) lo += step;
+  hi = lo + step < c->n ? lo + step : c->n - 1;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (c->buf[mid] < target) lo = mid + 1;
+    else hi = mid;
+  }
+  c->pos = lo;
+  return c->buf[lo] == target;
+}
+
+static int mmfidx_compare_lists(const void* a, const void* b)
+{
+  uint32_t x = ((const struct mmfidx_list*)a)->count, y = ((const struct mmfidx_list*)b)->count;
+  return x < y ? -1 : x > y;
+}
+
+size_t mmfidx_intersect(MMFIDX* idx, const char* const* terms, size_t nterms, uint32_t* out)
+{
+  size_t n = 0, i, j;
+  struct mmfidx_list* lists = nterms > 0 ? malloc(nterms * sizeof(*lists)) : NULL;
+  struct mmfidx_cursor* cursor = malloc(sizeof(*cursor));
+
+  if (lists != NULL && cursor != NULL) {
+    bool found = true;
+    for (i = 0; found && i < nterms; i++) found = mmfidx_find(idx, terms[i], &lists[i]);
+
+    // Rarest term first: its list is decoded whole and the others are only
+    // probed for its numbers, skipping blocks that cannot contain them.
+    if (found) {
+      qsort(lists, nterms, sizeof(*lists), mmfidx_compare_lists);
+      for (i = 0; i < lists[0].nblocks; i++) {
+        size_t len = mmfidx_decode_block(&lists[0], i, out + n);
+        if (len == 0) {
+          mmfseterror("could not decode posting list: list is corrupted");
+          n = 0;
+          break;
+        }
+        n += len;
+      }
+
+      for (i = 1; i < nterms && n > 0; i++) {
+        size_t kept = 0;
+        cursor->list = &lists[i];
+        cursor->block = 0;
+        cursor->n = 0;
+        for (j = 0; j < n; j++) {
+          int r = mmfidx_seek(cursor, out[j]);
+          if (r < 0) break;
+          if (r > 0) out[kept++] = out[j];
+        }
+        n = kept;
+      }
+    }
+  } else if (nterms > 0) mmfseterror("could not allocate space for intersection: %s", strerror(errno));
+
+  free(lists);
+  free(cursor);
+  return n;
+}
+
+size_t mmfidx_terms(MMFIDX* idx)
+{
+  return mmfpack_count(idx->pack);
+}
+
+void mmfidx_close(MMFIDX* idx)
+{
+  mmfpack_close(idx->pack);
+  free(idx);
+}
+
+// ----------------------------------------------------------------------------
+// Compressed bitmaps in the portable Roaring format, used where they lie.
+// Values are split by their high 16 bits into containers of up to 65536 low
+// halves, each stored as a sorted array (up to 4096 values), a 1024-word
+// bitmap or a list of runs. The container directory is read on open; the
+// containers themselves are never copied. Nothing in the format is aligned,
+// so every access goes through unaligned loads.
+// Layout: cookie, run flags, {key, cardinality - 1} pairs, offsets, containers.
+// ----------------------------------------------------------------------------
+
+#define MMFROAR_COOKIE_NORUN 12346
+#define MMFROAR_COOKIE 12347
+#define MMFROAR_ARRAY 0
+#define MMFROAR_BITMAP 1
+#define MMFROAR_RUN 2
+#define MMFROAR_AND 0
+#define MMFROAR_OR 1
+#define MMFROAR_ANDNOT 2
+
+struct mmfroar_container {
+  uint32_t key;
+  uint32_t type;
+  uint32_t card;
+  uint32_t nruns;
+  const unsigned char* data;
+};
+
+struct MMFROARING_impl {
+  MMFILE* file;
+  struct mmfroar_container* containers;
+  size_t count;
+  uint64_t card;
+};
+
+struct mmfroar_scratch {
+  uint64_t a[1024];
+  uint64_t b[1024];
+  uint16_t lows[65536];
+};
+
+static uint16_t mmfroar_u16(const unsigned char* p)
+{
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t mmfroar_u32(const unsigned char* p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static bool mmfroar_write_u16(FILE* out, uint32_t v)
+{
+  uint16_t x = (uint16_t)v;
+  return fwrite(&x, sizeof(x), 1, out) == 1;
+}
+
+static bool mmfroar_write_u32(FILE* out, uint32_t v)
+{
+  return fwrite(&v, sizeof(v), 1, out) == 1;
+}
+
+struct mmfroar_chunk {
+  size_t begin;
+  uint32_t key;
+  uint32_t card;
+  uint32_t nruns;
+  uint32_t type;
+};
+
+static uint32_t mmfroar_payload_size(const struct mmfroar_chunk* c)
+{
+  return c->type == MMFROAR_ARRAY ? 2 * c->card : c->type == MMFROAR_BITMAP ? 8192 : 2 + 4 * c->nruns;
+}
+
+int mmfroaring_write(const char* name, const uint32_t* values, size_t n)
+{
+  int ret = -1;
+  struct mmfroar_chunk* chunks = NULL;
+  size_t nchunks = 0, chunkscap = 0, i, j;
+  bool hasruns = false;
+  FILE* out;
+
+  for (i = 1; i < n; i++) {
+    if (values[i] <= values[i - 1]) {
+      mmfseterror("could not write bitmap: values must be strictly ascending");
+      return -1;
+    }
+  }
+
+  // Group values by their high halves and pick the smallest container for each
+  for (i = 0; i < n; i = j) {
+    struct mmfroar_chunk c;
+    c.begin = i;
+    c.key = values[i] >> 16;
+    c.nruns = 1;
+    for (j = i + 1; j < n && values[j] >> 16 == c.key; j++) {
+      if (values[j] != values[j - 1] + 1) c.nruns++;
+    }
+    c.card = (uint32_t)(j - i);
+    c.type = c.card <= 4096 ? MMFROAR_ARRAY : MMFROAR_BITMAP;
+    if (2 + 4 * c.nruns < (c.type == MMFROAR_ARRAY ? 2 * c.card : 8192)) {
+      c.type = MMFROAR_RUN;
+      hasruns = true;
+    }
+    if (!mmf_reserve((void**)&chunks, &chunkscap, nchunks + 1, sizeof(*chunks))) {
+      mmfseterror("could not allocate space for bitmap containers: %s", strerror(errno));
+      free(chunks);
+      return -1;
+    }
+    chunks[nchunks++] = c;
+  }
+
+  out = fopen(name, "wb");
+  if (out != NULL) {
+    uint32_t offset;
+    bool ok;
+    if (hasruns) {
+      ok = mmfroar_write_u32(out, MMFROAR_COOKIE | (uint32_t)(nchunks - 1) << 16);
+      for (i = 0; ok && i < nchunks; i += 8) {
+        unsigned char flags = 0;
+        for (j = i; j < nchunks && j < i + 8; j++) {
+          if (chunks[j].type == MMFROAR_RUN) flags |= (unsigned char)(1u << (j - i));
+        }
+        ok = fwrite(&flags, 1, 1, out) == 1;
+      }
+      offset = 4 + (uint32_t)(nchunks + 7) / 8 + 4 * (uint32_t)nchunks;
+    } else {
+      ok = mmfroar_write_u32(out, MMFROAR_COOKIE_NORUN) && mmfroar_write_u32(out, (uint32_t)nchunks);
+      offset = 8 + 4 * (uint32_t)nchunks;
+    }
+    for (i = 0; ok && i < nchunks; i++) {
+      ok = mmfroar_write_u16(out, chunks[i].key) && mmfroar_write_u16(out, chunks[i].card - 1);
+    }
+
+    // Small bitmaps with runs omit the offsets, readers walk the containers instead
+    if (!hasruns || nchunks >= 4) {
+      offset += 4 * (uint32_t)nchunks;
+      for (i = 0; ok && i < nchunks; i++) {
+        ok = mmfroar_write_u32(out, offset);
+        offset += mmfroar_payload_size(&chunks[i]);
+      }
+    }
+
+    for (i = 0; ok && i < nchunks; i++) {
+      const struct mmfroar_chunk* c = &chunks[i];
+      const uint32_t* v = values + c->begin;
+      if (c->type == MMFROAR_ARRAY) {
+        for (j = 0; ok && j < c->card; j++) ok = mmfroar_write_u16(out, v[j]);
+      } else if (c->type == MMFROAR_BITMAP) {
+        uint64_t words[1024];
+        memset(words, 0, sizeof(words));
+        for (j = 0; j < c->card; j++) words[(v[j] & 0xffff) / 64] |= (uint64_t)1 << (v[j] % 64);
+        ok = fwrite(words, sizeof(words), 1, out) == 1;
+      } else {
+        size_t start = 0;
+        ok = mmfroar_write_u16(out, c->nruns);
+        for (j = 1; ok && j <= c->card; j++) {
+          if (j == c->card || v[j] != v[j - 1] + 1) {
+            ok = mmfroar_write_u16(out, v[start]) && mmfroar_write_u16(out, (uint32_t)(j - 1 - start));
+            start = j;
+          }
+        }
+      }
+    }
+
+    if (ok) ret = 0;
+    else mmfseterror("could not write bitmap: %s", strerror(errno));
+    if (fclose(out) != 0 && ret == 0) {
+      mmfseterror("could not close the file: %s", strerror(errno));
+      ret = -1;
+    }
+  } else mmfseterror("could not create the file: %s", strerror(errno));
+
+  free(chunks);
+  return ret;
+}
+
+// Reads the container directory of a serialized bitmap. Returns 0 if the
+// data is not one, -1 if out of memory.
+static int mmfroar_parse(MMFROARING* r, const unsigned char* base, size_t size)
+{
+  const unsigned char *runflags = NULL, *desc, *offsets = NULL;
+  uint32_t cookie;
+  size_t n, i, pos;
+
+  if (size < 4) return 0;
+  cookie = mmfroar_u32(base);
+  if ((cookie & 0xffff) == MMFROAR_COOKIE) {
+    n = (cookie >> 16) + 1;
+    runflags = base + 4;
+    pos = 4 + (n + 7) / 8;
+  } else if (cookie == MMFROAR_COOKIE_NORUN && size >= 8) {
+    n = mmfroar_u32(base + 4);
+    pos = 8;
+  } else return 0;
+
+  if (n > 65536 || pos > size || (size - pos) / 4 < n) return 0;
+  desc = base + pos;
+  pos += 4 * n;
+  if (runflags == NULL || n >= 4) {
+    if ((size - pos) / 4 < n) return 0;
+    offsets = base + pos;
+    pos += 4 * n;
+  }
+
+  r->containers = malloc((n > 0 ? n : 1) * sizeof(*r->containers));
+  if (r->containers == NULL) {
+    mmfseterror("could not allocate space for bitmap containers: %s", strerror(errno));
+    return -1;
+  }
+
+  for (i = 0; i < n; i++) {
+    struct mmfroar_container* c = &r->containers[i];
+    size_t payload, k;
+    c->key = mmfroar_u16(desc + 4 * i);
+    c->card = mmfroar_u16(desc + 4 * i + 2) + 1u;
+    c->nruns = 0;
+    if (i > 0 && c->key <= r->containers[i - 1].key) return 0;
+    if (offsets != NULL) pos = mmfroar_u32(offsets + 4 * i);
+    if (pos > size) return 0;
+    if (runflags != NULL && (runflags[i / 8] >> (i % 8)) & 1) {
+      if (size - pos < 2) return 0;
+      c->type = MMFROAR_RUN;
+      c->nruns = mmfroar_u16(base + pos);
+      payload = 2 + 4 * (size_t)c->nruns;
+    } else if (c->card <= 4096) {
+      c->type = MMFROAR_ARRAY;
+      payload = 2 * (size_t)c->card;
+    } else {
+      c->type = MMFROAR_BITMAP;
+      payload = 8192;
+    }
+    if (size - pos < payload) return 0;
+    c->data = base + pos;
+    pos += payload;
+
+    // Runs must stay inside the container, everything else is bounded by construction
+    for (k = 0; k < c->nruns; k++) {
+      if ((uint32_t)mmfroar_u16(c->data + 2 + 4 * k) + mmfroar_u16(c->data + 4 + 4 * k) > 0xffff) return 0;
+    }
+    r->card += c->card;
+  }
+
+  r->count = n;
+  return 1;
+}
+
+MMFROARING* mmfroaring_view(const void* data, size_t size)
+{
+  MMFROARING* ret = NULL;
+  MMFROARING* r = calloc(1, sizeof(*r));
+  if (r != NULL) {
+    int parsed = mmfroar_parse(r, data, size);
+    if (parsed > 0) ret = r;
+    else {
+      if (parsed == 0) mmfseterror("could not read bitmap: not a valid serialized bitmap");
+      free(r->containers);
+      free(r);
+    }
+  } else mmfseterror("could not allocate space for MMFROARING: %s", strerror(errno));
+
+  return ret;
+}
+
+MMFROARING* mmfroaring_open(const char* name)
+{
+  MMFROARING* ret = NULL;
+  MMFILE* file = mmfopen(name, "r");
+  if (file != NULL) {
+    ret = mmfroaring_view(mmfdata(file), mmfsize(file));
+    if (ret != NULL) ret->file = file;
+    else mmfclose(file);
+  }
+
+  return ret;
+}
+
+uint64_t mmfroaring_cardinality(MMFROARING* r)
+{
+  return r->card;
+}
+
+static bool mmfroar_container_contains(const struct mmfroar_container* c, uint16_t low)
+{
+  size_t lo = 0, hi;
+  if (c->type == MMFROAR_BITMAP) {
+    return (mmfroar_u32(c->data + (size_t)(low / 32) * 4) >> (low % 32)) & 1;
+  } else if (c->type == MMFROAR_ARRAY) {
+    hi = c->card;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (mmfroar_u16(c->data + 2 * mid) < low) lo = mid + 1;
+      else hi = mid;
+    }
+    return lo < c->card && mmfroar_u16(c->data + 2 * lo) == low;
+  } else {
+    // Find the last run starting at or before low
+    hi = c->nruns;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (mmfroar_u16(c->data + 2 + 4 * mid) <= low) lo = mid + 1;
+      else hi = mid;
+    }
+    return lo > 0 && low - mmfroar_u16(c->data + 2 + 4 * (lo - 1)) <= mmfroar_u16(c->data + 4 + 4 * (lo - 1));
+  }
+}
+
+static const struct mmfroar_container* mmfroar_find(MMFROARING* r, uint32_t key)
+{
+  size_t lo = 0, hi = r->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (r->containers[mid].key < key) lo = mid + 1;
+    else hi = mid;
+  }
+
+  return lo < r->count && r->containers[lo].key == key ? &r->containers[lo] : NULL;
+}
+
+int mmfroaring_contains(MMFROARING* r, uint32_t value)
+{
+  const struct mmfroar_container* c = mmfroar_find(r, value >> 16);
+  return c != NULL && mmfroar_container_contains(c, (uint16_t)value);
+}
+
+static void mmfroar_to_bitmap(const struct mmfroar_container* c, uint64_t* words)
+{
+  size_t i;
+  if (c->type == MMFROAR_BITMAP) {
+    memcpy(words, c->data, 8192);
+    return;
+  }
+
+  memset(words, 0, 8192);
+  if (c->type == MMFROAR_ARRAY) {
+    for (i = 0; i < c->card; i++) {
+      uint16_t v = mmfroar_u16(c->data + 2 * i);
+      words[v / 64] |= (uint64_t)1 << (v % 64);
+    }
+  } else {
+    for (i = 0; i < c->nruns; i++) {
+      uint32_t start = mmfroar_u16(c->data + 2 + 4 * i);
+      uint32_t end = start + mmfroar_u16(c->data + 4 + 4 * i) + 1;
+      uint32_t first = start / 64, last = (end - 1) / 64, w;
+      uint64_t head = ~(uint64_t)0 << (start % 64), tail = ~(uint64_t)0 >> (63 - (end - 1) % 64);
+      if (first == last) words[first] |= head & tail;
+      else {
+        words[first] |= head;
+        for (w = first + 1; w < last; w++) words[w] = ~(uint64_t)0;
+        words[last] |= tail;
+      }
+    }
+  }
+}
+
+static size_t mmfroar_extract(const uint64_t* words, uint16_t* lows)
+{
+  size_t n = 0, i;
+  for (i = 0; i < 1024; i++) {
+    uint64_t w = words[i];
+    while (w != 0) {
+      lows[n++] = (uint16_t)(i * 64 + (size_t)mmf_ctz64(w));
+      w &= w - 1;
+    }
+  }
+
+  return n;
+}
+
+static size_t mmfroar_to_array(const struct mmfroar_container* c, uint16_t* lows, uint64_t* words)
+{
+  size_t i;
+  if (c->type == MMFROAR_ARRAY) {
+    for (i = 0; i < c->card; i++) lows[i] = mmfroar_u16(c->data + 2 * i);
+    return c->card;
+  }
+
+  mmfroar_to_bitmap(c, words);
+  return mmfroar_extract(words, lows);
+}
+
+static void mmfroar_words(uint64_t* a, const uint64_t* b, int op)
+{
+  size_t i;
+#if defined(__SSE2__) || defined(_M_X64)
+  for (i = 0; i < 1024; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + i)), y = _mm_loadu_si128((const __m128i*)(b + i));
+    x = op == MMFROAR_AND ? _mm_and_si128(x, y) : op == MMFROAR_OR ? _mm_or_si128(x, y) : _mm_andnot_si128(y, x);
+    _mm_storeu_si128((__m128i*)(a + i), x);
+  }
+#else
+  for (i = 0; i < 1024; i++) a[i] = op == MMFROAR_AND ? a[i] & b[i] : op == MMFROAR_OR ? a[i] | b[i] : a[i] & ~b[i];
+#endif
+}
+
+// Intersects two sorted arrays. The vector loop compares blocks of eight
+// against all eight rotations of each other and drops whichever block ends first.
+static size_t mmfroar_intersect_arrays(const unsigned char* a, size_t na, const unsigned char* b, size_t nb, uint16_t* lows)
+{
+  size_t i = 0, j = 0, n = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+  while (i + 8 <= na && j + 8 <= nb) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + 2 * i)), vb = _mm_loadu_si128((const __m128i*)(b + 2 * j));
+    __m128i eq = _mm_cmpeq_epi16(va, vb);
+    uint16_t amax = mmfroar_u16(a + 2 * (i + 7)), bmax = mmfroar_u16(b + 2 * (j + 7));
+    int rot, mask;
+    for (rot = 1; rot < 8; rot++) {
+      vb = _mm_or_si128(_mm_srli_si128(vb, 2), _mm_slli_si128(vb, 14));
+      eq = _mm_or_si128(eq, _mm_cmpeq_epi16(va, vb));
+    }
+    for (mask = _mm_movemask_epi8(eq) & 0x5555; mask != 0; mask &= mask - 1) {
+      lows[n++] = mmfroar_u16(a + 2 * (i + (size_t)mmf_ctz64((uint64_t)mask) / 2));
+    }
+    if (amax <= bmax) i += 8;
+    if (bmax <= amax) j += 8;
+  }
+#endif
+  while (i < na && j < nb) {
+    uint16_t x = mmfroar_u16(a + 2 * i), y = mmfroar_u16(b + 2 * j);
+    if (x < y) i++;
+    else if (y < x) j++;
+    else {
+      lows[n++] = x;
+      i++;
+      j++;
+    }
+  }
+
+  return n;
+}
+
+static size_t mmfroar_union_arrays(const unsigned char* a, size_t na, const unsigned char* b, size_t nb, uint16_t* lows)
+{
+  size_t i = 0, j = 0, n = 0;
+  while (i < na && j < nb) {
+    uint16_t x = mmfroar_u16(a + 2 * i), y = mmfroar_u16(b + 2 * j);
+    lows[n++] = x < y ? x : y;
+    i += x <= y;
+    j += y <= x;
+  }
+  for (; i < na; i++) lows[n++] = mmfroar_u16(a + 2 * i);
+  for (; j < nb; j++) lows[n++] = mmfroar_u16(b + 2 * j);
+  return n;
+}
+
+// Combines two containers with the same key (either may be absent) into sorted low halves.
+static size_t mmfroar_combine(const struct mmfroar_container* a, const struct mmfroar_container* b, int op,
+                              struct mmfroar_scratch* s)
+{
+  size_t n = 0, i;
+  if (a == NULL || b == NULL) {
+    if (op == MMFROAR_AND || a == NULL) return op == MMFROAR_OR && b != NULL ? mmfroar_to_array(b, s->lows, s->a) : 0;
+    return mmfroar_to_array(a, s->lows, s->a);
+  }
+
+  if (a->type == MMFROAR_ARRAY && b->type == MMFROAR_ARRAY && op != MMFROAR_ANDNOT) {
+    if (op == MMFROAR_AND) return mmfroar_intersect_arrays(a->data, a->card, b->data, b->card, s->lows);
+    return mmfroar_union_arrays(a->data, a->card, b->data, b->card, s->lows);
+  }
+
+  // A small array against anything else is filtered by membership tests
+  if (op != MMFROAR_OR && (a->type == MMFROAR_ARRAY || (op == MMFROAR_AND && b->type == MMFROAR_ARRAY))) {
+    const struct mmfroar_container* small = a->type == MMFROAR_ARRAY ? a : b;
+    const struct mmfroar_container* other = small == a ? b : a;
+    bool want = op == MMFROAR_AND;
+    for (i = 0; i < small->card; i++) {
+      uint16_t v = mmfroar_u16(small->data + 2 * i);
+      if (mmfroar_container_contains(other, v) == want) s->lows[n++] = v;
+    }
+    return n;
+  }
+
+  mmfroar_to_bitmap(a, s->a);
+  mmfroar_to_bitmap(b, s->b);
+  mmfroar_words(s->a, s->b, op);
+  return mmfroar_extract(s->a, s->lows);
+}
+
+static uint32_t* mmfroar_op(MMFROARING* a, MMFROARING* b, int op, MMFARENA* arena, size_t* count)
+{
+  struct mmfroar_scratch* s = malloc(sizeof(*s));
+  uint32_t* out = NULL;
+  size_t n = 0, i = 0, j = 0;
+  bool ok = s != NULL;
+
+  if (!ok) mmfseterror("could not allocate space for bitmap scratch: %s", strerror(errno));
+  if (ok && arena != NULL) {
+    size_t at = (arena->used + 3) & ~(size_t)3;
+    if (at > arena->size) ok = false;
+    else out = (uint32_t*)((char*)arena->base + at);
+  }
+
+  // Walk both container directories in key order
+  while (ok && (i < a->count || j < b->count)) {
+    const struct mmfroar_container* ca = i < a->count ? &a->containers[i] : NULL;
+    const struct mmfroar_container* cb = j < b->count ? &b->containers[j] : NULL;
+    size_t len, k;
+    uint32_t key;
+    if (ca != NULL && cb != NULL && ca->key != cb->key) {
+      if (ca->key < cb->key) cb = NULL;
+      else ca = NULL;
+    }
+    if (i == a->count && op != MMFROAR_OR) break;
+    key = ca != NULL ? ca->key : cb->key;
+    i += ca != NULL;
+    j += cb != NULL;
+
+    len = mmfroar_combine(ca, cb, op, s);
+    if (out != NULL) {
+      if (((char*)arena->base + arena->size - (char*)(out + n)) / sizeof(*out) < len) ok = false;
+      else for (k = 0; k < len; k++) out[n + k] = key << 16 | s->lows[k];
+    }
+    n += len;
+  }
+
+  if (ok) {
+    if (arena != NULL) arena->used = (size_t)((char*)(out + n) - (char*)arena->base);
+    *count = n;
+  } else {
+    if (s != NULL) mmfseterror("could not combine bitmaps: arena is too small");
+    out = NULL;
+    *count = 0;
+  }
+
+  free(s);
+  return arena != NULL ? out : NULL;
+}
+
+uint32_t* mmfroaring_and(MMFROARING* a, MMFROARING* b, MMFARENA* arena, size_t* count)
+{
+  return mmfroar_op(a, b, MMFROAR_AND, arena, count);
+}
+
+uint32_t* mmfroaring_or(MMFROARING* a, MMFROARING* b, MMFARENA* arena, size_t* count)
+{
+  return mmfroar_op(a, b, MMFROAR_OR, arena, count);
+}
+
+uint32_t* mmfroaring_andnot(MMFROARING* a, MMFROARING* b, MMFARENA* arena, size_t* count)
+{
+  return mmfroar_op(a, b, MMFROAR_ANDNOT, arena, count);
+}
+
+void mmfroaring_close(MMFROARING* r)
+{
+  if (r->file != NULL) mmfclose(r->file);
+  free(r->containers);
+  free(r);
+}
+
+// ----------------------------------------------------------------------------
+// Columnar files: every column is a typed array aligned to 64 bytes, stored
+// either plainly, as offsets from the column minimum (frame of reference, for
+// integers) or as codes into a sorted dictionary of its distinct values.
+// Offsets and codes take 1, 2 or 4 bytes, whichever is enough. Kernels decode
+// 1024 rows at a time into a 64-bit buffer and run vector loops over it, with
+// rows split between threads.
+// Layout: header, column data (each with its dictionary), directory, names.
+// ----------------------------------------------------------------------------
+
+#define MMFCOL_CHUNK 1024
+
+static const char mmfcol_magic[8] = { 'M', 'M', 'F', 'C', 'O', 'L', 'S', '1' };
+
+struct mmfcol_header {
+  char magic[8];
+  uint64_t nrows;
+  uint64_t ncols;
+  uint64_t columns;
+  uint64_t names;
+  uint64_t reserved[3];
+};
+
+struct mmfcol_entry {
+  uint32_t type;
+  uint32_t encoding;
+  uint64_t data;
+  uint64_t size;
+  uint64_t dict;
+  uint64_t dictcount;
+  int64_t base;
+  uint32_t width;
+  uint32_t namelen;
+  uint64_t name;
+};
+
+struct MMFCOLW_impl {
+  FILE* out;
+  uint64_t pos;
+  uint64_t nrows;
+  struct mmfcol_entry* entries;
+  size_t count, entriescap;
+  char* names;
+  size_t namessize, namescap;
+  bool failed;
+};
+
+struct MMFCOL_impl {
+  MMFILE* file;
+  const char* base;
+  struct mmfcol_header header;
+  const struct mmfcol_entry* entries;
+  const char* names;
+};
+
+static size_t mmfcol_type_size(int type)
+{
+  return type == MMF_COL_I32 || type == MMF_COL_F32 ? 4 : type == MMF_COL_I64 || type == MMF_COL_F64 ? 8 : 0;
+}
+
+static bool mmfcol_is_float(int type)
+{
+  return type == MMF_COL_F32 || type == MMF_COL_F64;
+}
+
+// Reads row i of a plain typed array as int64 or double, by column kind.
+static int64_t mmfcol_int_at(const void* p, int type, size_t i)
+{
+  return type == MMF_COL_I32 ? ((const int32_t*)p)[i] : ((const int64_t*)p)[i];
+}
+
+static double mmfcol_float_at(const void* p, int type, size_t i)
+{
+  return type == MMF_COL_F32 ? ((const float*)p)[i] : ((const double*)p)[i];
+}
+
+static int mmfcol_compare_ints(const void* a, const void* b)
+{
+  int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+static int mmfcol_compare_floats(const void* a, const void* b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+static uint32_t mmfcol_width(uint64_t maxvalue)
+{
+  return maxvalue <= 0xff ? 1 : maxvalue <= 0xffff ? 2 : maxvalue <= 0xffffffffu ? 4 : 8;
+}
+
+static void mmfcol_put(unsigned char* p, uint32_t width, size_t i, uint64_t v)
+{
+  if (width == 1) p[i] = (unsigned char)v;
+  else if (width == 2) ((uint16_t*)p)[i] = (uint16_t)v;
+  else ((uint32_t*)p)[i] = (uint32_t)v;
+}
+
+MMFCOLW* mmfcol_create(const char* name, size_t nrows)
+{
+  MMFCOLW* ret = NULL;
+  MMFCOLW* w = calloc(1, sizeof(*w));
+  if (w != NULL) {
+    w->out = fopen(name, "wb");
+    if (w->out != NULL) {
+      struct mmfcol_header header;
+      memset(&header, 0, sizeof(header));
+      if (fwrite(&header, sizeof(header), 1, w->out) == 1) {
+        w->pos = sizeof(header);
+        w->nrows = nrows;
+        ret = w;
+      } else mmfseterror("could not write column file header: %s", strerror(errno));
+      if (ret == NULL) fclose(w->out);
+    } else mmfseterror("could not create the file: %s", strerror(errno));
+    if (ret == NULL) free(w);
+  } else mmfseterror("could not allocate space for MMFCOLW: %s", strerror(errno));
+
+  return ret;
+}
+
+int mmfcol_add(MMFCOLW* w, const char* colname, int type, int encoding, const void* values)
+{
+  size_t n = (size_t)w->nrows, elemsize = mmfcol_type_size(type), namelen = strlen(colname), i;
+  bool isfloat = mmfcol_is_float(type), ok = true;
+  void* dict = NULL;
+  unsigned char* codes = NULL;
+  struct mmfcol_entry e;
+
+  if (w->failed) return -1;
+  if (elemsize == 0 || encoding < MMF_ENC_PLAIN || encoding > MMF_ENC_DICT || (encoding == MMF_ENC_FOR && isfloat)) {
+    mmfseterror("could not add column '%s': unsupported type and encoding", colname);
+    return -1;
+  }
+  if (!mmf_reserve((void**)&w->entries, &w->entriescap, w->count + 1, sizeof(*w->entries)) ||
+      !mmf_reserve((void**)&w->names, &w->namescap, w->namessize + namelen, 1)) {
+    mmfseterror("could not allocate space for column directory: %s", strerror(errno));
+    w->failed = true;
+    return -1;
+  }
+
+  memset(&e, 0, sizeof(e));
+  e.type = (uint32_t)type;
+  e.encoding = (uint32_t)encoding;
+  e.width = (uint32_t)elemsize;
+  if (encoding == MMF_ENC_FOR && n > 0) {
+    int64_t lo = mmfcol_int_at(values, type, 0), hi = lo;
+    for (i = 1; i < n; i++) {
+      int64_t v = mmfcol_int_at(values, type, i);
+      if (v < lo) lo = v;
+      if (v > hi) hi = v;
+    }
+    e.base = lo;
+    e.width = mmfcol_width((uint64_t)hi - (uint64_t)lo);
+    if (e.width == 8) e.encoding = MMF_ENC_PLAIN;
+    else if ((codes = malloc(n * e.width)) != NULL) {
+      for (i = 0; i < n; i++) mmfcol_put(codes, e.width, i, (uint64_t)mmfcol_int_at(values, type, i) - (uint64_t)lo);
+    } else ok = false;
+  } else if (encoding == MMF_ENC_DICT && n > 0) {
+    // The dictionary holds distinct values in ascending order, kept as int64 or double while building
+    size_t ndict = 0;
+    dict = malloc(n * 8);
+    if (dict != NULL) {
+      for (i = 0; i < n; i++) {
+        if (isfloat) ((double*)dict)[i] = mmfcol_float_at(values, type, i);
+        else ((int64_t*)dict)[i] = mmfcol_int_at(values, type, i);
+        if (isfloat && ((double*)dict)[i] != ((double*)dict)[i]) {
+          mmfseterror("could not add column '%s': dictionary encoding does not support NaN", colname);
+          free(dict);
+          return -1;
+        }
+      }
+      qsort(dict, n, 8, isfloat ? mmfcol_compare_floats : mmfcol_compare_ints);
+      for (i = 0; i < n; i++) {
+        if (ndict == 0 || memcmp((char*)dict + i * 8, (char*)dict + (ndict - 1) * 8, 8) != 0) {
+          memmove((char*)dict + ndict * 8, (char*)dict + i * 8, 8);
+          ndict++;
+        }
+      }
+      e.dictcount = ndict;
+      e.width = mmfcol_width(ndict - 1);
+      if (e.width == 8) {
+        e.encoding = MMF_ENC_PLAIN;
+        e.width = (uint32_t)elemsize;
+        e.dictcount = 0;
+        free(dict);
+        dict = NULL;
+      } else if ((codes = malloc(n * e.width)) != NULL) {
+        for (i = 0; i < n; i++) {
+          size_t lo = 0, hi = ndict;
+          double f = isfloat ? mmfcol_float_at(values, type, i) : 0;
+          int64_t v = isfloat ? 0 : mmfcol_int_at(values, type, i);
+          while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (isfloat ? ((double*)dict)[mid] < f : ((int64_t*)dict)[mid] < v) lo = mid + 1;
+            else hi = mid;
+          }
+          mmfcol_put(codes, e.width, i, lo);
+        }
+        // Narrow the dictionary back to the column type
+        for (i = 0; i < ndict; i++) {
+          if (type == MMF_COL_I32) ((int32_t*)dict)[i] = (int32_t)((int64_t*)dict)[i];
+          else if (type == MMF_COL_F32) ((float*)dict)[i] = (float)((double*)dict)[i];
+        }
+      } else ok = false;
+    } else ok = false;
+  } else if (encoding == MMF_ENC_DICT) e.width = 1;
+
+  if (!ok) {
+    mmfseterror("could not allocate space for column encoding: %s", strerror(errno));
+    free(dict);
+    return -1;
+  }
+
+  e.size = (uint64_t)n * e.width;
+  ok = mmf_write_padding(w->out, &w->pos, 64);
+  e.data = w->pos;
+  if (ok && n > 0) ok = fwrite(codes != NULL ? (const void*)codes : values, e.width, n, w->out) == n;
+  w->pos += e.size;
+  if (ok && dict != NULL) {
+    ok = mmf_write_padding(w->out, &w->pos, 64);
+    e.dict = w->pos;
+    ok = ok && fwrite(dict, elemsize, (size_t)e.dictcount, w->out) == e.dictcount;
+    w->pos += e.dictcount * elemsize;
+  }
+  free(dict);
+  free(codes);
+  if (!ok) {
+    mmfseterror("could not write column '%s': %s", colname, strerror(errno));
+    w->failed = true;
+    return -1;
+  }
+
+  e.name = w->namessize;
+  e.namelen = (uint32_t)namelen;
+  memcpy(w->names + w->namessize, colname, namelen);
+  w->namessize += namelen;
+  w->entries[w->count++] = e;
+  return 0;
+}
+
+int mmfcol_finish(MMFCOLW* w)
+{
+  int ret = -1;
+  if (!w->failed) {
+    struct mmfcol_header header;
+    bool ok = mmf_write_padding(w->out, &w->pos, 8);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, mmfcol_magic, sizeof(header.magic));
+    header.nrows = w->nrows;
+    header.ncols = w->count;
+    header.columns = w->pos;
+    ok = ok && (w->count == 0 || fwrite(w->entries, sizeof(*w->entries), w->count, w->out) == w->count);
+    w->pos += w->count * sizeof(*w->entries);
+    header.names = w->pos;
+    ok = ok && (w->namessize == 0 || fwrite(w->names, 1, w->namessize, w->out) == w->namessize);
+    if (ok) {
+      rewind(w->out);
+      ok = fwrite(&header, sizeof(header), 1, w->out) == 1;
+    }
+    if (ok) ret = 0;
+    else mmfseterror("could not write column directory: %s", strerror(errno));
+  }
+
+  if (fclose(w->out) != 0 && ret == 0) {
+    mmfseterror("could not close the file: %s", strerror(errno));
+    ret = -1;
+  }
+
+  free(w->entries);
+  free(w->names);
+  free(w);
+  return ret;
+}
+
+MMFCOL* mmfcol_open(const char* name)
+{
+  MMFCOL* ret = NULL;
+  MMFCOL* c = calloc(1, sizeof(*c));
+  if (c != NULL) {
+    c->file = mmfopen(name, "r");
+    if (c->file != NULL) {
+      struct mmfcol_header* h = &c->header;
+      size_t size = mmfsize(c->file);
+      bool ok;
+      uint64_t i;
+      c->base = mmfdata(c->file);
+      if (size >= sizeof(*h)) memcpy(h, c->base, sizeof(*h));
+      ok = size >= sizeof(*h) && memcmp(h->magic, mmfcol_magic, sizeof(h->magic)) == 0 && h->columns <= size &&
+           h->ncols <= (size - h->columns) / sizeof(struct mmfcol_entry) && h->names <= size;
+      if (ok) {
+        c->entries = (const struct mmfcol_entry*)(c->base + h->columns);
+        c->names = c->base + h->names;
+      }
+
+      // Every column has to lie inside the file with data matching its type and encoding
+      for (i = 0; ok && i < h->ncols; i++) {
+        const struct mmfcol_entry* e = &c->entries[i];
+        size_t elemsize = mmfcol_type_size((int)e->type);
+        ok = elemsize > 0 && e->encoding <= MMF_ENC_DICT && e->data <= size && e->data % 8 == 0 &&
+             (e->width == 1 || e->width == 2 || e->width == 4 || e->width == 8) &&
+             (e->encoding != MMF_ENC_PLAIN || e->width == elemsize) && h->nrows <= (size - e->data) / e->width &&
+             e->size == h->nrows * e->width && e->namelen <= size - h->names && e->name <= size - h->names - e->namelen &&
+             (e->encoding != MMF_ENC_DICT ||
+              (e->dict <= size && e->dict % 8 == 0 && e->dictcount <= (size - e->dict) / elemsize &&
+               (h->nrows == 0 || e->dictcount > 0)));
+      }
+      if (ok) ret = c;
+      else mmfseterror("could not open column file: not a valid column file");
+      if (ret == NULL) mmfclose(c->file);
+    }
+    if (ret == NULL) free(c);
+  } else mmfseterror("could not allocate space for MMFCOL: %s", strerror(errno));
+
+  return ret;
+}
+
+size_t mmfcol_rows(MMFCOL* c)
+{
+  return (size_t)c->header.nrows;
+}
+
+size_t mmfcol_columns(MMFCOL* c)
+{
+  return (size_t)c->header.ncols;
+}
+
+int mmfcol_find(MMFCOL* c, const char* colname)
+{
+  size_t len = strlen(colname);
+  uint64_t i;
+  for (i = 0; i < c->header.ncols; i++) {
+    if (c->entries[i].namelen == len && memcmp(c->names + c->entries[i].name, colname, len) == 0) return (int)i;
+  }
+
+  return -1;
+}
+
+int mmfcol_type(MMFCOL* c, int col)
+{
+  return (int)c->entries[col].type;
+}
+
+const void* mmfcol_data(MMFCOL* c, int col)
+{
+  return c->entries[col].encoding == MMF_ENC_PLAIN ? c->base + c->entries[col].data : NULL;
+}
+
+// Decodes rows [begin, begin + n) of a column into int64 (integer columns)
+// or double (floating-point columns) values.
+static void mmfcol_decode(MMFCOL* c, const struct mmfcol_entry* e, size_t begin, size_t n, void* out)
+{
+  const unsigned char* data = (const unsigned char*)c->base + e->data;
+  int type = (int)e->type;
+  size_t i;
+
+  if (e->encoding == MMF_ENC_PLAIN) {
+    if (mmfcol_is_float(type)) for (i = 0; i < n; i++) ((double*)out)[i] = mmfcol_float_at(data, type, begin + i);
+    else for (i = 0; i < n; i++) ((int64_t*)out)[i] = mmfcol_int_at(data, type, begin + i);
+  } else {
+    // Codes and offsets are widened first, then mapped in place
+    uint64_t* u = out;
+    if (e->width == 1) for (i = 0; i < n; i++) u[i] = data[begin + i];
+    else if (e->width == 2) for (i = 0; i < n; i++) u[i] = ((const uint16_t*)data)[begin + i];
+    else for (i = 0; i < n; i++) u[i] = ((const uint32_t*)data)[begin + i];
+
+    if (e->encoding == MMF_ENC_FOR) {
+      for (i = 0; i < n; i++) ((int64_t*)out)[i] = (int64_t)(u[i] + (uint64_t)e->base);
+    } else {
+      const void* dict = c->base + e->dict;
+      uint64_t last = e->dictcount - 1;
+      for (i = 0; i < n; i++) {
+        uint64_t code = u[i] < last ? u[i] : last;
+        if (mmfcol_is_float(type)) ((double*)out)[i] = mmfcol_float_at(dict, type, (size_t)code);
+        else ((int64_t*)out)[i] = mmfcol_int_at(dict, type, (size_t)code);
+      }
+    }
+  }
+}
+
+static void mmfcol_agg_ints(const int64_t* v, size_t n, MMFCOLAGG* agg)
+{
+  size_t i = 0;
+#if defined(__AVX2__)
+  __m256i sum = _mm256_setzero_si256(), lo = _mm256_set1_epi64x(agg->imin), hi = _mm256_set1_epi64x(agg->imax);
+  int64_t lanes[4];
+  int k;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(v + i));
+    sum = _mm256_add_epi64(sum, x);
+    lo = _mm256_blendv_epi8(lo, x, _mm256_cmpgt_epi64(lo, x));
+    hi = _mm256_blendv_epi8(hi, x, _mm256_cmpgt_epi64(x, hi));
+  }
+  _mm256_storeu_si256((__m256i*)lanes, sum);
+  for (k = 0; k < 4; k++) agg->isum = (int64_t)((uint64_t)agg->isum + (uint64_t)lanes[k]);
+  _mm256_storeu_si256((__m256i*)lanes, lo);
+  for (k = 0; k < 4; k++) agg->imin = lanes[k] < agg->imin ? lanes[k] : agg->imin;
+  _mm256_storeu_si256((__m256i*)lanes, hi);
+  for (k = 0; k < 4; k++) agg->imax = lanes[k] > agg->imax ? lanes[k] : agg->imax;
+#endif
+  for (; i < n; i++) {
+    agg->isum = (int64_t)((uint64_t)agg->isum + (uint64_t)v[i]);
+    agg->imin = v[i] < agg->imin ? v[i] : agg->imin;
+    agg->imax = v[i] > agg->imax ? v[i] : agg->imax;
+  }
+}
+
+static void mmfcol_agg_floats(const double* v, size_t n, MMFCOLAGG* agg)
+{
+  size_t i = 0;
+#if defined(__AVX2__)
+  __m256d sum = _mm256_setzero_pd(), lo = _mm256_set1_pd(agg->fmin), hi = _mm256_set1_pd(agg->fmax);
+  double lanes[4];
+  int k;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(v + i);
+    sum = _mm256_add_pd(sum, x);
+    lo = _mm256_min_pd(lo, x);
+    hi = _mm256_max_pd(hi, x);
+  }
+  _mm256_storeu_pd(lanes, sum);
+  agg->fsum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  _mm256_storeu_pd(lanes, lo);
+  for (k = 0; k < 4; k++) agg->fmin = lanes[k] < agg->fmin ? lanes[k] : agg->fmin;
+  _mm256_storeu_pd(lanes, hi);
+  for (k = 0; k < 4; k++) agg->fmax = lanes[k] > agg->fmax ? lanes[k] : agg->fmax;
+#elif defined(__SSE2__) || defined(_M_X64)
+  __m128d sum = _mm_setzero_pd(), lo = _mm_set1_pd(agg->fmin), hi = _mm_set1_pd(agg->fmax);
+  double lanes[2];
+  int k;
+  for (; i + 2 <= n; i += 2) {
+    __m128d x = _mm_loadu_pd(v + i);
+    sum = _mm_add_pd(sum, x);
+    lo = _mm_min_pd(lo, x);
+    hi = _mm_max_pd(hi, x);
+  }
+  _mm_storeu_pd(lanes, sum);
+  agg->fsum += lanes[0] + lanes[1];
+  _mm_storeu_pd(lanes, lo);
+  for (k = 0; k < 2; k++) agg->fmin = lanes[k] < agg->fmin ? lanes[k] : agg->fmin;
+  _mm_storeu_pd(lanes, hi);
+  for (k = 0; k < 2; k++) agg->fmax = lanes[k] > agg->fmax ? lanes[k] : agg->fmax;
+#endif
+  for (; i < n; i++) {
+    agg->fsum += v[i];
+    agg->fmin = v[i] < agg->fmin ? v[i] : agg->fmin;
+    agg->fmax = v[i] > agg->fmax ? v[i] : agg->fmax;
+  }
+}
+
+// Sets bits of rows with lo <= v <= hi; n is a multiple of 64 except for the last chunk.
+static size_t mmfcol_filter_chunk(const void* values, bool isfloat, size_t n, const void* lo, const void* hi, uint64_t* bits)
+{
+  size_t found = 0, i, j;
+  for (i = 0; i < n; i += 64) {
+    size_t m = n - i < 64 ? n - i : 64;
+    uint64_t word = 0;
+    j = 0;
+#if defined(__AVX2__)
+    if (isfloat) {
+      const double* v = (const double*)values + i;
+      __m256d flo = _mm256_set1_pd(*(const double*)lo), fhi = _mm256_set1_pd(*(const double*)hi);
+      for (; j + 4 <= m; j += 4) {
+        __m256d x = _mm256_loadu_pd(v + j);
+        __m256d in = _mm256_and_pd(_mm256_cmp_pd(x, flo, _CMP_GE_OQ), _mm256_cmp_pd(x, fhi, _CMP_LE_OQ));
+        word |= (uint64_t)_mm256_movemask_pd(in) << j;
+      }
+    } else {
+      const int64_t* v = (const int64_t*)values + i;
+      __m256i ilo = _mm256_set1_epi64x(*(const int64_t*)lo), ihi = _mm256_set1_epi64x(*(const int64_t*)hi);
+      for (; j + 4 <= m; j += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(v + j));
+        __m256i out = _mm256_or_si256(_mm256_cmpgt_epi64(ilo, x), _mm256_cmpgt_epi64(x, ihi));
+        word |= (uint64_t)(~_mm256_movemask_pd(_mm256_castsi256_pd(out)) & 0xf) << j;
+      }
+    }
+#endif
+    for (; j < m; j++) {
+      bool in;
+      if (isfloat) {
+        double x = ((const double*)values)[i + j];
+        in = x >= *(const double*)lo && x <= *(const double*)hi;
+      } else {
+        int64_t x = ((const int64_t*)values)[i + j];
+        in = x >= *(const int64_t*)lo && x <= *(const int64_t*)hi;
+      }
+      word |= (uint64_t)in << j;
+    }
+    bits[i / 64] = word;
+    found += (size_t)mmf_popcount64(word);
+  }
+
+  return found;
+}
+
+struct mmfcol_job {
+  MMFCOL* c;
+  const struct mmfcol_entry* e;
+  MMFCOLAGG* parts;
+  int64_t lo, hi;
+  double flo, fhi;
+  uint64_t* bits;
+  size_t* found;
+  bool failed;
+};
+
+static void mmfcol_aggregate_part(void* arg, int tid, int nthreads)
+{
+  struct mmfcol_job* job = arg;
+  MMFCOLAGG* agg = &job->parts[tid];
+  bool isfloat = mmfcol_is_float((int)job->e->type);
+  size_t begin, end, i;
+  void* buf = malloc(MMFCOL_CHUNK * 8);
+
+  mmf_split((size_t)job->c->header.nrows, tid, nthreads, &begin, &end);
+  if (buf == NULL) {
+    job->failed = true;
+    return;
+  }
+  for (i = begin; i < end; i += MMFCOL_CHUNK) {
+    size_t n = end - i < MMFCOL_CHUNK ? end - i : MMFCOL_CHUNK;
+    mmfcol_decode(job->c, job->e, i, n, buf);
+    if (isfloat) mmfcol_agg_floats(buf, n, agg);
+    else mmfcol_agg_ints(buf, n, agg);
+  }
+  free(buf);
+}
+
+static void mmfcol_filter_part(void* arg, int tid, int nthreads)
+{
+  struct mmfcol_job* job = arg;
+  bool isfloat = mmfcol_is_float((int)job->e->type);
+  size_t nrows = (size_t)job->c->header.nrows, begin, end, i;
+  void* buf = malloc(MMFCOL_CHUNK * 8);
+
+  // Split by 64-row words so that every thread owns whole words of the bitmap
+  mmf_split((nrows + 63) / 64, tid, nthreads, &begin, &end);
+  begin *= 64;
+  end = end * 64 < nrows ? end * 64 : nrows;
+  job->found[tid] = 0;
+  if (buf == NULL) {
+    job->failed = true;
+    return;
+  }
+  for (i = begin; i < end; i += MMFCOL_CHUNK) {
+    size_t n = end - i < MMFCOL_CHUNK ? end - i : MMFCOL_CHUNK;
+    mmfcol_decode(job->c, job->e, i, n, buf);
+    job->found[tid] += mmfcol_filter_chunk(buf, isfloat, n, isfloat ? (const void*)&job->flo : (const void*)&job->lo,
+                                           isfloat ? (const void*)&job->fhi : (const void*)&job->hi, job->bits + i / 64);
+  }
+  free(buf);
+}
+
+int mmfcol_aggregate(MMFCOL* c, int col, int nthreads, MMFCOLAGG* agg)
+{
+  int ret = -1, i;
+  struct mmfcol_job job;
+
+  if (nthreads <= 0) nthreads = mmf_cpu_count();
+  memset(&job, 0, sizeof(job));
+  job.c = c;
+  job.e = &c->entries[col];
+  job.parts = calloc((size_t)nthreads, sizeof(*job.parts));
+  if (job.parts != NULL) {
+    for (i = 0; i < nthreads; i++) {
+      job.parts[i].imin = INT64_MAX;
+      job.parts[i].imax = INT64_MIN;
+      job.parts[i].fmin = HUGE_VAL;
+      job.parts[i].fmax = -HUGE_VAL;
+    }
+    mmfadvise(c->file, (size_t)job.e->data, (size_t)job.e->size, MMF_ADVICE_SEQUENTIAL);
+    mmf_parallel(nthreads, mmfcol_aggregate_part, &job);
+
+    if (!job.failed) {
+      *agg = job.parts[0];
+      for (i = 1; i < nthreads; i++) {
+        agg->isum = (int64_t)((uint64_t)agg->isum + (uint64_t)job.parts[i].isum);
+        agg->imin = job.parts[i].imin < agg->imin ? job.parts[i].imin : agg->imin;
+        agg->imax = job.parts[i].imax > agg->imax ? job.parts[i].imax : agg->imax;
+        agg->fsum += job.parts[i].fsum;
+        agg->fmin = job.parts[i].fmin < agg->fmin ? job.parts[i].fmin : agg->fmin;
+        agg->fmax = job.parts[i].fmax > agg->fmax ? job.parts[i].fmax : agg->fmax;
+      }
+      if (!mmfcol_is_float((int)job.e->type)) {
+        agg->fsum = (double)agg->isum;
+        agg->fmin = (double)agg->imin;
+        agg->fmax = (double)agg->imax;
+      }
+      ret = 0;
+    } else mmfseterror("could not aggregate column: out of memory");
+  } else mmfseterror("could not allocate space for aggregation: %s", strerror(errno));
+
+  free(job.parts);
+  return ret;
+}
+
+size_t mmfcol_filter(MMFCOL* c, int col, double lo, double hi, uint64_t* bits, int nthreads)
+{
+  size_t found = 0;
+  int i;
+  struct mmfcol_job job;
+  bool isfloat = mmfcol_is_float(mmfcol_type(c, col));
+  bool empty = !(lo <= hi) || (!isfloat && (lo >= 9223372036854775808.0 || hi < -9223372036854775808.0));
+
+  if (nthreads <= 0) nthreads = mmf_cpu_count();
+  memset(&job, 0, sizeof(job));
+  job.c = c;
+  job.e = &c->entries[col];
+  job.flo = lo;
+  job.fhi = hi;
+  // Integer bounds are rounded inwards and clamped to the int64 range
+  if (!empty && !isfloat) {
+    job.lo = lo <= -9223372036854775808.0 ? INT64_MIN : (int64_t)lo + ((double)(int64_t)lo < lo);
+    job.hi = hi >= 9223372036854775808.0 ? INT64_MAX : (int64_t)hi - ((double)(int64_t)hi > hi);
+  }
+  job.bits = bits;
+  job.found = calloc((size_t)nthreads, sizeof(*job.found));
+  if (job.found != NULL && !empty) {
+    mmfadvise(c->file, (size_t)job.e->data, (size_t)job.e->size, MMF_ADVICE_SEQUENTIAL);
+    mmf_parallel(nthreads, mmfcol_filter_part, &job);
+    if (!job.failed) for (i = 0; i < nthreads; i++) found += job.found[i];
+    else mmfseterror("could not filter column: out of memory");
+  } else if (job.found == NULL) mmfseterror("could not allocate space for filter: %s", strerror(errno));
+  else memset(bits, 0, ((size_t)c->header.nrows + 63) / 64 * sizeof(*bits));
+
+  free(job.found);
+  return found;
+}
+
+void mmfcol_close(MMFCOL* c)
+{
+  mmfclose(c->file);
+  free(c);
+}
+
+// ----------------------------------------------------------------------------
+// NumPy arrays: the .npy header is a Python dict literal giving the element
+// type, the memory order and the shape, padded so that the payload starts
+// aligned. Parsing it yields a strided view of the payload in place.
+// Layout: "\x93NUMPY", version, header length (2 or 4 bytes), header, data.
+// ----------------------------------------------------------------------------
+
+// Fills type fields from a NumPy type string such as "<f4" or "|u1".
+static bool mmfnpy_descr(const char* s, size_t len, MMFNPYARRAY* array)
+{
+  size_t i = 0, itemsize = 0;
+  char order = '|';
+
+  if (i < len && (s[i] == '<' || s[i] == '>' || s[i] == '|' || s[i] == '=')) order = s[i++];
+  if (i >= len || strchr("fiubc", s[i]) == NULL || s[i] == '\0') return false;
+  array->kind = s[i++];
+  if (i >= len) return false;
+  for (; i < len && s[i] >= '0' && s[i] <= '9' && itemsize < 1000; i++) itemsize = itemsize * 10 + (size_t)(s[i] - '0');
+  if (i != len || itemsize == 0) return false;
+
+  // Only native (little-endian) byte order can be used in place
+  if (order == '>' && itemsize > 1) return false;
+  array->itemsize = itemsize;
+  return true;
+}
+
+// Computes byte strides and checks that the array fits into size bytes.
+static bool mmfnpy_layout(MMFNPYARRAY* array, size_t size)
+{
+  size_t total = array->itemsize;
+  int d;
+  for (d = 0; d < array->ndim; d++) {
+    int at = array->fortran ? d : array->ndim - 1 - d;
+    array->strides[at] = (ptrdiff_t)total;
+    if (array->shape[at] != 0 && total > (size_t)PTRDIFF_MAX / array->shape[at]) return false;
+    total *= array->shape[at];
+  }
+
+  return total <= size;
+}
+
+// Returns a pointer just past `'key':` in a header, or NULL if the key is missing.
+static const char* mmfnpy_find(const char* header, size_t len, const char* key)
+{
+  size_t keylen = strlen(key), i;
+  for (i = 0; i + keylen + 2 <= len; i++) {
+    if ((header[i] == '\'' || header[i] == '"') && memcmp(header + i + 1, key, keylen) == 0 &&
+        header[i + 1 + keylen] == header[i]) {
+      const char* p = header + i + keylen + 2;
+      while (p < header + len && (*p == ' ' || *p == ':')) p++;
+      return p;
+    }
+  }
+
+  return NULL;
+}
+
+int mmfnpy_parse(const void* data, size_t size, MMFNPYARRAY* array)
+{
+  const unsigned char* p = data;
+  const char *header, *end, *v, *q;
+  size_t headerlen, offset;
+
+  memset(array, 0, sizeof(*array));
+  if (size < 10 || memcmp(p, "\x93NUMPY", 6) != 0 || p[6] < 1 || p[6] > 3) {
+    mmfseterror("could not parse array: not a .npy file");
+    return -1;
+  }
+  if (p[6] == 1) {
+    headerlen = (size_t)p[8] | (size_t)p[9] << 8;
+    offset = 10;
+  } else {
+    if (size < 12) {
+      mmfseterror("could not parse array: header is truncated");
+      return -1;
+    }
+    headerlen = (size_t)p[8] | (size_t)p[9] << 8 | (size_t)p[10] << 16 | (size_t)p[11] << 24;
+    offset = 12;
+  }
+  if (headerlen > size - offset) {
+    mmfseterror("could not parse array: header is truncated");
+    return -1;
+  }
+  header = (const char*)p + offset;
+  end = header + headerlen;
+  offset += headerlen;
+
+  v = mmfnpy_find(header, headerlen, "descr");
+  if (v == NULL || v >= end || (*v != '\'' && *v != '"')) {
+    mmfseterror("could not parse array: structured element types are not supported");
+    return -1;
+  }
+  for (q = v + 1; q < end && *q != *v; q++);
+  if (q >= end || !mmfnpy_descr(v + 1, (size_t)(q - v - 1), array)) {
+    mmfseterror("could not parse array: unsupported element type '%.*s'", (int)(q - v - 1), v + 1);
+    return -1;
+  }
+
+  v = mmfnpy_find(header, headerlen, "fortran_order");
+  array->fortran = v != NULL && end - v >= 4 && memcmp(v, "True", 4) == 0;
+
+  v = mmfnpy_find(header, headerlen, "shape");
+  if (v == NULL || v >= end || *v != '(') {
+    mmfseterror("could not parse array: shape is missing");
+    return -1;
+  }
+  for (v++; v < end && *v != ')';) {
+    size_t dim = 0;
+    bool digits = false;
+    while (v < end && (*v == ' ' || *v == ',')) v++;
+    if (v < end && *v == ')') break;
+    while (v < end && *v >= '0' && *v <= '9' && dim <= SIZE_MAX / 10 - 1) {
+      dim = dim * 10 + (size_t)(*v++ - '0');
+      digits = true;
+    }
+    while (v < end && *v == 'L') v++;
+    if (!digits || array->ndim == MMF_NPY_MAXDIM) {
+      mmfseterror("could not parse array: unsupported shape");
+      return -1;
+    }
+    array->shape[array->ndim++] = dim;
+  }
+
+  if (v >= end || !mmfnpy_layout(array, size - offset)) {
+    mmfseterror("could not parse array: data is truncated");
+    return -1;
+  }
+  array->data = p + offset;
+  return 0;
+}
+
+int mmfnpy_raw(const void* data, size_t size, const char* descr, int ndim, const size_t* shape, MMFNPYARRAY* array)
+{
+  memset(array, 0, sizeof(*array));
+  if (ndim < 0 || ndim > MMF_NPY_MAXDIM || !mmfnpy_descr(descr, strlen(descr), array)) {
+    mmfseterror("could not use array: unsupported element type or shape");
+    return -1;
+  }
+  array->ndim = ndim;
+  if (ndim > 0) memcpy(array->shape, shape, (size_t)ndim * sizeof(*shape));
+  if (!mmfnpy_layout(array, size)) {
+    mmfseterror("could not use array: data is shorter than the shape");
+    return -1;
+  }
+
+  array->data = data;
+  return 0;
+}
+
+MMFILE* mmfnpy_open(const char* name, MMFNPYARRAY* array)
+{
+  MMFILE* ret = mmfopen(name, "r");
+  if (ret != NULL && mmfnpy_parse(mmfdata(ret), mmfsize(ret), array) != 0) {
+    mmfclose(ret);
+    ret = NULL;
+  }
+
+  return ret;
+}
+
+// ----------------------------------------------------------------------------
+// Vector scans: exhaustive nearest neighbour search over fixed-size rows of
+// float, half, int8 or uint8 components (.fvecs/.bvecs files or raw arrays).
+// Rows are converted to float on load and scored against a float query by
+// dot product or squared Euclidean distance. Every thread scans a contiguous
+// range of rows into its own top-k heap; the heaps are merged at the end.
+// ----------------------------------------------------------------------------
+
+static size_t mmfvec_type_size(int type)
+{
+  return type == MMF_VEC_F32 ? 4 : type == MMF_VEC_F16 ? 2 : type == MMF_VEC_I8 || type == MMF_VEC_U8 ? 1 : 0;
+}
+
+static float mmfvec_half(uint16_t h)
+{
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16, exp = (h >> 10) & 0x1f, mant = h & 0x3ff, bits;
+  float f;
+  if (exp == 0x1f) bits = sign | 0x7f800000 | mant << 13;
+  else if (exp != 0) bits = sign | (exp + 112) << 23 | mant << 13;
+  else if (mant == 0) bits = sign;
+  else {
+    // Subnormal halves are normal floats
+    exp = 113;
+    while ((mant & 0x400) == 0) {
+      mant <<= 1;
+      exp--;
+    }
+    bits = sign | exp << 23 | (mant & 0x3ff) << 13;
+  }
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+static float mmfvec_component(const void* row, int type, size_t i)
+{
+  uint16_t h;
+  switch (type) {
+    case MMF_VEC_F32: return ((const float*)row)[i];
+    case MMF_VEC_F16: memcpy(&h, (const char*)row + 2 * i, 2); return mmfvec_half(h);
+    case MMF_VEC_I8: return ((const signed char*)row)[i];
+    default: return ((const unsigned char*)row)[i];
+  }
+}
+
+// Scores one row; the vector loops handle whole registers, the scalar loop the rest.
+static float mmfvec_score(const void* row, int type, const float* q, size_t dim, int metric)
+{
+  float acc[4] = { 0, 0, 0, 0 };
+  size_t i = 0;
+
+#if defined(__AVX512F__)
+#define MMFVEC_LOOP(LOAD)                                                                      \
+  for (; i + 16 <= dim; i += 16) {                                                             \
+    __m512 x = LOAD, y = _mm512_loadu_ps(q + i);                                               \
+    if (metric == MMF_METRIC_L2) {                                                             \
+      __m512 d = _mm512_sub_ps(x, y);                                                          \
+      sum = _mm512_fmadd_ps(d, d, sum);                                                        \
+    } else sum = _mm512_fmadd_ps(x, y, sum);                                                   \
+  }
+  {
+    __m512 sum = _mm512_setzero_ps();
+    const char* p = row;
+    switch (type) {
+      case MMF_VEC_F32: MMFVEC_LOOP(_mm512_loadu_ps((const float*)p + i)) break;
+      case MMF_VEC_F16: MMFVEC_LOOP(_mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(p + 2 * i)))) break;
+      case MMF_VEC_I8: MMFVEC_LOOP(_mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(p + i))))) break;
+      default: MMFVEC_LOOP(_mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(p + i))))) break;
+    }
+    acc[0] = _mm512_reduce_add_ps(sum);
+  }
+#undef MMFVEC_LOOP
+#elif defined(__AVX2__) && defined(__FMA__)
+#define MMFVEC_LOOP(LOAD)                                                                      \
+  for (; i + 8 <= dim; i += 8) {                                                               \
+    __m256 x = LOAD, y = _mm256_loadu_ps(q + i);                                               \
+    if (metric == MMF_METRIC_L2) {                                                             \
+      __m256 d = _mm256_sub_ps(x, y);                                                          \
+      sum = _mm256_fmadd_ps(d, d, sum);                                                        \
+    } else sum = _mm256_fmadd_ps(x, y, sum);                                                   \
+  }
+  {
+    __m256 sum = _mm256_setzero_ps();
+    __m128 half;
+    const char* p = row;
+    switch (type) {
+      case MMF_VEC_F32: MMFVEC_LOOP(_mm256_loadu_ps((const float*)p + i)) break;
+#if defined(__F16C__)
+      case MMF_VEC_F16: MMFVEC_LOOP(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(p + 2 * i)))) break;
+#endif
+      case MMF_VEC_I8: MMFVEC_LOOP(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(p + i))))) break;
+      case MMF_VEC_U8: MMFVEC_LOOP(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(p + i))))) break;
+      default: break;
+    }
+    half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    acc[0] = _mm_cvtss_f32(half);
+  }
+#undef MMFVEC_LOOP
+#endif
+
+  // Four independent sums keep the scalar loop from waiting on one addition chain
+  for (; i + 4 <= dim; i += 4) {
+    int k;
+    for (k = 0; k < 4; k++) {
+      float d = mmfvec_component(row, type, i + (size_t)k);
+      if (metric == MMF_METRIC_L2) {
+        d -= q[i + (size_t)k];
+        acc[k] += d * d;
+      } else acc[k] += d * q[i + (size_t)k];
+    }
+  }
+  for (; i < dim; i++) {
+    float d = mmfvec_component(row, type, i);
+    if (metric == MMF_METRIC_L2) {
+      d -= q[i];
+      acc[0] += d * d;
+    } else acc[0] += d * q[i];
+  }
+
+  return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+static int mmfvecs_init(MMFVECS* vecs, MMFILE* file, const void* data, int type, size_t dim, size_t count, size_t stride)
+{
+  vecs->file = file;
+  vecs->data = data;
+  vecs->type = type;
+  vecs->dim = dim;
+  vecs->count = count;
+  vecs->stride = stride;
+  return 0;
+}
+
+// .fvecs and .bvecs files repeat {int32 dim, dim components} for every row.
+static int mmfvecs_xvecs(MMFILE* file, int type, MMFVECS* vecs)
+{
+  const char* base = mmfdata(file);
+  size_t size = mmfsize(file), stride;
+  int32_t dim, lastdim;
+
+  if (size == 0) return mmfvecs_init(vecs, file, base, type, 0, 0, 4);
+  if (size >= 4) memcpy(&dim, base, 4);
+  if (size < 4 || dim <= 0) {
+    mmfseterror("could not read vectors: bad dimension in the first row");
+    return -1;
+  }
+
+  // Only the first and the last row are checked, so that nothing else is paged in
+  stride = 4 + (size_t)dim * mmfvec_type_size(type);
+  if (size % stride == 0) memcpy(&lastdim, base + size - stride, 4);
+  if (size % stride != 0 || lastdim != dim) {
+    mmfseterror("could not read vectors: rows have different dimensions");
+    return -1;
+  }
+
+  return mmfvecs_init(vecs, file, base + 4, type, (size_t)dim, size / stride, stride);
+}
+
+int mmfvecs_fvecs(MMFILE* file, MMFVECS* vecs)
+{
+  return mmfvecs_xvecs(file, MMF_VEC_F32, vecs);
+}
+
+int mmfvecs_bvecs(MMFILE* file, MMFVECS* vecs)
+{
+  return mmfvecs_xvecs(file, MMF_VEC_U8, vecs);
+}
+
+int mmfvecs_raw(MMFILE* file, size_t offset, int type, size_t dim, MMFVECS* vecs)
+{
+  size_t size = mmfsize(file), rowsize = dim * mmfvec_type_size(type);
+  if (rowsize == 0 || offset > size) {
+    mmfseterror("could not read vectors: bad type, dimension or offset");
+    return -1;
+  }
+
+  return mmfvecs_init(vecs, file, (const char*)mmfdata(file) + offset, type, dim, (size - offset) / rowsize, rowsize);
+}
+
+// Heaps keep the worst of the best k hits at the root; ties go to lower row numbers.
+static bool mmfvec_worse(const MMFVECHIT* a, const MMFVECHIT* b, int metric)
+{
+  if (a->score != b->score) return metric == MMF_METRIC_L2 ? a->score > b->score : a->score < b->score;
+  return a->index > b->index;
+}
+
+static void mmfvec_sift_down(MMFVECHIT* heap, size_t n, size_t at, int metric)
+{
+  for (;;) {
+    size_t child = 2 * at + 1, worst = at;
+    MMFVECHIT t;
+    if (child < n && mmfvec_worse(&heap[child], &heap[worst], metric)) worst = child;
+    if (child + 1 < n && mmfvec_worse(&heap[child + 1], &heap[worst], metric)) worst = child + 1;
+    if (worst == at) return;
+    t = heap[at];
+    heap[at] = heap[worst];
+    heap[worst] = t;
+    at = worst;
+  }
+}
+
+static void mmfvec_push(MMFVECHIT* heap, size_t* n, size_t k, MMFVECHIT hit, int metric)
+{
+  size_t at = *n;
+  if (at < k) {
+    heap[(*n)++] = hit;
+    while (at > 0 && mmfvec_worse(&heap[at], &heap[(at - 1) / 2], metric)) {
+      MMFVECHIT t = heap[at];
+      heap[at] = heap[(at - 1) / 2];
+      heap[(at - 1) / 2] = t;
+      at = (at - 1) / 2;
+    }
+  } else if (k > 0 && mmfvec_worse(&heap[0], &hit, metric)) {
+    heap[0] = hit;
+    mmfvec_sift_down(heap, k, 0, metric);
+  }
+}
+
+struct mmfvec_job {
+  const MMFVECS* vecs;
+  const float* query;
+  int metric;
+  size_t k;
+  MMFVECHIT* heaps;
+  size_t* counts;
+};
+
+static void mmfvec_scan_part(void* arg, int tid, int nthreads)
+{
+  struct mmfvec_job* job = arg;
+  const MMFVECS* v = job->vecs;
+  MMFVECHIT* heap = job->heaps + (size_t)tid * job->k;
+  size_t begin, end, i, n = 0;
+
+  mmf_split(v->count, tid, nthreads, &begin, &end);
+  for (i = begin; i < end; i++) {
+    MMFVECHIT hit;
+    hit.index = i;
+    hit.score = mmfvec_score((const char*)v->data + i * v->stride, v->type, job->query, v->dim, job->metric);
+    mmfvec_push(heap, &n, job->k, hit, job->metric);
+  }
+  job->counts[tid] = n;
+}
+
+size_t mmfvecs_search(const MMFVECS* vecs, const float* query, int metric, size_t k, MMFVECHIT* hits, int nthreads)
+{
+  size_t n = 0, i, j;
+  struct mmfvec_job job;
+
+  if (nthreads <= 0) nthreads = mmf_cpu_count();
+  if ((size_t)nthreads > vecs->count) nthreads = vecs->count > 0 ? (int)vecs->count : 1;
+  if (k > vecs->count) k = vecs->count;
+  job.vecs = vecs;
+  job.query = query;
+  job.metric = metric;
+  job.k = k;
+  job.heaps = k > 0 ? malloc((size_t)nthreads * k * sizeof(*job.heaps)) : NULL;
+  job.counts = calloc((size_t)nthreads, sizeof(*job.counts));
+  if (k > 0 && job.heaps != NULL && job.counts != NULL) {
+    if (vecs->file != NULL) {
+      size_t offset = (size_t)((const char*)vecs->data - (const char*)mmfdata(vecs->file));
+      mmfadvise(vecs->file, offset, vecs->count * vecs->stride, MMF_ADVICE_SEQUENTIAL);
+    }
+    mmf_parallel(nthreads, mmfvec_scan_part, &job);
+
+    // Merge the per-thread heaps, then pop the worst hit to the back until it is sorted
+    for (i = 0; i < (size_t)nthreads; i++) {
+      for (j = 0; j < job.counts[i]; j++) mmfvec_push(hits, &n, k, job.heaps[i * k + j], metric);
+    }
+    for (i = n; i > 1; i--) {
+      MMFVECHIT t = hits[0];
+      hits[0] = hits[i - 1];
+      hits[i - 1] = t;
+      mmfvec_sift_down(hits, i - 1, 0, metric);
+    }
+  } else if (k > 0) mmfseterror("could not allocate space for search heaps: %s", strerror(errno));
+
+  free(job.heaps);
+  free(job.counts);
+  return n;
+}
+
+// ----------------------------------------------------------------------------
+// Graphs in compressed sparse row form: out-neighbours of node v are
+// neighbors[offsets[v] .. offsets[v + 1]), optionally followed by the same
+// arrays for the transposed graph (in-neighbours), which pull-style kernels
+// such as PageRank need. Offsets are touched on every step of a traversal,
+// so they are prefetched and offered huge pages on open.
+// Layout: header, offsets (u64), neighbors (u32), transposed offsets and neighbors.
+// ----------------------------------------------------------------------------
+
+static const char mmfgraph_magic[8] = { 'M', 'M', 'F', 'G', 'R', 'A', 'F', '1' };
+
+struct mmfgraph_header {
+  char magic[8];
+  uint64_t nnodes;
+  uint64_t nedges;
+  uint64_t offsets;
+  uint64_t neighbors;
+  uint64_t toffsets;
+  uint64_t tneighbors;
+  uint64_t reserved;
+};
+
+struct MMFGRAPH_impl {
+  MMFILE* file;
+  uint64_t nnodes, nedges;
+  const uint64_t* offsets;
+  const uint32_t* neighbors;
+  const uint64_t* toffsets;
+  const uint32_t* tneighbors;
+};
+
+// Counting sort of edges by their first end into offsets and neighbors.
+static void mmfgraph_fill(uint64_t* offsets, uint32_t* neighbors, size_t nnodes, const uint32_t* from,
+                          const uint32_t* to, size_t nedges)
+{
+  size_t i;
+  memset(offsets, 0, (nnodes + 1) * sizeof(*offsets));
+  for (i = 0; i < nedges; i++) offsets[from[i] + 1]++;
+  for (i = 0; i < nnodes; i++) offsets[i + 1] += offsets[i];
+  for (i = 0; i < nedges; i++) neighbors[offsets[from[i]]++] = to[i];
+
+  // Every offset now points at the end of its list, so shift them back
+  for (i = nnodes; i > 0; i--) offsets[i] = offsets[i - 1];
+  offsets[0] = 0;
+}
+
+int mmfgraph_build(const char* name, size_t nnodes, const uint32_t* src, const uint32_t* dst, size_t nedges, int transpose)
+{
+  int ret = -1;
+  struct mmfgraph_header h;
+  size_t i;
+  MMFILE* file;
+
+  if (nnodes > UINT32_MAX) {
+    mmfseterror("could not build graph: node numbers must fit into 32 bits");
+    return -1;
+  }
+  for (i = 0; i < nedges; i++) {
+    if (src[i] >= nnodes || dst[i] >= nnodes) {
+      mmfseterror("could not build graph: edge %llu refers to a missing node", (unsigned long long)i);
+      return -1;
+    }
+  }
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, mmfgraph_magic, sizeof(h.magic));
+  h.nnodes = nnodes;
+  h.nedges = nedges;
+  h.offsets = 64;
+  h.neighbors = h.offsets + (nnodes + 1) * sizeof(uint64_t);
+  h.toffsets = transpose ? (h.neighbors + nedges * sizeof(uint32_t) + 63) / 64 * 64 : 0;
+  h.tneighbors = transpose ? h.toffsets + (nnodes + 1) * sizeof(uint64_t) : 0;
+
+  file = mmfcreate(name, (size_t)(transpose ? h.tneighbors + nedges * sizeof(uint32_t) : h.neighbors + nedges * sizeof(uint32_t)));
+  if (file != NULL) {
+    char* mem = mmfdata(file);
+    memcpy(mem, &h, sizeof(h));
+    mmfgraph_fill((uint64_t*)(mem + h.offsets), (uint32_t*)(mem + h.neighbors), nnodes, src, dst, nedges);
+    if (transpose) mmfgraph_fill((uint64_t*)(mem + h.toffsets), (uint32_t*)(mem + h.tneighbors), nnodes, dst, src, nedges);
+    if (mmfflush(file) == 0) ret = 0;
+    mmfclose(file);
+    if (ret != 0) remove(name);
+  }
+
+  return ret;
+}
+
+MMFGRAPH* mmfgraph_open(const char* name)
+{
+  MMFGRAPH* ret = NULL;
+  MMFGRAPH* g = calloc(1, sizeof(*g));
+  if (g != NULL) {
+    g->file = mmfopen(name, "r");
+    if (g->file != NULL) {
+      struct mmfgraph_header h;
+      size_t size = mmfsize(g->file);
+      const char* base = mmfdata(g->file);
+      bool ok = size >= sizeof(h);
+      if (ok) memcpy(&h, base, sizeof(h));
+
+      // Only sizes and the ends of offset arrays are checked, so that opening reads nothing else;
+      // the kernels bound every edge range by nedges and skip neighbours past nnodes instead
+      ok = ok && memcmp(h.magic, mmfgraph_magic, sizeof(h.magic)) == 0 && h.nnodes <= UINT32_MAX &&
+           h.offsets % 8 == 0 && h.offsets <= size && (h.nnodes + 1) <= (size - h.offsets) / sizeof(uint64_t) &&
+           h.neighbors % 4 == 0 && h.neighbors <= size && h.nedges <= (size - h.neighbors) / sizeof(uint32_t) &&
+           (h.toffsets == 0 || (h.toffsets % 8 == 0 && h.toffsets <= size &&
+                                (h.nnodes + 1) <= (size - h.toffsets) / sizeof(uint64_t) && h.tneighbors % 4 == 0 &&
+                                h.tneighbors <= size && h.nedges <= (size - h.tneighbors) / sizeof(uint32_t)));
+      if (ok) {
+        g->nnodes = h.nnodes;
+        g->nedges = h.nedges;
+        g->offsets = (const uint64_t*)(base + h.offsets);
+        g->neighbors = (const uint32_t*)(base + h.neighbors);
+        g->toffsets = h.toffsets != 0 ? (const uint64_t*)(base + h.toffsets) : NULL;
+        g->tneighbors = h.toffsets != 0 ? (const uint32_t*)(base + h.tneighbors) : NULL;
+        mmfadvise(g->file, (size_t)h.offsets, (size_t)(h.nnodes + 1) * sizeof(uint64_t), MMF_ADVICE_HUGEPAGE);
+        mmfadvise(g->file, (size_t)h.offsets, (size_t)(h.nnodes + 1) * sizeof(uint64_t), MMF_ADVICE_WILLNEED);
+        if (h.toffsets != 0) {
+          mmfadvise(g->file, (size_t)h.toffsets, (size_t)(h.nnodes + 1) * sizeof(uint64_t), MMF_ADVICE_HUGEPAGE);
+        }
+        ok = g->offsets[0] == 0 && g->offsets[g->nnodes] == g->nedges &&
+             (g->toffsets == NULL || (g->toffsets[0] == 0 && g->toffsets[g->nnodes] == g->nedges));
+      }
+      if (ok) ret = g;
+      else mmfseterror("could not open graph: not a valid graph file");
+      if (ret == NULL) mmfclose(g->file);
+    }
+    if (ret == NULL) free(g);
+  } else mmfseterror("could not allocate space for MMFGRAPH: %s", strerror(errno));
+
+  return ret;
+}
+
+size_t mmfgraph_nodes(MMFGRAPH* g)
+{
+  return (size_t)g->nnodes;
+}
+
+size_t mmfgraph_edges(MMFGRAPH* g)
+{
+  return (size_t)g->nedges;
+}
+
+// Returns the list of node v in a CSR pair, bounded by nedges like the
+// kernels bound it, since open checks only the ends of the offsets
+static const uint32_t* mmfgraph_list(MMFGRAPH* g, const uint64_t* offsets, const uint32_t* neighbors, uint32_t v,
+                                     size_t* degree)
+{
+  uint64_t first, last;
+
+  if (v >= g->nnodes) {
+    mmfseterror("could not get neighbours: node is out of range");
+    *degree = 0;
+    return NULL;
+  }
+  first = offsets[v] < g->nedges ? offsets[v] : g->nedges;
+  last = offsets[v + 1] < g->nedges ? offsets[v + 1] : g->nedges;
+  *degree = last > first ? (size_t)(last - first) : 0;
+  return neighbors + first;
+}
+
+const uint32_t* mmfgraph_neighbors(MMFGRAPH* g, uint32_t v, size_t* degree)
+{
+  return mmfgraph_list(g, g->offsets, g->neighbors, v, degree);
+}
+
+const uint32_t* mmfgraph_in_neighbors(MMFGRAPH* g, uint32_t v, size_t* degree)
+{
+  if (g->toffsets == NULL) {
+    *degree = 0;
+    return NULL;
+  }
+
+  return mmfgraph_list(g, g->toffsets, g->tneighbors, v, degree);
+}
+
+struct mmfgraph_bfs_job {
+  MMFGRAPH* g;
+  uint32_t* dist;
+  const uint32_t* frontier;
+  size_t nfrontier;
+  uint32_t level;
+  uint32_t** next;
+  size_t* nnext;
+  size_t* nextcap;
+  bool failed;
+};
+
+// Expands a slice of the frontier; a node joins the next frontier of the
+// thread whose compare-and-swap claims it first.
+static void mmfgraph_bfs_part(void* arg, int tid, int nthreads)
+{
+  struct mmfgraph_bfs_job* job = arg;
+  const uint64_t* offsets = job->g->offsets;
+  const uint32_t* neighbors = job->g->neighbors;
+  uint64_t nnodes = job->g->nnodes, nedges = job->g->nedges, e, last;
+  size_t begin, end, i, n = 0;
+
+  mmf_split(job->nfrontier, tid, nthreads, &begin, &end);
+  for (i = begin; i < end; i++) {
+    uint32_t v = job->frontier[i];
+    last = offsets[v + 1] < nedges ? offsets[v + 1] : nedges;
+    for (e = offsets[v]; e < last; e++) {
+      uint32_t w = neighbors[e];
+      if (w < nnodes && mmf_atomic_load32(&job->dist[w]) == UINT32_MAX &&
+          mmf_atomic_cas32(&job->dist[w], UINT32_MAX, job->level + 1)) {
+        if (!mmf_reserve((void**)&job->next[tid], &job->nextcap[tid], n + 1, sizeof(uint32_t))) {
+          job->failed = true;
+          job->nnext[tid] = n;
+          return;
+        }
+        job->next[tid][n++] = w;
+      }
+    }
+  }
+  job->nnext[tid] = n;
+}
+
+size_t mmfgraph_bfs(MMFGRAPH* g, uint32_t source, uint32_t* dist, int nthreads)
+{
+  size_t reached = 0, nfrontier = 1, i;
+  uint32_t* frontier;
+  struct mmfgraph_bfs_job job;
+
+  if (source >= g->nnodes) {
+    mmfseterror("could not run BFS: source node is out of range");
+    return 0;
+  }
+  if (nthreads <= 0) nthreads = mmf_cpu_count();
+  memset(&job, 0, sizeof(job));
+  job.g = g;
+  job.dist = dist;
+  job.next = calloc((size_t)nthreads, sizeof(*job.next));
+  job.nnext = calloc((size_t)nthreads, sizeof(*job.nnext));
+  job.nextcap = calloc((size_t)nthreads, sizeof(*job.nextcap));
+  frontier = malloc((size_t)g->nnodes * sizeof(*frontier));
+
+  if (job.next != NULL && job.nnext != NULL && job.nextcap != NULL && frontier != NULL) {
+    mmfadvise(g->file, 0, 0, MMF_ADVICE_RANDOM);
+    for (i = 0; i < g->nnodes; i++) dist[i] = UINT32_MAX;
+    dist[source] = 0;
+    frontier[0] = source;
+    reached = 1;
+
+    // Level-synchronous: expand the frontier in parallel, then gather the per-thread next frontiers
+    while (nfrontier > 0 && !job.failed) {
+      int t;
+      job.frontier = frontier;
+      job.nfrontier = nfrontier;
+      mmf_parallel(nthreads, mmfgraph_bfs_part, &job);
+      nfrontier = 0;
+      for (t = 0; t < nthreads; t++) {
+        if (job.nnext[t] > 0) memcpy(frontier + nfrontier, job.next[t], job.nnext[t] * sizeof(*frontier));
+        nfrontier += job.nnext[t];
+      }
+      reached += nfrontier;
+      job.level++;
+    }
+    if (job.failed) {
+      mmfseterror("could not allocate space for BFS frontier: %s", strerror(errno));
+      reached = 0;
+    }
+  } else mmfseterror("could not allocate space for BFS frontier: %s", strerror(errno));
+
+  if (job.next != NULL) {
+    for (i = 0; i < (size_t)nthreads; i++) free(job.next[i]);
+  }
+  free(job.next);
+  free(job.nnext);
+  free(job.nextcap);
+  free(frontier);
+  return reached;
+}
+
+struct mmfgraph_pr_job {
+  MMFGRAPH* g;
+  float* rank;
+  float* contrib;
+  double* dangling;
+  double damping;
+  double base;
+};
+
+// Turns ranks into per-edge contributions and sums the rank of nodes without out-edges.
+static void mmfgraph_pr_scatter(void* arg, int tid, int nthreads)
+{
+  struct mmfgraph_pr_job* job = arg;
+  const uint64_t* offsets = job->g->offsets;
+  size_t begin, end, v;
+  double dangling = 0;
+
+  mmf_split((size_t)job->g->nnodes, tid, nthreads, &begin, &end);
+  for (v = begin; v < end; v++) {
+    uint64_t degree = offsets[v + 1] - offsets[v];
+    if (degree > 0) job->contrib[v] = (float)(job->rank[v] / (double)degree);
+    else {
+      job->contrib[v] = 0;
+      dangling += job->rank[v];
+    }
+  }
+  job->dangling[tid] = dangling;
+}
+
+// Pulls contributions along in-edges; every node is written by one thread only.
+static void mmfgraph_pr_gather(void* arg, int tid, int nthreads)
+{
+  struct mmfgraph_pr_job* job = arg;
+  const uint64_t* toffsets = job->g->toffsets;
+  const uint32_t* tneighbors = job->g->tneighbors;
+  uint64_t nnodes = job->g->nnodes, nedges = job->g->nedges;
+  size_t begin, end, v;
+
+  mmf_split((size_t)nnodes, tid, nthreads, &begin, &end);
+  for (v = begin; v < end; v++) {
+    double sum = 0;
+    uint64_t e, last = toffsets[v + 1] < nedges ? toffsets[v + 1] : nedges;
+    for (e = toffsets[v]; e < last; e++) {
+      if (tneighbors[e] < nnodes) sum += job->contrib[tneighbors[e]];
+    }
+    job->rank[v] = (float)(job->base + job->damping * sum);
+  }
+}
+
+int mmfgraph_pagerank(MMFGRAPH* g, double damping, int iterations, float* rank, int nthreads)
+{
+  int ret = -1, it, t;
+  struct mmfgraph_pr_job job;
+  size_t v, n = (size_t)g->nnodes;
+
+  if (g->toffsets == NULL) {
+    mmfseterror("could not run PageRank: graph was built without in-edges");
+    return -1;
+  }
+  if (nthreads <= 0) nthreads = mmf_cpu_count();
+  memset(&job, 0, sizeof(job));
+  job.g = g;
+  job.rank = rank;
+  job.damping = damping;
+  job.contrib = malloc((n > 0 ? n : 1) * sizeof(*job.contrib));
+  job.dangling = calloc((size_t)nthreads, sizeof(*job.dangling));
+
+  if (job.contrib != NULL && job.dangling != NULL) {
+    size_t toffsets = (size_t)((const char*)g->toffsets - (const char*)mmfdata(g->file));
+    mmfadvise(g->file, toffsets, 0, MMF_ADVICE_SEQUENTIAL);
+    for (v = 0; v < n; v++) rank[v] = (float)(1.0 / (double)n);
+    for (it = 0; it < iterations; it++) {
+      double dangling = 0;
+      mmf_parallel(nthreads, mmfgraph_pr_scatter, &job);
+      for (t = 0; t < nthreads; t++) dangling += job.dangling[t];
+      // Rank of dangling nodes is spread evenly over all nodes
+      job.base = (1.0 - damping) / (double)n + damping * dangling / (double)n;
+      mmf_parallel(nthreads, mmfgraph_pr_gather, &job);
+    }
+    ret = 0;
+  } else mmfseterror("could not allocate space for PageRank: %s", strerror(errno));
+
+  free(job.contrib);
+  free(job.dangling);
+  return ret;
+}
+
+void mmfgraph_close(MMFGRAPH* g)
+{
+  mmfclose(g->file);
+  free(g);
+}
+
+// ----------------------------------------------------------------------------
+// External sort of fixed-size records by a byte-string key (compared as
+// unsigned bytes, like memcmp). The input is cut into runs that fit the
+// memory budget; each run is copied into a mapped scratch file and sorted
+// there by an in-place MSD radix sort whose top-level buckets are spread
+// over threads. The runs are then merged through a heap straight into the
+// output mapping. The sort is not stable.
+// ----------------------------------------------------------------------------
+
+#define MMFSORT_SMALL 32
+
+struct mmfsort_keys {
+  size_t record_size;
+  size_t key_offset;
+  size_t key_len;
+};
+
+static int mmfsort_compare(const struct mmfsort_keys* k, const char* a, const char* b, size_t depth)
+{
+  return memcmp(a + k->key_offset + depth, b + k->key_offset + depth, k->key_len - depth);
+}
+
+static void mmfsort_swap(const struct mmfsort_keys* k, char* a, char* b, char* tmp)
+{
+  memcpy(tmp, a, k->record_size);
+  memcpy(a, b, k->record_size);
+  memcpy(b, tmp, k->record_size);
+}
+
+static void mmfsort_insertion(const struct mmfsort_keys* k, char* base, size_t n, size_t depth, char* tmp)
+{
+  size_t i, j;
+  for (i = 1; i < n; i++) {
+    char* rec = base + i * k->record_size;
+    for (j = i; j > 0 && mmfsort_compare(k, base + (j - 1) * k->record_size, rec, depth) > 0; j--);
+    if (j < i) {
+      memcpy(tmp, rec, k->record_size);
+      memmove(base + (j + 1) * k->record_size, base + j * k->record_size, (i - j) * k->record_size);
+      memcpy(base + j * k->record_size, tmp, k->record_size);
+    }
+  }
+}
+
+// Permutes records into buckets by the key byte at depth (American flag
+// sort) and returns bucket starts in starts[0..256].
+static void mmfsort_permute(const struct mmfsort_keys* k, char* base, size_t depth, const size_t* counts, size_t* starts,
+                            char* tmp)
+{
+  size_t heads[256], b;
+  const size_t at = k->key_offset + depth;
+
+  starts[0] = 0;
+  for (b = 0; b < 256; b++) starts[b + 1] = starts[b] + counts[b];
+  memcpy(heads, starts, sizeof(heads));
+  for (b = 0; b < 256; b++) {
+    while (heads[b] < starts[b + 1]) {
+      char* rec = base + heads[b] * k->record_size;
+      unsigned char c = (unsigned char)rec[at];
+      // Swap the record home until one that belongs here arrives
+      while (c != b) {
+        mmfsort_swap(k, rec, base + heads[c]++ * k->record_size, tmp);
+        c = (unsigned char)rec[at];
+      }
+      heads[b]++;
+    }
+  }
+}
+
+static void mmfsort_radix(const struct mmfsort_keys* k, char* base, size_t n, size_t depth, char* tmp)
+{
+  size_t counts[256], starts[257], i, b;
+
+  if (n < MMFSORT_SMALL) {
+    mmfsort_insertion(k, base, n, depth, tmp);
+    return;
+  }
+
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < n; i++) counts[(unsigned char)base[i * k->record_size + k->key_offset + depth]]++;
+  mmfsort_permute(k, base, depth, counts, starts, tmp);
+  if (depth + 1 < k->key_len) {
+    for (b = 0; b < 256; b++) {
+      if (counts[b] > 1) mmfsort_radix(k, base + starts[b] * k->record_size, counts[b], depth + 1, tmp);
+    }
+  }
+}
+
+struct mmfsort_job {
+  const struct mmfsort_keys* keys;
+  char* base;
+  size_t n;
+  size_t* counts;
+  size_t starts[257];
+  int owner[256];
+  bool failed;
+};
+
+static void mmfsort_count_part(void* arg, int tid, int nthreads)
+{
+  struct mmfsort_job* job = arg;
+  size_t* counts = job->counts + (size_t)tid * 256;
+  size_t begin, end, i;
+
+  mmf_split(job->n, tid, nthreads, &begin, &end);
+  for (i = begin; i < end; i++) counts[(unsigned char)job->base[i * job->keys->record_size + job->keys->key_offset]]++;
+}
+
+static void mmfsort_bucket_part(void* arg, int tid, int nthreads)
+{
+  struct mmfsort_job* job = arg;
+  char* tmp = malloc(job->keys->record_size);
+  int b;
+
+  (void)nthreads;
+  if (tmp == NULL) {
+    job->failed = true;
+    return;
+  }
+  for (b = 0; b < 256; b++) {
+    size_t n = job->starts[b + 1] - job->starts[b];
+    if (job->owner[b] == tid && n > 1) {
+      mmfsort_radix(job->keys, job->base + job->starts[b] * job->keys->record_size, n, 1, tmp);
+    }
+  }
+  free(tmp);
+}
+
+// Sorts n records in place: counts the first key byte in parallel, permutes
+// once, then gives every thread whole buckets, largest first to the least loaded.
+static bool mmfsort_run(const struct mmfsort_keys* k, char* base, size_t n, int nthreads)
+{
+  struct mmfsort_job job;
+  size_t totals[256], load[64], b, t;
+  char* tmp = malloc(k->record_size);
+  bool ok = false;
+
+  if (nthreads > 64) nthreads = 64;
+  memset(&job, 0, sizeof(job));
+  job.keys = k;
+  job.base = base;
+  job.n = n;
+  job.counts = calloc((size_t)nthreads * 256, sizeof(*job.counts));
+  if (tmp != NULL && job.counts != NULL) {
+    if (n < MMFSORT_SMALL * 256 || k->key_len == 1) mmfsort_radix(k, base, n, 0, tmp);
+    else {
+      mmf_parallel(nthreads, mmfsort_count_part, &job);
+      for (b = 0; b < 256; b++) {
+        totals[b] = 0;
+        for (t = 0; t < (size_t)nthreads; t++) totals[b] += job.counts[t * 256 + b];
+      }
+      mmfsort_permute(k, base, 0, totals, job.starts, tmp);
+
+      memset(load, 0, sizeof(load));
+      for (b = 0; b < 256; b++) job.owner[b] = -1;
+      for (b = 0; b < 256; b++) {
+        size_t biggest = 0, best = 0, i;
+        for (i = 0; i < 256; i++) {
+          if (job.owner[i] == -1 && (totals[i] > totals[biggest] || job.owner[biggest] != -1)) biggest = i;
+        }
+        for (t = 1; t < (size_t)nthreads; t++) {
+          if (load[t] < load[best]) best = t;
+        }
+        job.owner[biggest] = (int)best;
+        load[best] += totals[biggest];
+      }
+      mmf_parallel(nthreads, mmfsort_bucket_part, &job);
+    }
+    ok = !job.failed;
+  }
+
+  free(tmp);
+  free(job.counts);
+  return ok;
+}
+
+struct mmfsort_cursor {
+  const char* pos;
+  const char* end;
+  size_t run;
+};
+
+static bool mmfsort_cursor_less(const struct mmfsort_keys* k, const struct mmfsort_cursor* a, const struct mmfsort_cursor* b)
+{
+  int c = mmfsort_compare(k, a->pos, b->pos, 0);
+  return c < 0 || (c == 0 && a->run < b->run);
+}
+
+static void mmfsort_sift_down(const struct mmfsort_keys* k, struct mmfsort_cursor* heap, size_t n, size_t at)
+{
+  for (;;) {
+    size_t child = 2 * at + 1, least = at;
+    struct mmfsort_cursor t;
+    if (child < n && mmfsort_cursor_less(k, &heap[child], &heap[least])) least = child;
+    if (child + 1 < n && mmfsort_cursor_less(k, &heap[child + 1], &heap[least])) least = child + 1;
+    if (least == at) return;
+    t = heap[at];
+    heap[at] = heap[least];
+    heap[least] = t;
+    at = least;
+  }
+}
+
+int mmfsort(const char* in, const char* out, size_t record_size, size_t key_offset, size_t key_len, size_t mem_budget)
+{
+  int ret = -1;
+  struct mmfsort_keys k;
+  MMFILE *src, *dst = NULL, *scratch = NULL;
+  size_t n, runlen, nruns, size, r;
+  char* scratchname = NULL;
+  int nthreads = mmf_cpu_count();
+
+  if (record_size == 0 || key_len == 0 || key_offset > record_size || key_len > record_size - key_offset) {
+    mmfseterror("could not sort: key does not fit into the record");
+    return -1;
+  }
+  if (strcmp(in, out) == 0) {
+    mmfseterror("could not sort: input and output must be different files");
+    return -1;
+  }
+
+  src = mmfopen(in, "r");
+  if (src == NULL) return -1;
+  size = mmfsize(src);
+  n = size / record_size;
+  runlen = mem_budget / record_size > 0 ? mem_budget / record_size : 1;
+  nruns = n > 0 ? (n + runlen - 1) / runlen : 0;
+  k.record_size = record_size;
+  k.key_offset = key_offset;
+  k.key_len = key_len;
+
+  if (size % record_size != 0) mmfseterror("could not sort: file size is not a multiple of the record size");
+  else if ((dst = mmfcreate(out, size)) != NULL) {
+    char* runs = mmfdata(dst);
+    bool ok = true;
+
+    // With several runs they are sorted in a scratch file and merged into the output
+    if (nruns > 1) {
+      scratchname = malloc(strlen(out) + 6);
+      if (scratchname != NULL) {
+        strcpy(scratchname, out);
+        strcat(scratchname, ".runs");
+        scratch = mmfcreate(scratchname, size);
+        if (scratch != NULL) runs = mmfdata(scratch);
+        else ok = false;
+      } else {
+        mmfseterror("could not allocate space for file name: %s", strerror(errno));
+        ok = false;
+      }
+    }
+
+    mmfadvise(src, 0, 0, MMF_ADVICE_SEQUENTIAL);
+    for (r = 0; ok && r < nruns; r++) {
+      size_t first = r * runlen, count = n - first < runlen ? n - first : runlen;
+      char* run = runs + first * record_size;
+      memcpy(run, (const char*)mmfdata(src) + first * record_size, count * record_size);
+      mmfadvise(src, first * record_size, count * record_size, MMF_ADVICE_DONTNEED);
+      ok = mmfsort_run(&k, run, count, nthreads);
+      if (!ok) mmfseterror("could not allocate space for sorting: %s", strerror(errno));
+      else if (scratch != NULL) mmfadvise(scratch, first * record_size, count * record_size, MMF_ADVICE_DONTNEED);
+    }
+
+    if (ok && scratch != NULL) {
+      struct mmfsort_cursor* heap = malloc(nruns * sizeof(*heap));
+      if (heap != NULL) {
+        char* to = mmfdata(dst);
+        size_t live = nruns;
+        mmfadvise(scratch, 0, 0, MMF_ADVICE_SEQUENTIAL);
+        mmfadvise(dst, 0, 0, MMF_ADVICE_SEQUENTIAL);
+        for (r = 0; r < nruns; r++) {
+          size_t first = r * runlen, count = n - first < runlen ? n - first : runlen;
+          heap[r].pos = runs + first * record_size;
+          heap[r].end = heap[r].pos + count * record_size;
+          heap[r].run = r;
+        }
+        for (r = nruns / 2; r > 0; r--) mmfsort_sift_down(&k, heap, live, r - 1);
+        while (live > 0) {
+          memcpy(to, heap[0].pos, record_size);
+          to += record_size;
+          heap[0].pos += record_size;
+          if (heap[0].pos == heap[0].end) heap[0] = heap[--live];
+          mmfsort_sift_down(&k, heap, live, 0);
+        }
+        free(heap);
+      } else {
+        mmfseterror("could not allocate space for merge heap: %s", strerror(errno));
+        ok = false;
+      }
+    }
+
+    if (ok && mmfflush(dst) == 0) ret = 0;
+    mmfclose(dst);
+    if (ret != 0) remove(out);
+    if (scratch != NULL) mmfclose(scratch);
+    if (scratchname != NULL) remove(scratchname);
+  }
+
+  free(scratchname);
+  mmfclose(src);
+  return ret;
+}
+
+// ----------------------------------------------------------------------------
+// In-place sort of records inside a writable mapping. Keys of up to eight
+// bytes (or keys from a callback) are packed with record numbers into
+// pairs that are sorted by a parallel LSD radix sort: each pass counts a
+// digit per thread, then scatters through small per-bucket buffers that
+// are flushed a few cache lines at a time. Records are then moved once,
+// cycle by cycle, into their sorted places. The pairs take 32 bytes per
+// record, so longer byte keys, and short ones when free memory cannot hold
+// the pairs, go through the MSD radix sort of mmfsort directly in the mapping.
+// ----------------------------------------------------------------------------
+
+#define MMFSORT_WC 8
+
+struct mmfsort_pair {
+  uint64_t key;
+  uint64_t index;
+};
+
+struct mmfsort_lsd {
+  struct mmfsort_pair* from;
+  struct mmfsort_pair* to;
+  size_t n;
+  size_t* counts;                                          // 256 per thread, then offsets
+  int shift;
+  int bits;                                                // Key bits to sort by
+  const char* data;
+  size_t record_size;
+  size_t key_offset;
+  size_t key_len;
+  MMFSORTKEY key;
+  void* ctx;
+};
+
+static void mmfsort_keys_part(void* arg, int tid, int nthreads)
+{
+  struct mmfsort_lsd* job = arg;
+  size_t begin, end, i, j;
+
+  mmf_split(job->n, tid, nthreads, &begin, &end);
+  for (i = begin; i < end; i++) {
+    const unsigned char* rec = (const unsigned char*)job->data + i * job->record_size;
+    uint64_t key = 0;
+    if (job->key != NULL) key = job->key(rec, job->ctx);
+    else {
+      for (j = 0; j < job->key_len; j++) key = key << 8 | rec[job->key_offset + j];
+    }
+    job->from[i].key = key;
+    job->from[i].index = i;
+  }
+}
+
+static void mmfsort_digit_part(void* arg, int tid, int nthreads)
+{
+  struct mmfsort_lsd* job = arg;
+  size_t* counts = job->counts + (size_t)tid * 256;
+  size_t begin, end, i;
+
+  mmf_split(job->n, tid, nthreads, &begin, &end);
+  memset(counts, 0, 256 * sizeof(*counts));
+  for (i = begin; i < end; i++) counts[(job->from[i].key >> job->shift) & 255]++;
+}
+
+static void mmfsort_scatter_part(void* arg, int tid, int nthreads)
+{
+  struct mmfsort_lsd* job = arg;
+  size_t* next = job->counts + (size_t)tid * 256;
+  struct mmfsort_pair* buffers = malloc(256 * MMFSORT_WC * sizeof(*buffers));
+  unsigned char fill[256];
+  size_t begin, end, i;
+  int b;
+
+  mmf_split(job->n, tid, nthreads, &begin, &end);
+  if (buffers == NULL) {
+    // Scatter directly
+    for (i = begin; i < end; i++) job->to[next[(job->from[i].key >> job->shift) & 255]++] = job->from[i];
+    return;
+  }
+  memset(fill, 0, sizeof(fill));
+  for (i = begin; i < end; i++) {
+    b = (int)((job->from[i].key >> job->shift) & 255);
+    buffers[b * MMFSORT_WC + fill[b]] = job->from[i];
+    if (++fill[b] == MMFSORT_WC) {
+      memcpy(job->to + next[b], buffers + b * MMFSORT_WC, MMFSORT_WC * sizeof(*buffers));
+      next[b] += MMFSORT_WC;
+      fill[b] = 0;
+    }
+  }
+  for (b = 0; b < 256; b++) {
+    if (fill[b] > 0) memcpy(job->to + next[b], buffers + b * MMFSORT_WC, fill[b] * sizeof(*buffers));
+  }
+  free(buffers);
+}
+
+static int mmfsort_pairs(char* data, size_t n, size_t record_size, struct mmfsort_lsd* job, int nthreads)
+{
+  int ret = -1;
+  struct mmfsort_pair* pairs = malloc(2 * n * sizeof(*pairs));
+  char* tmp = malloc(record_size);
+
+  job->counts = malloc((size_t)nthreads * 256 * sizeof(*job->counts));
+  if (pairs != NULL && tmp != NULL && job->counts != NULL) {
+    size_t i, t, b, sum;
+    job->data = data;
+    job->n = n;
+    job->record_size = record_size;
+    job->from = pairs;
+    job->to = pairs + n;
+    mmf_parallel(nthreads, mmfsort_keys_part, job);
+
+    for (job->shift = 0; job->shift < job->bits; job->shift += 8) {
+      struct mmfsort_pair* swap;
+      bool trivial = false;
+      mmf_parallel(nthreads, mmfsort_digit_part, job);
+      // Turn counts into scatter offsets, ordered by bucket, then by thread
+      for (b = 0, sum = 0; b < 256; b++) {
+        size_t total = 0;
+        for (t = 0; t < (size_t)nthreads; t++) {
+          size_t c = job->counts[t * 256 + b];
+          job->counts[t * 256 + b] = sum;
+          sum += c;
+          total += c;
+        }
+        if (total == n) trivial = true;
+      }
+      if (trivial) continue;
+      mmf_parallel(nthreads, mmfsort_scatter_part, job);
+      swap = job->from;
+      job->from = job->to;
+      job->to = swap;
+    }
+
+    // Move every record once along the cycles of the permutation
+    for (i = 0; i < n; i++) {
+      size_t j = i, k;
+      if (job->from[i].index == i) continue;
+      memcpy(tmp, data + i * record_size, record_size);
+      while ((k = (size_t)job->from[j].index) != i) {
+        memcpy(data + j * record_size, data + k * record_size, record_size);
+        job->from[j].index = j;
+        j = k;
+      }
+      memcpy(data + j * record_size, tmp, record_size);
+      job->from[j].index = j;
+    }
+    ret = 0;
+  } else mmfseterror("could not allocate space for sorting: %s", strerror(errno));
+
+  free(job->counts);
+  free(tmp);
+  free(pairs);
+  return ret;
+}
+
+int mmfsort_inplace(MMFILE* mmf, size_t record_size, size_t key_offset, size_t key_len, int nthreads)
+{
+  int ret = -1;
+  size_t n;
+
+  if (nthreads <= 0) nthreads = mmf_cpu_count();
+  if (record_size == 0 || key_len == 0 || key_offset > record_size || key_len > record_size - key_offset) {
+    mmfseterror("could not sort: key does not fit into the record");
+  } else if (mmfsize(mmf) % record_size != 0) {
+    mmfseterror("could not sort: file size is not a multiple of the record size");
+  } else if ((n = mmfsize(mmf) / record_size) < 2) ret = 0;
+  else if (key_len <= 8 && n <= mmf_available_memory() / (2 * sizeof(struct mmfsort_pair))) {
+    struct mmfsort_lsd job;
+    memset(&job, 0, sizeof(job));
+    job.key_offset = key_offset;
+    job.key_len = key_len;
+    job.bits = (int)key_len * 8;
+    ret = mmfsort_pairs(mmfdata(mmf), n, record_size, &job, nthreads);
+  } else {
+    struct mmfsort_keys k;
+    k.record_size = record_size;
+    k.key_offset = key_offset;
+    k.key_len = key_len;
+    if (mmfsort_run(&k, mmfdata(mmf), n, nthreads)) ret = 0;
+    else mmfseterror("could not allocate space for sorting: %s", strerror(errno));
+  }
+
+  return ret;
+}
+
+int mmfsort_inplace_by(MMFILE* mmf, size_t record_size, MMFSORTKEY key, void* ctx, int nthreads)
+{
+  int ret = -1;
+  size_t n;
+
+  if (nthreads <= 0) nthreads = mmf_cpu_count();
+  if (record_size == 0) mmfseterror("could not sort: record size is zero");
+  else if (mmfsize(mmf) % record_size != 0) mmfseterror("could not sort: file size is not a multiple of the record size");
+  else if ((n = mmfsize(mmf) / record_size) < 2) ret = 0;
+  else {
+    struct mmfsort_lsd job;
+    memset(&job, 0, sizeof(job));
+    job.key = key;
+    job.ctx = ctx;
+    job.bits = 64;
+    ret = mmfsort_pairs(mmfdata(mmf), n, record_size, &job, nthreads);
+  }
+
+  return ret;
+}
+
+// ----------------------------------------------------------------------------
+// Streams of records framed by a varint (LEB128) length prefix. A writer
+// may put a sync marker, best a long random byte string, between any two
+// records; readers skip it, and the parallel scan starts every chunk but
+// the first at the first marker inside it. Lengths are decoded from one
+// unaligned 64-bit load: the stop bit is found by a bit scan and the 7-bit
+// groups are squeezed together with PEXT or three shift-and-mask steps.
+// ----------------------------------------------------------------------------
+
+struct MMFRECITER_impl {
+  const unsigned char* base;
+  const unsigned char* pos;
+  const unsigned char* end;
+  const unsigned char* sync;
+  size_t synclen;
+};
+
+// Decodes a length prefix, returns false if the prefix is truncated or too long
+static bool mmfrec_length(const unsigned char** p, const unsigned char* end, uint64_t* len)
+{
+  if (end - *p >= 8) {
+    uint64_t w, stops;
+    memcpy(&w, *p, sizeof(w));
+    stops = ~w & 0x8080808080808080ULL;
+    if (stops != 0) {
+      int bytes = (mmf_ctz64(stops) >> 3) + 1;
+      if (bytes < 8) w &= ((uint64_t)1 << (bytes * 8)) - 1;
+#if defined(__BMI2__)
+      w = _pext_u64(w, 0x7f7f7f7f7f7f7f7fULL);
+#else
+      w = (w & 0x007f007f007f007fULL) | ((w & 0x7f007f007f007f00ULL) >> 1);
+      w = (w & 0x00003fff00003fffULL) | ((w & 0x3fff00003fff0000ULL) >> 2);
+      w = (w & 0x000000000fffffffULL) | ((w & 0x0fffffff00000000ULL) >> 4);
+#endif
+      *p += bytes;
+      *len = w;
+      return true;
+    }
+  }
+  return mmf_get_varint(p, end, len);
+}
+
+static bool mmfrec_at_sync(const unsigned char* p, const unsigned char* end, const unsigned char* sync, size_t synclen)
+{
+  return synclen > 0 && (size_t)(end - p) >= synclen && *p == *sync && memcmp(p, sync, synclen) == 0;
+}
+
+// Returns the first sync marker at or after p, or end
+static const unsigned char* mmfrec_find_sync(const unsigned char* p, const unsigned char* end, const unsigned char* sync,
+                                             size_t synclen)
+{
+  while ((size_t)(end - p) >= synclen) {
+    p = memchr(p, *sync, (size_t)(end - p) - synclen + 1);
+    if (p == NULL) break;
+    if (memcmp(p, sync, synclen) == 0) return p;
+    p++;
+  }
+  return end;
+}
+
+// Steps over a marker and one record, returns 1 for a record, 0 at the stop, -1 on bad framing
+static int mmfrec_step(const unsigned char** pos, const unsigned char* stop, const unsigned char* end,
+                       const unsigned char* sync, size_t synclen, const void** rec, size_t* len)
+{
+  const unsigned char* p = *pos;
+  uint64_t n;
+
+  while (p < stop && mmfrec_at_sync(p, end, sync, synclen)) p += synclen;
+  if (p >= stop) {
+    *pos = p;
+    return 0;
+  }
+  if (!mmfrec_length(&p, end, &n) || n > (uint64_t)(end - p)) return -1;
+  *rec = p;
+  *len = (size_t)n;
+  *pos = p + n;
+  return 1;
+}
+
+MMFRECITER* mmfrec_iter(const void* data, size_t size, const void* sync, size_t synclen)
+{
+  MMFRECITER* it = calloc(1, sizeof(*it));
+
+  if (it != NULL) {
+    it->base = data;
+    it->pos = it->base;
+    it->end = it->pos + size;
+    it->sync = sync;
+    it->synclen = sync != NULL ? synclen : 0;
+  } else mmfseterror("could not allocate space for MMFRECITER: %s", strerror(errno));
+
+  return it;
+}
+
+int mmfrec_next(MMFRECITER* it, const void** rec, size_t* len)
+{
+  int ret = mmfrec_step(&it->pos, it->end, it->end, it->sync, it->synclen, rec, len);
+
+  if (ret < 0) {
+    mmfseterror("could not read record: bad length prefix after offset %llu", (unsigned long long)(it->pos - it->base));
+  }
+  return ret;
+}
+
+void mmfrec_iter_close(MMFRECITER* it)
+{
+  free(it);
+}
+
+struct mmfrec_scan {
+  const unsigned char* data;
+  size_t size;
+  const unsigned char* sync;
+  size_t synclen;
+  MMFRECCB cb;
+  void* ctx;
+  uint32_t stop;                                           // Set once a callback asks to stop
+  uint32_t bad;                                            // Set once a chunk meets bad framing
+};
+
+static void mmfrec_scan_part(void* arg, int tid, int nthreads)
+{
+  struct mmfrec_scan* scan = arg;
+  const unsigned char* end = scan->data + scan->size;
+  const unsigned char *pos, *stop;
+  size_t begin, last;
+  const void* rec;
+  size_t len;
+  int r;
+
+  mmf_split(scan->size, tid, nthreads, &begin, &last);
+  pos = tid == 0 ? scan->data : mmfrec_find_sync(scan->data + begin, end, scan->sync, scan->synclen);
+  stop = tid == nthreads - 1 ? end : mmfrec_find_sync(scan->data + last, end, scan->sync, scan->synclen);
+  while (!mmf_atomic_load32(&scan->stop) && (r = mmfrec_step(&pos, stop, end, scan->sync, scan->synclen, &rec, &len)) != 0) {
+    if (r < 0) {
+      mmf_atomic_cas32(&scan->bad, 0, 1);
+      break;
+    }
+    if (scan->cb(rec, len, tid, scan->ctx)) mmf_atomic_cas32(&scan->stop, 0, 1);
+  }
+}
+
+int mmfrec_parallel(const void* data, size_t size, const void* sync, size_t synclen, MMFRECCB cb, void* ctx, int nthreads)
+{
+  int ret = -1;
+  struct mmfrec_scan scan;
+
+  if (nthreads <= 0) nthreads = mmf_cpu_count();
+  // Without markers there is no way to find a record boundary mid-stream
+  if (sync == NULL || synclen == 0) nthreads = 1;
+  memset(&scan, 0, sizeof(scan));
+  scan.data = data;
+  scan.size = size;
+  scan.sync = sync;
+  scan.synclen = sync != NULL ? synclen : 0;
+  scan.cb = cb;
+  scan.ctx = ctx;
+  mmf_parallel(nthreads, mmfrec_scan_part, &scan);
+  if (scan.bad) mmfseterror("could not read record: bad length prefix");
+  else ret = 0;
+
+  return ret;
+}
+
+// ----------------------------------------------------------------------------
+// Byte histograms. Counting into a single table stalls whenever nearby
+// bytes are equal, because each increment has to wait for the previous
+// store to the same counter; four tables, each fed every fourth byte of a
+// 64-bit load, keep such increments independent. Threads take whole
+// blocks, so per-block entropy comes out of the same pass.
+// ----------------------------------------------------------------------------
+
+// Counts bytes into a histogram, which is added to and not cleared
+static void mmfhist_count(const unsigned char* p, size_t n, uint64_t* counts)
+{
+  uint32_t tables[4][256];
+  size_t chunk, i;
+  int b;
+
+  while (n > 0) {
+    // Chunks keep every 32-bit counter from overflowing
+    chunk = n < ((size_t)1 << 30) ? n : ((size_t)1 << 30);
+    memset(tables, 0, sizeof(tables));
+    for (i = 0; i + 8 <= chunk; i += 8) {
+      uint64_t w;
+      memcpy(&w, p + i, sizeof(w));
+      tables[0][w & 255]++;
+      tables[1][(w >> 8) & 255]++;
+      tables[2][(w >> 16) & 255]++;
+      tables[3][(w >> 24) & 255]++;
+      tables[0][(w >> 32) & 255]++;
+      tables[1][(w >> 40) & 255]++;
+      tables[2][(w >> 48) & 255]++;
+      tables[3][w >> 56]++;
+    }
+    for (; i < chunk; i++) tables[0][p[i]]++;
+    for (b = 0; b < 256; b++) counts[b] += (uint64_t)tables[0][b] + tables[1][b] + tables[2][b] + tables[3][b];
+    p += chunk;
+    n -= chunk;
+  }
+}
+
+double mmfentropy(const uint64_t counts[256])
+{
+  double total = 0.0, sum = 0.0;
+  int b;
+
+  for (b = 0; b < 256; b++) {
+    if (counts[b] > 0) {
+      total += (double)counts[b];
+      sum += (double)counts[b] * mmf_log((double)counts[b]);
+    }
+  }
+  // H = log n - (1/n) sum c log c, in bits
+  return total > 0.0 ? (mmf_log(total) - sum / total) / mmf_log(2.0) : 0.0;
+}
+
+struct mmfhist_job {
+  const unsigned char* data;
+  size_t size;
+  size_t block_size;
+  size_t nblocks;
+  uint64_t* counts;                                        // 256 per thread
+  double* block_entropy;
+};
+
+static void mmfhist_part(void* arg, int tid, int nthreads)
+{
+  struct mmfhist_job* job = arg;
+  uint64_t* total = job->counts + (size_t)tid * 256;
+  uint64_t block[256];
+  size_t begin, end, i;
+  int b;
+
+  mmf_split(job->nblocks, tid, nthreads, &begin, &end);
+  for (i = begin; i < end; i++) {
+    size_t offset = i * job->block_size;
+    size_t n = job->size - offset < job->block_size ? job->size - offset : job->block_size;
+    memset(block, 0, sizeof(block));
+    mmfhist_count(job->data + offset, n, block);
+    for (b = 0; b < 256; b++) total[b] += block[b];
+    if (job->block_entropy != NULL) job->block_entropy[i] = mmfentropy(block);
+  }
+}
+
+int mmfhistogram(MMFILE* mmf, size_t block_size, int nthreads, uint64_t counts[256], double* block_entropy)
+{
+  int ret = -1;
+  struct mmfhist_job job;
+  size_t size = mmfsize(mmf);
+  int b, t;
+
+  if (nthreads <= 0) nthreads = mmf_cpu_count();
+  memset(&job, 0, sizeof(job));
+  job.data = mmfdata(mmf);
+  job.size = size;
+  // Without entropy blocks every thread gets one block
+  job.block_size = block_size > 0 && block_entropy != NULL ? block_size : (size + (size_t)nthreads - 1) / (size_t)nthreads;
+  if (job.block_size == 0) job.block_size = 1;
+  job.nblocks = (size + job.block_size - 1) / job.block_size;
+  job.block_entropy = block_size > 0 ? block_entropy : NULL;
+  job.counts = calloc((size_t)nthreads * 256, sizeof(*job.counts));
+
+  if (job.counts != NULL) {
+    mmfadvise(mmf, 0, 0, MMF_ADVICE_SEQUENTIAL);
+    mmf_parallel(nthreads, mmfhist_part, &job);
+    for (b = 0; b < 256; b++) {
+      counts[b] = 0;
+      for (t = 0; t < nthreads; t++) counts[b] += job.counts[(size_t)t * 256 + b];
+    }
+    ret = 0;
+  } else mmfseterror("could not allocate space for histograms: %s", strerror(errno));
+
+  free(job.counts);
+  return ret;
+}
+
+// ----------------------------------------------------------------------------
+// Writer of block-compressed files (see the layout next to the codec).
+// Blocks are compressed in parallel, a batch of a few per thread at a time,
+// and written in order.
+// ----------------------------------------------------------------------------
+
+#define MMFZ_BLOCK 262144
+
+struct mmfz_batch {
+  const unsigned char* data;
+  size_t size;
+  size_t block_size;
+  size_t first;                                            // First block of the batch
+  size_t count;
+  unsigned char* out;                                      // mmfz_bound(block_size) bytes per block
+  size_t* sizes;
+  uint32_t* tables;                                        // Hash table per thread
+};
+
+static void mmfz_batch_part(void* arg, int tid, int nthreads)
+{
+  struct mmfz_batch* batch = arg;
+  size_t bound = mmfz_bound(batch->block_size), i;
+
+  for (i = (size_t)tid; i < batch->count; i += (size_t)nthreads) {
+    size_t offset = (batch->first + i) * batch->block_size;
+    size_t raw = batch->size - offset < batch->block_size ? batch->size - offset : batch->block_size;
+    unsigned char* out = batch->out + i * bound;
+    batch->sizes[i] = mmfz_compress_block(batch->data + offset, raw, out, batch->tables + ((size_t)tid << MMFZ_HASHBITS));
+    if (batch->sizes[i] >= raw) {
+      // Stored blocks are told apart by their length
+      memcpy(out, batch->data + offset, raw);
+      batch->sizes[i] = raw;
+    }
+  }
+}
+
+int mmfz_compress(const char* in, const char* out, size_t block_size)
+{
+  int ret = -1;
+  MMFILE* src;
+  FILE* dst;
+  int nthreads = mmf_cpu_count();
+  struct mmfz_batch batch;
+  struct mmfz_header header;
+  uint64_t* offsets;
+  size_t perbatch = (size_t)nthreads * 4, b;
+
+  if (block_size == 0) block_size = MMFZ_BLOCK;
+  if (block_size % MMFZ_ALIGN != 0 || block_size > UINT32_MAX) {
+    mmfseterror("could not compress: block size must be a multiple of %d", MMFZ_ALIGN);
+    return -1;
+  }
+  src = mmfopen(in, "r");
+  if (src == NULL) return -1;
+
+  memset(&batch, 0, sizeof(batch));
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, mmfz_magic, sizeof(header.magic));
+  header.size = mmfsize(src);
+  header.nblocks = (header.size - 1) / block_size + 1;
+  header.block_size = (uint32_t)block_size;
+  batch.data = mmfdata(src);
+  batch.size = mmfsize(src);
+  batch.block_size = block_size;
+  batch.out = malloc(perbatch * mmfz_bound(block_size));
+  batch.sizes = malloc(perbatch * sizeof(*batch.sizes));
+  batch.tables = malloc(((size_t)nthreads << MMFZ_HASHBITS) * sizeof(*batch.tables));
+  offsets = malloc((size_t)(header.nblocks + 1) * sizeof(*offsets));
+
+  if (batch.out != NULL && batch.sizes != NULL && batch.tables != NULL && offsets != NULL) {
+    dst = fopen(out, "wb");
+    if (dst != NULL) {
+      // The index is written once all block sizes are known
+      bool ok = fwrite(&header, sizeof(header), 1, dst) == 1;
+      offsets[0] = sizeof(header) + (header.nblocks + 1) * sizeof(*offsets);
+      ok = ok && fseek(dst, (long)offsets[0], SEEK_SET) == 0;
+      mmfadvise(src, 0, 0, MMF_ADVICE_SEQUENTIAL);
+      for (batch.first = 0; ok && batch.first < header.nblocks; batch.first += batch.count) {
+        batch.count = header.nblocks - batch.first < perbatch ? (size_t)header.nblocks - batch.first : perbatch;
+        mmf_parallel(nthreads, mmfz_batch_part, &batch);
+        for (b = 0; ok && b < batch.count; b++) {
+          ok = fwrite(batch.out + b * mmfz_bound(block_size), 1, batch.sizes[b], dst) == batch.sizes[b];
+          offsets[batch.first + b + 1] = offsets[batch.first + b] + batch.sizes[b];
+        }
+      }
+      if (ok) rewind(dst);
+      ok = ok && fwrite(&header, sizeof(header), 1, dst) == 1 &&
+           fwrite(offsets, sizeof(*offsets), (size_t)header.nblocks + 1, dst) == header.nblocks + 1;
+      if (ok) ret = 0;
+      else mmfseterror("could not write compressed file: %s", strerror(errno));
+      if (fclose(dst) != 0 && ret == 0) {
+        mmfseterror("could not close the file: %s", strerror(errno));
+        ret = -1;
+      }
+      if (ret != 0) remove(out);
+    } else mmfseterror("could not create the file: %s", strerror(errno));
+  } else mmfseterror("could not allocate space for compression: %s", strerror(errno));
+
+  free(offsets);
+  free(batch.tables);
+  free(batch.sizes);
+  free(batch.out);
+  mmfclose(src);
+  return ret;
+}
+
+// ----------------------------------------------------------------------------
+// Cache of mapped windows over a set of files. Window k of a file starts at
+// k * window_size and is mapped max_len bytes longer, so any request of up
+// to max_len bytes lies inside the window of its first byte. Windows live
+// in shards chosen by a hash of (file, window). Each shard has a fixed pool
+// of windows, an open-addressing table of pool indices, a spin lock taken
+// only on misses, and a CLOCK hand approximating LRU. A hit takes no lock:
+// it pins the window found in the table with a compare-and-swap on its
+// reference count and then checks that the window still holds the wanted
+// part of the file, because the window may have been recycled meanwhile.
+// Unpinned windows are recycled only after the count is swung to DEAD.
+// Slots of recycled windows become tombstones, and once they fill a quarter
+// of the table it is rebuilt under the lock; a lookup that runs meanwhile
+// may miss, but misses look again under the lock.
+// ----------------------------------------------------------------------------
+
+#define MMFCACHE_SHARDS 64
+#define MMFCACHE_DEAD UINT32_MAX                          // Reference count of unmapped or recycled windows
+#define MMFCACHE_TOMB UINT32_MAX                          // Table slot whose window was evicted
+
+struct MMFCACHEWIN_impl {
+  uint32_t refs;
+  uint32_t referenced;                                     // CLOCK bit, set on every hit
+  size_t file;
+  uint64_t index;
+  char* mem;
+  size_t len;
+};
+
+struct mmfcache_shard {
+  uint32_t lock;
+  size_t hand;
+  struct MMFCACHEWIN_impl* windows;
+  uint32_t* table;                                         // Pool index + 1, 0 for empty
+  size_t tablemask;
+  size_t tombs;                                            // Tombstones in the table
+  char padding[64];
+};
+
+struct MMFCACHE_impl {
+  struct mmf_source* files;
+  size_t nfiles;
+  size_t window_size;
+  size_t max_len;
+  size_t nshards;
+  size_t pershard;                                         // Windows per shard
+  struct mmfcache_shard* shards;
+};
+
+static uint64_t mmfcache_hash(size_t file, uint64_t index)
+{
+  uint64_t state = index ^ ((uint64_t)file << 40 | (uint64_t)file >> 24);
+  return mmf_splitmix64(&state);
+}
+
+static void mmfcache_unpin_window(struct MMFCACHEWIN_impl* w)
+{
+  uint32_t refs = mmf_atomic_load32(&w->refs);
+  while (!mmf_atomic_cas32(&w->refs, refs, refs - 1)) refs = mmf_atomic_load32(&w->refs);
+}
+
+// Looks the window up without locking and returns it pinned, or NULL
+static struct MMFCACHEWIN_impl* mmfcache_find(struct mmfcache_shard* shard, uint64_t hash, size_t file, uint64_t index)
+{
+  size_t probe;
+
+  for (probe = 0; probe <= shard->tablemask; probe++) {
+    uint32_t slot = mmf_atomic_load32(&shard->table[(hash + probe) & shard->tablemask]);
+    struct MMFCACHEWIN_impl* w;
+    uint32_t refs;
+    if (slot == 0) break;
+    if (slot == MMFCACHE_TOMB) continue;
+    w = &shard->windows[slot - 1];
+    refs = mmf_atomic_load32(&w->refs);
+    while (refs != MMFCACHE_DEAD && !mmf_atomic_cas32(&w->refs, refs, refs + 1)) refs = mmf_atomic_load32(&w->refs);
+    if (refs == MMFCACHE_DEAD) continue;
+    if (w->file == file && w->index == index) return w;
+    mmfcache_unpin_window(w);
+  }
+  return NULL;
+}
+
+// Puts a window into the table of its locked shard
+static void mmfcache_insert(struct mmfcache_shard* shard, struct MMFCACHEWIN_impl* w, uint64_t hash)
+{
+  size_t i;
+
+  for (i = 0; i <= shard->tablemask; i++) {
+    uint32_t* slot = &shard->table[(hash + i) & shard->tablemask];
+    if (*slot == 0 || *slot == MMFCACHE_TOMB) {
+      if (*slot == MMFCACHE_TOMB) shard->tombs--;
+      mmf_atomic_store32(slot, (uint32_t)(w - shard->windows) + 1);
+      break;
+    }
+  }
+}
+
+// Rebuilds the table of a locked shard from its mapped windows, dropping tombstones
+static void mmfcache_rehash(MMFCACHE* c, struct mmfcache_shard* shard)
+{
+  size_t i;
+
+  for (i = 0; i <= shard->tablemask; i++) mmf_atomic_store32(&shard->table[i], 0);
+  shard->tombs = 0;
+  for (i = 0; i < c->pershard; i++) {
+    struct MMFCACHEWIN_impl* w = &shard->windows[i];
+    if (w->mem != NULL) mmfcache_insert(shard, w, mmfcache_hash(w->file, w->index));
+  }
+}
+
+// Finds a window to reuse, with the shard locked: a never used one, or the
+// first unpinned one the CLOCK hand passes twice without a hit in between.
+static struct MMFCACHEWIN_impl* mmfcache_victim(MMFCACHE* c, struct mmfcache_shard* shard)
+{
+  size_t step, i;
+
+  for (step = 0; step < 2 * c->pershard; step++) {
+    struct MMFCACHEWIN_impl* w = &shard->windows[shard->hand];
+    shard->hand = (shard->hand + 1) % c->pershard;
+    if (w->mem == NULL) return w;
+    if (mmf_atomic_load32(&w->referenced)) mmf_atomic_store32(&w->referenced, 0);
+    else if (mmf_atomic_cas32(&w->refs, 0, MMFCACHE_DEAD)) {
+      uint64_t hash = mmfcache_hash(w->file, w->index);
+      for (i = 0; i <= shard->tablemask; i++) {
+        uint32_t* slot = &shard->table[(hash + i) & shard->tablemask];
+        if (*slot == (uint32_t)(w - shard->windows) + 1) {
+          mmf_atomic_store32(slot, MMFCACHE_TOMB);
+          shard->tombs++;
+          break;
+        }
+      }
+      mmf_source_unmap(w->mem, w->len);
+      w->mem = NULL;
+      if (shard->tombs > (shard->tablemask + 1) / 4) mmfcache_rehash(c, shard);
+      return w;
+    }
+  }
+  return NULL;
+}
+
+MMFCACHE* mmfcache_open(const char* const* names, size_t n, size_t window_size, size_t max_len, size_t budget)
+{
+  MMFCACHE* ret = NULL;
+  MMFCACHE* c = calloc(1, sizeof(*c));
+  size_t granularity = mmf_granularity(), capacity, tablesize, i, j;
+  bool ok = c != NULL;
+
+  if (ok) {
+    // Windows start on mapping boundaries
+    c->window_size = window_size < granularity ? granularity : (window_size + granularity - 1) / granularity * granularity;
+    c->max_len = max_len;
+    capacity = budget / (c->window_size + max_len);
+    if (capacity == 0) {
+      mmfseterror("could not open cache: budget is smaller than a window of %llu bytes",
+                  (unsigned long long)(c->window_size + max_len));
+      free(c);
+      return NULL;
+    }
+    // Shards of a few windows would run out of unpinned ones too easily
+    c->nshards = capacity / 16 < MMFCACHE_SHARDS ? (capacity / 16 > 0 ? capacity / 16 : 1) : MMFCACHE_SHARDS;
+    c->pershard = capacity / c->nshards > 0 ? capacity / c->nshards : 1;
+    for (tablesize = 2; tablesize < 2 * c->pershard; tablesize *= 2);
+    c->files = calloc(n > 0 ? n : 1, sizeof(*c->files));
+    c->shards = calloc(c->nshards, sizeof(*c->shards));
+    ok = c->files != NULL && c->shards != NULL;
+    for (i = 0; ok && i < c->nshards; i++) {
+      struct mmfcache_shard* shard = &c->shards[i];
+      shard->windows = calloc(c->pershard, sizeof(*shard->windows));
+      shard->table = calloc(tablesize, sizeof(*shard->table));
+      shard->tablemask = tablesize - 1;
+      ok = shard->windows != NULL && shard->table != NULL;
+      for (j = 0; ok && j < c->pershard; j++) shard->windows[j].refs = MMFCACHE_DEAD;
+    }
+    if (!ok) mmfseterror("could not allocate space for MMFCACHE: %s", strerror(errno));
+  } else mmfseterror("could not allocate space for MMFCACHE: %s", strerror(errno));
+
+  for (i = 0; ok && i < n; i++) {
+    ok = mmf_source_open(names[i], &c->files[i]);
+    if (ok) c->nfiles++;
+  }
+
+  if (ok) ret = c;
+  else if (c != NULL) mmfcache_close(c);
+  return ret;
+}
+
+const void* mmfcache_get(MMFCACHE* c, size_t file, uint64_t offset, size_t len, MMFCACHEWIN** win)
+{
+  const void* ret = NULL;
+  uint64_t index = offset / c->window_size, hash;
+  struct mmfcache_shard* shard;
+  struct MMFCACHEWIN_impl* w = NULL;
+
+  if (file >= c->nfiles) {
+    mmfseterror("could not get range: there is no file %llu", (unsigned long long)file);
+    return NULL;
+  }
+  if (len > c->max_len || offset > c->files[file].size || len > c->files[file].size - offset) {
+    mmfseterror("could not get range: it is longer than the cache allows or ends past the end of file");
+    return NULL;
+  }
+
+  hash = mmfcache_hash(file, index);
+  shard = &c->shards[(hash >> 32) % c->nshards];
+  w = mmfcache_find(shard, hash, file, index);
+  if (w == NULL) {
+    while (!mmf_atomic_cas32(&shard->lock, 0, 1)) mmf_yield();
+    // Another thread may have mapped it while this one waited
+    w = mmfcache_find(shard, hash, file, index);
+    if (w == NULL) {
+      w = mmfcache_victim(c, shard);
+      if (w != NULL) {
+        uint64_t start = index * c->window_size;
+        size_t maplen = c->files[file].size - start < c->window_size + c->max_len ?
+                        (size_t)(c->files[file].size - start) : c->window_size + c->max_len;
+        w->mem = mmf_source_map(&c->files[file], start, maplen);
+        if (w->mem != NULL) {
+          w->file = file;
+          w->index = index;
+          w->len = maplen;
+          mmf_atomic_store32(&w->referenced, 1);
+          mmf_atomic_store32(&w->refs, 1);
+          mmfcache_insert(shard, w, hash);
+        }
+        else w = NULL;
+      } else mmfseterror("could not get range: every window of its shard is pinned");
+    }
+    mmf_atomic_store32(&shard->lock, 0);
+  }
+  else if (!mmf_atomic_load32(&w->referenced)) mmf_atomic_store32(&w->referenced, 1);
+
+  if (w != NULL) {
+    ret = w->mem + (offset - index * c->window_size);
+    *win = w;
+  }
+  return ret;
+}
+
+void mmfcache_unpin(MMFCACHEWIN* win)
+{
+  mmfcache_unpin_window(win);
+}
+
+void mmfcache_close(MMFCACHE* c)
+{
+  size_t i, j;
+
+  for (i = 0; c->shards != NULL && i < c->nshards; i++) {
+    for (j = 0; c->shards[i].windows != NULL && j < c->pershard; j++) {
+      if (c->shards[i].windows[j].mem != NULL) mmf_source_unmap(c->shards[i].windows[j].mem, c->shards[i].windows[j].len);
+    }
+    free(c->shards[i].windows);
+    free(c->shards[i].table);
+  }
+  for (i = 0; i < c->nfiles; i++) mmf_source_close(&c->files[i]);
+  free(c->shards);
+  free(c->files);
+  free(c);
+}
+
+// ----------------------------------------------------------------------------
+// Tiered locking. Sampled access offsets are counted per region; the regions
+// hit most often are locked and the rest of the mapping is unlocked, so that
+// calling it again with fresh samples moves the locks along with the hot
+// set. No more regions are locked than RLIMIT_MEMLOCK allows.
+// ----------------------------------------------------------------------------
+
+struct mmfhot_region {
+  size_t index;
+  size_t count;
+};
+
+static int mmfhot_compare_indices(const void* a, const void* b)
+{
+  size_t x = *(const size_t*)a, y = *(const size_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+static int mmfhot_compare_regions(const void* a, const void* b)
+{
+  const struct mmfhot_region* x = a;
+  const struct mmfhot_region* y = b;
+  // Most hit first, ties in file order
+  if (x->count != y->count) return x->count > y->count ? -1 : 1;
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static int mmfhot_compare_positions(const void* a, const void* b)
+{
+  size_t x = ((const struct mmfhot_region*)a)->index, y = ((const struct mmfhot_region*)b)->index;
+  return x < y ? -1 : x > y;
+}
+
+int mmflock_hot(MMFILE* mmf, const size_t* samples, size_t nsamples, size_t region_size, size_t topn, int flags)
+{
+  int ret = -1;
+  size_t granularity = mmf_granularity(), size = mmfsize(mmf);
+  size_t* indices = malloc((nsamples > 0 ? nsamples : 1) * sizeof(*indices));
+  struct mmfhot_region* regions = malloc((nsamples > 0 ? nsamples : 1) * sizeof(*regions));
+  size_t n = 0, nregions = 0, i, pos, end;
+
+  if (region_size == 0) mmfseterror("could not lock hot regions: region size is zero");
+  else if (indices != NULL && regions != NULL) {
+    // Whole pages, so that unlocking a cold region never touches a hot one
+    region_size = (region_size + granularity - 1) / granularity * granularity;
+    for (i = 0; i < nsamples; i++) {
+      if (samples[i] < size) indices[n++] = samples[i] / region_size;
+    }
+    qsort(indices, n, sizeof(*indices), mmfhot_compare_indices);
+    for (i = 0; i < n; i++) {
+      if (nregions > 0 && regions[nregions - 1].index == indices[i]) regions[nregions - 1].count++;
+      else {
+        regions[nregions].index = indices[i];
+        regions[nregions].count = 1;
+        nregions++;
+      }
+    }
+    qsort(regions, nregions, sizeof(*regions), mmfhot_compare_regions);
+    if (topn > nregions) topn = nregions;
+    if (topn > mmf_lock_limit() / region_size) topn = mmf_lock_limit() / region_size;
+    qsort(regions, topn, sizeof(*regions), mmfhot_compare_positions);
+
+    ret = 0;
+    for (i = 0, pos = 0; ret == 0 && i < topn; i++) {
+      size_t first = regions[i].index;
+      // Neighbouring hot regions are locked with one call
+      while (i + 1 < topn && regions[i + 1].index == regions[i].index + 1) i++;
+      end = (regions[i].index + 1) * region_size < size ? (regions[i].index + 1) * region_size : size;
+      if (first * region_size > pos) ret = mmfunlock(mmf, pos, first * region_size - pos);
+      if (ret == 0) ret = mmflock(mmf, first * region_size, end - first * region_size, flags);
+      pos = end;
+    }
+    if (ret == 0 && pos < size) ret = mmfunlock(mmf, pos, size - pos);
+  } else mmfseterror("could not allocate space for access samples: %s", strerror(errno));
+
+  free(indices);
+  free(regions);
+  return ret;
+}
 
 #undef LASTERROR
+#undef MMFKIND_MAPPED
+#undef MMFKIND_CONCAT
+#undef MMFKIND_COMPRESSED
+#undef MMFKIND_LOADED
 #undef OPENMODE_INVALID
 #undef OPENMODE_READONLY
 #undef OPENMODE_WRITEONLY
 #undef OPENMODE_READWRITE
+#undef OPENMODE_COMPRESSED
+#undef OPENMODE_DONTFORK
+#undef OPENMODE_DONTDUMP
+#undef OPENMODE_LOAD
+#undef OPENMODE_ADVICES
 
 #endif // MMFIO_IMPLEMENTATION